@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "instruction.h"
 
@@ -28,6 +29,20 @@ struct chip8asm_options {
     bool shift_quirks;
 };
 
+/**
+ * A label attached to an instruction in an assembled program.
+ */
+struct chip8asm_symbol {
+    /**
+     * The name of the label.
+     */
+    char *name;
+    /**
+     * The address of the instruction (in Chip-8 memory).
+     */
+    uint16_t addr;
+};
+
 /**
  * An assembled Chip-8 program.
  */
@@ -43,6 +58,18 @@ struct chip8asm_program {
      * The length of the assembled program.
      */
     size_t len;
+    /**
+     * The labels attached to instructions in the program, in the order in
+     * which they were defined.
+     *
+     * Labels defined using `=` or `DEFINE` are not included, since they need
+     * not refer to addresses at all.
+     */
+    struct chip8asm_symbol *symbols;
+    /**
+     * The number of symbols.
+     */
+    size_t n_symbols;
 };
 
 /**
@@ -119,5 +146,15 @@ void chip8asm_program_destroy(struct chip8asm_program *prog);
  */
 uint16_t chip8asm_program_opcode(
     const struct chip8asm_program *prog, uint16_t addr);
+/**
+ * Writes the symbols of the given program to the given file as a symbol map.
+ *
+ * Each line of the map holds the address of a symbol (in hexadecimal) and its
+ * name, separated by a space.
+ *
+ * @return An error code.
+ */
+int chip8asm_program_write_symbols(
+    const struct chip8asm_program *prog, FILE *output);
 
 #endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Handing frames and input between an emulation thread and a presentation
+ * thread.
+ *
+ * When the interpreter runs on a thread of its own, neither side should ever
+ * have to wait for the other: a slow window system mustn't hold up the game,
+ * and a busy game mustn't hold up the window.  Finished frames are therefore
+ * passed to the presentation thread through a triple buffer, where the
+ * emulation thread always has a buffer to write to and the presentation
+ * thread always gets the latest frame (skipping any it was too slow to see).
+ * Input goes the other way through a single-producer, single-consumer queue.
+ * Neither uses any locks.
+ */
+#ifndef CHIP8_HANDOFF_H
+#define CHIP8_HANDOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * A snapshot of everything needed to present one frame of a game.
+ */
+struct chip8_frame {
+    /**
+     * The contents of the display, as in `struct chip8`.
+     */
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WORDS];
+    /**
+     * The rows of the display which have changed since the previous frame
+     * (bit `y` is set if row `y` has changed), as for `chip8_take_dirty_rows`.
+     *
+     * When frames go through a triple buffer, this also covers any frames
+     * which the reader skipped (see `chip8_triple_buffer_publish`).
+     */
+    uint64_t dirty_rows;
+    /**
+     * Whether the display is in high-resolution mode.
+     */
+    bool highres;
+    /**
+     * Whether the sound timer is active.
+     */
+    bool sound;
+    /**
+     * Whether the interpreter has halted.
+     */
+    bool halted;
+    /**
+     * Whether this is the last frame which will be published (for example,
+     * because the game has halted or stopped with an error).
+     */
+    bool last;
+    /**
+     * The number of the frame, counting from 0.
+     */
+    unsigned long number;
+};
+
+/**
+ * A triple buffer of frames.
+ */
+struct chip8_triple_buffer;
+
+/**
+ * The kinds of input which can be sent to the emulation thread.
+ */
+enum chip8_input_type {
+    /**
+     * The key `key` was pressed.
+     */
+    CHIP8_INPUT_KEY_DOWN,
+    /**
+     * The key `key` was released.
+     */
+    CHIP8_INPUT_KEY_UP,
+    /**
+     * The game state should be saved to the checkpoint file.
+     */
+    CHIP8_INPUT_SAVE_STATE,
+    /**
+     * The game state should be restored from the checkpoint file.
+     */
+    CHIP8_INPUT_LOAD_STATE,
+    /**
+     * The game should start running backwards through its history.
+     */
+    CHIP8_INPUT_REWIND_START,
+    /**
+     * The game should stop running backwards.
+     */
+    CHIP8_INPUT_REWIND_STOP,
+    /**
+     * The emulation thread should stop.
+     */
+    CHIP8_INPUT_QUIT,
+};
+
+/**
+ * A single input event.
+ */
+struct chip8_input {
+    enum chip8_input_type type;
+    /**
+     * The Chip-8 key (0 to F) pressed or released, if any.
+     */
+    uint8_t key;
+};
+
+/**
+ * A queue of input events, which may be used by one producer thread and one
+ * consumer thread at the same time.
+ */
+struct chip8_input_queue;
+
+/**
+ * Copies the state needed to present the current frame of the given
+ * interpreter.
+ *
+ * The interpreter's changed rows are taken (see `chip8_take_dirty_rows`), so
+ * each frame only holds the rows changed since the one captured before it.
+ */
+void chip8_frame_capture(struct chip8_frame *frame, struct chip8 *chip);
+/**
+ * Returns whether the pixel at the given position is on, as for
+ * `chip8_get_pixel`.
+ */
+bool chip8_frame_get_pixel(const struct chip8_frame *frame, int x, int y);
+/**
+ * Converts the visible part of a frame into 32-bit pixels, using the given
+ * values for pixels which are on and off.
+ *
+ * In high-resolution mode, the whole display (`CHIP8_DISPLAY_WIDTH` by
+ * `CHIP8_DISPLAY_HEIGHT` pixels) is visible; in low-resolution mode, only the
+ * top-left quarter is.  This is all a renderer needs to do in software, so
+ * any scaling can be left to the graphics hardware.
+ *
+ * @param pitch The distance between the starts of consecutive rows of
+ * `pixels`, in bytes.
+ */
+void chip8_frame_to_pixels(const struct chip8_frame *frame, uint32_t *pixels,
+    size_t pitch, uint32_t on, uint32_t off);
+
+/**
+ * Returns a new triple buffer, in which no frame has been published yet.
+ */
+struct chip8_triple_buffer *chip8_triple_buffer_new(void);
+void chip8_triple_buffer_destroy(struct chip8_triple_buffer *buf);
+/**
+ * Returns the frame which the writer should fill in next.
+ *
+ * The frame belongs to the writer until it is published, and its contents
+ * are unspecified (it may hold any earlier frame).
+ */
+struct chip8_frame *chip8_triple_buffer_back(struct chip8_triple_buffer *buf);
+/**
+ * Publishes the frame returned by `chip8_triple_buffer_back`, replacing any
+ * published frame which the reader hasn't taken yet.
+ *
+ * The frame's changed rows are extended to cover every frame published since
+ * the one the reader is last known to have taken, so that the reader never
+ * misses a change, even in frames it skips.  (A frame may therefore repeat
+ * some changes which the reader has already seen.)
+ */
+void chip8_triple_buffer_publish(struct chip8_triple_buffer *buf);
+/**
+ * Takes the most recently published frame.
+ *
+ * The frame belongs to the reader until the next call.
+ *
+ * @return The frame, or NULL if nothing has been published since the last
+ * call.
+ */
+const struct chip8_frame *chip8_triple_buffer_take(
+    struct chip8_triple_buffer *buf);
+
+/**
+ * Returns a new, empty input queue with room for at least `capacity` events.
+ */
+struct chip8_input_queue *chip8_input_queue_new(size_t capacity);
+void chip8_input_queue_destroy(struct chip8_input_queue *queue);
+/**
+ * Adds an event to the end of the queue (from the producer thread).
+ *
+ * @return Whether there was room for the event.
+ */
+bool chip8_input_queue_push(
+    struct chip8_input_queue *queue, struct chip8_input input);
+/**
+ * Removes an event from the front of the queue (from the consumer thread).
+ *
+ * @return Whether there was an event to remove.
+ */
+bool chip8_input_queue_pop(
+    struct chip8_input_queue *queue, struct chip8_input *input);
+
+#endif
@@ -380,6 +380,10 @@ enum chip8_operation {
      */
     OP_LD_REG_R,
 };
+/**
+ * The number of values in `enum chip8_operation` (including `OP_INVALID`).
+ */
+#define CHIP8_OP_COUNT (OP_LD_REG_R - OP_INVALID + 1)
 
 /**
  * A complete Chip-8 instruction (operation and arguments).
@@ -428,5 +432,10 @@ uint16_t chip8_instruction_to_opcode(struct chip8_instruction instr);
  * Returns whether the given instruction takes an address operand.
  */
 bool chip8_instruction_uses_addr(struct chip8_instruction instr);
+/**
+ * Returns a description of the form of the given operation, such as
+ * "LD Vx, byte" for `OP_LD_BYTE`.
+ */
+const char *chip8_operation_name(enum chip8_operation op);
 
 #endif
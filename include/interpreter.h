@@ -18,14 +18,68 @@
 #include <time.h>
 
 #include "instruction.h"
+#include "jit.h"
+#include "trace.h"
 
 #define CHIP8_DISPLAY_WIDTH 128
 #define CHIP8_DISPLAY_HEIGHT 64
+/**
+ * The number of 64-bit words in each row of the display.
+ */
+#define CHIP8_DISPLAY_WORDS (CHIP8_DISPLAY_WIDTH / 64)
+/**
+ * The number of instruction slots in memory.
+ *
+ * Instructions are always aligned on a 2-byte boundary, so there is one slot
+ * for every valid program counter value.
+ */
+#define CHIP8_INSTR_SLOTS (CHIP8_MEM_SIZE / 2)
+/**
+ * The maximum supported depth of the call stack.
+ */
+#define CHIP8_STACK_MAX 256
+/**
+ * How often instructions are timed when profiling (one in this many).
+ */
+#define CHIP8_PROFILE_SAMPLE_INTERVAL 16
 
 /**
- * A node in a linked list which functions as a call stack.
+ * The reasons why `chip8_run_until` can stop executing instructions.
+ *
+ * Each reason is a separate bit, so that they can be combined into a mask
+ * specifying which conditions should stop execution.
  */
-struct chip8_call_node;
+enum chip8_stop_reason {
+    /**
+     * The requested number of cycles has been executed (only reported if
+     * nothing else stopped execution).
+     */
+    CHIP8_STOP_CYCLES = 1 << 0,
+    /**
+     * A frame (one tick of the timer) has ended.
+     */
+    CHIP8_STOP_FRAME = 1 << 1,
+    /**
+     * The interpreter has halted (using the EXIT instruction).
+     */
+    CHIP8_STOP_HALT = 1 << 2,
+    /**
+     * The program is waiting for a key press (using LD VX, K).
+     */
+    CHIP8_STOP_KEY_WAIT = 1 << 3,
+    /**
+     * An instruction which modifies the display has been executed.
+     */
+    CHIP8_STOP_DRAW = 1 << 4,
+    /**
+     * The program counter has reached a breakpoint.
+     */
+    CHIP8_STOP_BREAKPOINT = 1 << 5,
+    /**
+     * An error occurred during execution.
+     */
+    CHIP8_STOP_ERROR = 1 << 6,
+};
 
 /**
  * Options which can be given to the interpreter.
@@ -61,10 +115,148 @@ struct chip8_options {
      * given as an argument.
      */
     bool shift_quirks;
+    /**
+     * Whether to compile straight-line sections of code to native code
+     * (default false).
+     *
+     * This is only supported on some platforms (see jit.h); elsewhere, a
+     * warning is logged and the interpreter is used as usual.  Compiled code
+     * is only ever used by `chip8_run`, since there is nothing to gain from it
+     * when executing a single instruction at a time.
+     */
+    bool jit;
     /**
      * The frequency at which to run the game (default 60Hz).
      */
     unsigned long timer_freq;
+    /**
+     * Whether to use a virtual clock for the timers (default false).
+     *
+     * Normally, the delay and sound timers count down in real time, and the
+     * interpreter sleeps between instructions to keep the game running at a
+     * reasonable speed.  When using a virtual clock, time is instead measured
+     * in executed instructions: the timers tick once every `cycles_per_frame`
+     * instructions, and the interpreter never sleeps or consults the system
+     * clock.  This makes execution fully reproducible, and lets it run as
+     * fast as the host allows.
+     *
+     * This has no effect if the timer is disabled.
+     */
+    bool virtual_clock;
+    /**
+     * The number of instructions to execute per timer tick when using a
+     * virtual clock (default 100).
+     */
+    unsigned long cycles_per_frame;
+    /**
+     * Whether to skip through idle loops (default true).
+     *
+     * A loop which only waits for the delay timer or a key can't do anything
+     * new until the next tick, so the interpreter sleeps until then (with the
+     * system clock) or counts the remaining iterations as executed without
+     * running them (with a virtual clock).  The results are the same either
+     * way, but benchmarks which want to measure how fast instructions are
+     * actually executed should turn this off.
+     */
+    bool skip_idle;
+    /**
+     * The maximum number of nested subroutine calls (default 16, as on the
+     * original hardware).
+     *
+     * This is limited to `CHIP8_STACK_MAX`.
+     */
+    unsigned stack_depth;
+    /**
+     * The seed for the random number generator used by the RND instruction
+     * (default 0).
+     *
+     * Two interpreters with the same seed will produce the same sequence of
+     * random numbers, so a program can be run reproducibly (together with
+     * `virtual_clock`).  Frontends which want a different sequence every time
+     * should set this to something like the current time.
+     */
+    uint64_t seed;
+    /**
+     * Whether to collect a profile of the instructions executed (default
+     * false).
+     *
+     * Profiling runs the program one instruction at a time, so it is much
+     * slower than usual, but when it is disabled it costs nothing.  See
+     * `chip8_get_profile`.
+     */
+    bool profile;
+};
+
+/**
+ * Execution statistics collected when profiling is enabled.
+ *
+ * The per-operation arrays are indexed by `op - OP_INVALID`.  Counting every
+ * instruction is cheap, but timing is not, so only one instruction in every
+ * `CHIP8_PROFILE_SAMPLE_INTERVAL` is timed.
+ */
+struct chip8_profile {
+    /**
+     * The number of times each operation was executed.
+     */
+    uint64_t counts[CHIP8_OP_COUNT];
+    /**
+     * The number of executions of each operation which were timed.
+     */
+    uint64_t samples[CHIP8_OP_COUNT];
+    /**
+     * The total host time taken by the timed executions of each operation, in
+     * nanoseconds.
+     */
+    uint64_t nanos[CHIP8_OP_COUNT];
+    /**
+     * The number of times the instruction at each address was executed,
+     * indexed by address / 2.
+     */
+    uint64_t addr_counts[CHIP8_INSTR_SLOTS];
+};
+
+/**
+ * A pristine copy of the interpreter memory with a game loaded, from which
+ * interpreters can be reset quickly (see `chip8_reset`).
+ */
+struct chip8_image {
+    /**
+     * The contents of memory, including the hex sprites and the game.
+     */
+    uint8_t mem[CHIP8_MEM_SIZE];
+    /**
+     * The length of the game, in bytes.
+     */
+    size_t len;
+};
+
+/**
+ * A pool of interpreter instances, allocated together in a single block.
+ */
+struct chip8_pool;
+
+/**
+ * An instruction in the decode cache.
+ *
+ * This holds the same information as `struct chip8_instruction`, packed into
+ * 4 bytes so that the cache for a whole interpreter is only 8 KiB.
+ */
+struct chip8_decoded {
+    /**
+     * The operation (an `enum chip8_operation`).
+     */
+    signed int op : 8;
+    /**
+     * The registers, which are taken from the usual places in the opcode
+     * whether or not the operation uses them.
+     */
+    unsigned int vx : 4;
+    unsigned int vy : 4;
+    /**
+     * The address, byte or nibble argument of the operation, or the whole
+     * opcode if it is invalid.
+     */
+    unsigned int arg : 16;
 };
 
 /**
@@ -80,12 +272,13 @@ struct chip8 {
      */
     uint8_t mem[CHIP8_MEM_SIZE];
     /**
-     * The display.
+     * The display, stored as one bit per pixel.
      *
-     * Each element in the display array is a boolean value specifying whether
-     * that pixel is on or off.
+     * Each row is made up of `CHIP8_DISPLAY_WORDS` words, going from left to
+     * right; within each word, the most significant bit is the leftmost
+     * pixel.  Use `chip8_get_pixel` to read individual pixels.
      */
-    bool display[CHIP8_DISPLAY_WIDTH][CHIP8_DISPLAY_HEIGHT];
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WORDS];
     /**
      * The general-purpose registers `V0`-`VF`.
      */
@@ -119,34 +312,97 @@ struct chip8 {
      */
     bool highres;
     /**
-     * The function to be called every time a pixel needs to be redrawn.  It
-     * accepts as parameters the x and y coordinates of the pixel, whether the
-     * pixel should be turned on and whether it should be drawn in
-     * high-resolution mode.
-     */
-    void (*draw_callback)(int x, int y, bool on, bool high);
-    /**
-     * Whether the external display needs to be completely redrawn (e.g. after
-     * changing between high- and low-resolution modes.
+     * The rows of the display which have changed since the last call to
+     * `chip8_take_dirty_rows` (bit `y` is set if row `y` has changed).
+     *
+     * Every row is marked as changed when the interpreter is created and
+     * whenever the whole display is affected (e.g. when scrolling or changing
+     * between high- and low-resolution modes).
      */
-    bool needs_full_redraw;
+    uint64_t dirty_rows;
     /**
      * The internal timer, in ticks.
      *
      * The frequency of these ticks is configured in the options passed to the
-     * `chip8_new` function.
+     * `chip8_new` function.  When using a virtual clock, this is the number of
+     * ticks since the interpreter was created.
      */
     unsigned long timer_ticks;
+    /**
+     * The number of instructions executed since the last tick (only used with
+     * a virtual clock).
+     */
+    unsigned long tick_cycles;
+    /**
+     * The total number of instructions executed.
+     */
+    uint64_t cycles;
+    /**
+     * The total number of sprites drawn (using DRW).
+     */
+    uint64_t draws;
     /**
      * The call stack (for returning from subroutines).
+     *
+     * Each element is the address of a CALL instruction; only the first
+     * `stack_size` are in use.
+     */
+    uint16_t call_stack[CHIP8_STACK_MAX];
+    /**
+     * The number of entries in the call stack.
      */
-    struct chip8_call_node *call_stack;
+    unsigned stack_size;
     /**
      * Which keys are currently being pressed.
      *
      * Each bit (0x0-0xF) represents the state of the corresponding key 0-F.
      */
     uint16_t key_states;
+    /**
+     * The state of the random number generator used by the RND instruction.
+     *
+     * Each interpreter has its own generator, so that several of them can run
+     * at the same time in different threads.
+     */
+    uint64_t rand_state;
+    /**
+     * The decoded instruction cache.
+     *
+     * Slot `n` holds the decoded form of the instruction at address `2 * n`.
+     * Its contents are only meaningful if the corresponding entry in
+     * `decoded` is set; slots are filled lazily as instructions are executed.
+     */
+    struct chip8_decoded decode_cache[CHIP8_INSTR_SLOTS];
+    /**
+     * Whether each slot in `decode_cache` is valid.
+     *
+     * Anything which modifies the contents of `mem` must clear the affected
+     * slots using `chip8_invalidate_code`, or else stale instructions may be
+     * executed.
+     */
+    bool decoded[CHIP8_INSTR_SLOTS];
+    /**
+     * Whether there is a breakpoint on each instruction slot.
+     *
+     * Slots with a breakpoint are never marked as decoded, so that the
+     * interpreter only needs to check for breakpoints when it misses the
+     * decode cache.
+     */
+    bool breakpoints[CHIP8_INSTR_SLOTS];
+    /**
+     * The recompiler, or NULL if JIT compilation is disabled.
+     */
+    struct chip8_jit *jit;
+    /**
+     * The execution profile, or NULL if profiling is disabled.
+     */
+    struct chip8_profile *profile;
+    /**
+     * The trace to which executed instructions are recorded, or NULL.
+     *
+     * This is owned by the caller (see `chip8_set_trace`).
+     */
+    struct chip8_trace *trace;
 };
 
 /**
@@ -156,11 +412,101 @@ struct chip8_options chip8_options_default(void);
 
 struct chip8 *chip8_new(struct chip8_options opts);
 void chip8_destroy(struct chip8 *chip);
+/**
+ * Puts the interpreter back into the state it was in when it was created,
+ * with the given image (or, if it is NULL, nothing) loaded into memory.
+ *
+ * This is much cheaper than destroying the interpreter and creating a new
+ * one, and is meant for running the same game many times over.  The options
+ * are those in `chip->opts`, so the seed (for example) can be changed before
+ * resetting.  Breakpoints, the profile and the trace are left alone.
+ */
+void chip8_reset(struct chip8 *chip, const struct chip8_image *image);
+/**
+ * Creates an image of memory with the given game loaded, for use with
+ * `chip8_reset`.
+ *
+ * @return An error code.
+ */
+int chip8_image_init(
+    struct chip8_image *image, const uint8_t *bytes, size_t len);
+
+/**
+ * Creates a pool which can hold up to the given number of instances.
+ *
+ * The instances are allocated up front in one block, each aligned on a cache
+ * line so that instances used by different threads never share one.
+ */
+struct chip8_pool *chip8_pool_new(size_t capacity);
+/**
+ * Frees the pool and every instance in it (whether or not it has been
+ * returned with `chip8_pool_free`).
+ */
+void chip8_pool_destroy(struct chip8_pool *pool);
+/**
+ * Takes an instance from the pool and sets it up as `chip8_new` would,
+ * followed by `chip8_reset` with the given image (which may be NULL).
+ *
+ * An instance which has been used before keeps its recompiler and profile
+ * (cleared, of course) if the new options want them, so that taking and
+ * returning instances over and over is cheap.  This may be called from
+ * several threads at once.
+ *
+ * @return The instance, or NULL if every instance in the pool is in use.
+ */
+struct chip8 *chip8_pool_alloc(struct chip8_pool *pool,
+    struct chip8_options opts, const struct chip8_image *image);
+/**
+ * Returns an instance taken from the pool, so that it can be used again.
+ *
+ * An instance from a pool must be returned using this function rather than
+ * `chip8_destroy`.
+ */
+void chip8_pool_free(struct chip8_pool *pool, struct chip8 *chip);
 
 /**
  * Returns the current instruction.
  */
 struct chip8_instruction chip8_current_instr(struct chip8 *chip);
+/**
+ * Returns whether the pixel at the given coordinates is on.
+ */
+bool chip8_get_pixel(const struct chip8 *chip, int x, int y);
+/**
+ * Returns the rows of the display which have changed since the last call to
+ * this function (see `dirty_rows`), and marks them as clean.
+ *
+ * A frontend can call this once per frame and redraw only the rows which are
+ * returned, rather than the whole display.
+ */
+uint64_t chip8_take_dirty_rows(struct chip8 *chip);
+/**
+ * Invalidates the cached decoding of any instructions in the given memory
+ * range.
+ *
+ * This must be called after writing to `mem` directly if the modified memory
+ * might be executed later.
+ */
+void chip8_invalidate_code(struct chip8 *chip, uint16_t addr, size_t len);
+/**
+ * Brings the timer tick count up to date with the system clock without
+ * decrementing the timers.
+ *
+ * This should be called after the interpreter has been stopped for a while
+ * (or its state has been replaced), so that the time during which it wasn't
+ * running doesn't count against the game.  It has no effect with a virtual
+ * clock.
+ */
+void chip8_timer_sync(struct chip8 *chip);
+/**
+ * Sets or clears a breakpoint on the instruction at the given address.
+ *
+ * Breakpoints only have an effect on `chip8_run_until` when
+ * `CHIP8_STOP_BREAKPOINT` is part of the stop mask.
+ *
+ * @return An error code.
+ */
+int chip8_set_breakpoint(struct chip8 *chip, uint16_t addr, bool enabled);
 /**
  * Inserts and executes the given opcode at the current program location.
  *
@@ -172,18 +518,99 @@ int chip8_execute_opcode(struct chip8 *chip, uint16_t opcode);
  *
  * @return An error code.
  */
-int chip8_load_from_bytes(struct chip8 *chip, uint8_t *bytes, size_t len);
+int chip8_load_from_bytes(
+    struct chip8 *chip, const uint8_t *bytes, size_t len);
 /**
  * Loads a program in binary format from the given file.
  *
  * @return An error code.
  */
 int chip8_load_from_file(struct chip8 *chip, FILE *file);
+/**
+ * Loads a program in binary format from the file with the given name.
+ *
+ * This is the fastest way to load a program, since the file is mapped into
+ * memory and copied in one go (see `rom.h`).
+ *
+ * @return An error code.
+ */
+int chip8_load_from_path(struct chip8 *chip, const char *fname);
 /**
  * Executes the next instruction.
  *
  * @return An error code.
  */
 int chip8_step(struct chip8 *chip);
+/**
+ * Executes instructions until the interpreter halts, the program begins
+ * waiting for a key press, an error occurs or `max_cycles` instructions have
+ * been executed.
+ *
+ * Unlike `chip8_step`, this does not delay between instructions, so it runs
+ * the program as fast as possible.  Timers are still updated, if enabled.
+ *
+ * @return An error code.
+ */
+int chip8_run(struct chip8 *chip, unsigned long max_cycles);
+/**
+ * Executes instructions until one of the conditions in `stop_mask` occurs or
+ * `max_cycles` instructions have been executed.
+ *
+ * Halting and errors always stop execution, regardless of the mask.  If
+ * `CHIP8_STOP_KEY_WAIT` is not in the mask, a program waiting for a key press
+ * keeps executing the same instruction (and using up cycles) until a key is
+ * pressed, as it would on real hardware.  Execution stops before an
+ * instruction with a breakpoint, unless it is the first instruction executed,
+ * so that calling this function again resumes from the breakpoint.
+ *
+ * @param stop_mask The conditions which should stop execution, as a
+ * combination of `enum chip8_stop_reason` values.
+ *
+ * @return The reasons execution stopped (a combination of `enum
+ * chip8_stop_reason` values).
+ */
+unsigned chip8_run_until(
+    struct chip8 *chip, unsigned long max_cycles, unsigned stop_mask);
+/**
+ * Executes instructions until the end of the current frame.
+ *
+ * If the timer is disabled or the virtual clock is in use, a frame is limited
+ * to `cycles_per_frame` instructions.
+ *
+ * @return The reasons execution stopped, as for `chip8_run_until`.
+ */
+unsigned chip8_run_frame(struct chip8 *chip);
+/**
+ * Starts (or, if `trace` is NULL, stops) recording every instruction executed
+ * to the given trace.
+ *
+ * Like profiling, tracing slows down the interpreter considerably.  The trace
+ * is not closed when the interpreter is destroyed.
+ */
+void chip8_set_trace(struct chip8 *chip, struct chip8_trace *trace);
+/**
+ * Returns the execution profile collected so far, or NULL if profiling is
+ * disabled.
+ */
+const struct chip8_profile *chip8_get_profile(const struct chip8 *chip);
+/**
+ * Writes a table summarizing the given profile to the given file.
+ *
+ * Operations are listed from most to least frequently executed, along with
+ * the average host time taken by each one.
+ */
+void chip8_profile_print(const struct chip8_profile *profile, FILE *output);
+/**
+ * Writes the per-address execution counts in the given profile (a "heat map")
+ * to the file with the given name.
+ *
+ * Each line of the file holds an address in hexadecimal and the number of
+ * times the instruction there was executed, separated by a space.  Addresses
+ * which were never executed are left out.
+ *
+ * @return An error code.
+ */
+int chip8_profile_save_heatmap(
+    const struct chip8_profile *profile, const char *fname);
 
 #endif
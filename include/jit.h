@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * A simple dynamic recompiler for the interpreter.
+ *
+ * The recompiler translates basic blocks of straight-line Chip-8 instructions
+ * (currently, those which only operate on registers) into native code, which
+ * the interpreter can then call instead of executing each instruction in
+ * turn.  Everything else (control flow, drawing, memory access) is left to the
+ * interpreter, so a block always ends just before the first instruction which
+ * it can't translate.
+ *
+ * Native code generation is only supported on x86-64; on other platforms,
+ * `chip8_jit_new` will always fail and the interpreter is used for
+ * everything.
+ */
+#ifndef CHIP8_JIT_H
+#define CHIP8_JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct chip8;
+
+/**
+ * A compiled block of instructions.
+ */
+struct chip8_jit_block {
+    /**
+     * The number of instructions in the block.
+     */
+    unsigned len;
+    /**
+     * The compiled code, which executes every instruction in the block on the
+     * given interpreter.
+     *
+     * The code only updates the interpreter state (registers, timers, etc.):
+     * it is up to the caller to advance the program counter past the end of
+     * the block.
+     */
+    void (*code)(struct chip8 *chip);
+};
+
+/**
+ * Contains the state of the recompiler (the compiled blocks and the memory
+ * where their code is stored).
+ */
+struct chip8_jit;
+
+/**
+ * Returns whether native code generation is supported on this platform.
+ */
+bool chip8_jit_supported(void);
+/**
+ * Creates a new recompiler.
+ *
+ * @return The new recompiler, or NULL if native code generation is not
+ * supported or memory for the generated code could not be obtained.
+ */
+struct chip8_jit *chip8_jit_new(void);
+void chip8_jit_destroy(struct chip8_jit *jit);
+
+/**
+ * Returns the compiled block starting at the given address, compiling it
+ * first if necessary.
+ *
+ * @return The block, or NULL if no block can be compiled at the given address
+ * (for example, if the instruction there isn't supported by the recompiler).
+ */
+const struct chip8_jit_block *chip8_jit_block(
+    struct chip8_jit *jit, const struct chip8 *chip, uint16_t addr);
+/**
+ * Discards any compiled code which depends on the given memory range.
+ *
+ * This must be called whenever the interpreter memory is modified.
+ */
+void chip8_jit_invalidate(struct chip8_jit *jit, uint16_t addr, size_t len);
+
+#endif
@@ -8,6 +8,17 @@
 /**
  * @file
  * General logging utilities.
+ *
+ * Logging is asynchronous: each message is formatted by the thread which logs
+ * it and pushed onto a lock-free queue, and a background writer thread takes
+ * messages off the queue and writes them to the output file.  This keeps slow
+ * output (such as a terminal) from holding up the interpreter, and means that
+ * a message is always written as a whole, even if it was built up in several
+ * parts.  Messages are flushed when the program exits normally (including
+ * through `die`), and can be flushed at any other time using `log_flush`.
+ *
+ * Messages less urgent than `CHIP8_LOG_MAX_LEVEL` are removed at compile time,
+ * so that they cost nothing at all in release builds.
  */
 #ifndef CHIP8_LOG_H
 #define CHIP8_LOG_H
@@ -29,12 +40,31 @@ enum log_level {
     LOG_TRACE,
 };
 
+#ifndef CHIP8_LOG_MAX_LEVEL
+/**
+ * The least urgent log level which is compiled in.
+ *
+ * Calls to the logging macros for less urgent levels compile to nothing (and
+ * their arguments are not evaluated).  This is normally set by the build
+ * system.
+ */
+#define CHIP8_LOG_MAX_LEVEL LOG_TRACE
+#endif
+/**
+ * Returns whether messages at the given level are compiled in.
+ */
+#define LOG_COMPILED(level) ((level) <= CHIP8_LOG_MAX_LEVEL)
+
 /**
  * Initializes the logging system.
  *
  * Until this function is called, you won't see any log messages, but nothing
  * (else) bad will happen.
  *
+ * Messages may be logged from any thread, but the logging system should only
+ * be configured (using this function, `log_set_level` and `log_set_output`)
+ * while no other threads are logging.
+ *
  * @param progname The name of the program to display in messages.
  * @param output The output file to use for log messages.
  * @param max The initial maximum log level to display.
@@ -58,6 +88,10 @@ void log_set_level(enum log_level max);
  * anywhere.
  */
 void log_set_output(FILE *output);
+/**
+ * Waits until every message logged so far has been written to the output.
+ */
+void log_flush(void);
 
 /**
  * Logs a formatted message using the logging system.
@@ -70,6 +104,11 @@ void log_set_output(FILE *output);
 void log_message(enum log_level level, const char *fmt, ...);
 /**
  * Begins a multi-part log message.
+ *
+ * The parts of the message are collected in a buffer belonging to the calling
+ * thread, and the whole message is logged when it is ended using
+ * `log_message_end`, so messages from other threads can't get mixed up with
+ * it.
  */
 void log_message_begin(enum log_level level);
 /**
@@ -80,26 +119,31 @@ void log_message_part(const char *fmt, ...);
  * Ends a multi-part log message.
  */
 void log_message_end(void);
+/**
+ * Logs a message at the given level if that level is compiled in.
+ */
+#define log_at(level, ...)                                                     \
+    (LOG_COMPILED(level) ? log_message((level), __VA_ARGS__) : (void)0)
 /**
  * Logs an error message.
  */
-#define log_error(...) log_message(LOG_ERROR, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
 /**
  * Logs a warning message.
  */
-#define log_warning(...) log_message(LOG_WARNING, __VA_ARGS__)
+#define log_warning(...) log_at(LOG_WARNING, __VA_ARGS__)
 /**
  * Logs an info message.
  */
-#define log_info(...) log_message(LOG_INFO, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
 /**
  * Logs a debug message.
  */
-#define log_debug(...) log_message(LOG_DEBUG, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
 /**
  * Logs a trace message.
  */
-#define log_trace(...) log_message(LOG_TRACE, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
 
 /**
  * Exits the program immediately with the given exit status and message.
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Recording and replaying input movies.
+ *
+ * A movie is a record of the keys pressed during each frame of a game, along
+ * with everything else which can affect the game's behavior (the random number
+ * generator seed, the quirks options and the number of instructions per
+ * frame).  Since the interpreter is deterministic when it uses a virtual
+ * clock, replaying a movie against the same game reproduces the original run
+ * exactly, down to the contents of the display on every frame.
+ *
+ * Movies are stored as text, so that they can easily be attached to bug
+ * reports.  A movie file looks like this:
+ *
+ *     chip8-movie 1
+ *     seed 1234
+ *     load-quirks 0
+ *     shift-quirks 1
+ *     cycles-per-frame 100
+ *     frames 600
+ *     0 0000
+ *     120 0010
+ *     135 0000
+ *
+ * Each line after the header gives the frame on which the key states changed
+ * and the new key states, in hexadecimal (as in `struct chip8`).
+ */
+#ifndef CHIP8_MOVIE_H
+#define CHIP8_MOVIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * The current version of the movie format.
+ */
+#define CHIP8_MOVIE_VERSION 1
+
+/**
+ * A change in the key states.
+ */
+struct chip8_movie_input {
+    /**
+     * The frame from which the new key states apply.
+     */
+    unsigned long frame;
+    /**
+     * The new key states.
+     */
+    uint16_t key_states;
+};
+
+/**
+ * An input movie.
+ */
+struct chip8_movie {
+    /**
+     * The random number generator seed.
+     */
+    uint64_t seed;
+    bool load_quirks;
+    bool shift_quirks;
+    /**
+     * The number of instructions executed per frame.
+     */
+    unsigned long cycles_per_frame;
+    /**
+     * The length of the movie, in frames.
+     */
+    unsigned long frames;
+    /**
+     * The changes in key states, in order of frame.
+     */
+    struct chip8_movie_input *inputs;
+    size_t n_inputs;
+    size_t inputs_cap;
+};
+
+/**
+ * Returns a new, empty movie using the given interpreter options.
+ */
+struct chip8_movie *chip8_movie_new(struct chip8_options opts);
+void chip8_movie_free(struct chip8_movie *movie);
+/**
+ * Returns the given interpreter options, modified as needed to replay the
+ * given movie.
+ *
+ * Replaying a movie requires the virtual clock, so it is always enabled.
+ */
+struct chip8_options chip8_movie_options(
+    const struct chip8_movie *movie, struct chip8_options opts);
+/**
+ * Records the key states for the next frame of the movie.
+ *
+ * This should be called just before running each frame.
+ */
+void chip8_movie_record(struct chip8_movie *movie, uint16_t key_states);
+/**
+ * Returns the key states for the given frame of the movie.
+ *
+ * @param[in,out] cursor The position of the next input to check, which should
+ * start at 0.  Frames must be requested in increasing order using the same
+ * cursor.
+ */
+uint16_t chip8_movie_keys(
+    const struct chip8_movie *movie, unsigned long frame, size_t *cursor);
+/**
+ * Replays the movie on the given interpreter, which should have been created
+ * with the options from `chip8_movie_options` and had the game loaded.
+ *
+ * @param[out] frames The number of frames completed (may be NULL).
+ * @return The reasons execution stopped on the last frame, as for
+ * `chip8_run_until`.
+ */
+unsigned chip8_movie_replay(const struct chip8_movie *movie, struct chip8 *chip,
+    unsigned long *frames);
+/**
+ * Saves the movie to the file with the given name.
+ *
+ * @return An error code.
+ */
+int chip8_movie_save(const struct chip8_movie *movie, const char *fname);
+/**
+ * Loads a movie from the file with the given name.
+ *
+ * @return The movie, or NULL if it could not be loaded.
+ */
+struct chip8_movie *chip8_movie_load(const char *fname);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Packs of many game files stored together in a single file.
+ *
+ * Opening thousands of small game files one at a time is slow, so a whole
+ * collection of games can instead be packed into one file using the chip8pack
+ * tool.  A pack is mapped into memory in one go when it is opened, so that its
+ * pages are shared between every process using it, and looking up a game is
+ * just a binary search on its SHA-1 digest.
+ *
+ * A pack file starts with a `struct chip8_pack_header`, followed by the
+ * `struct chip8_pack_entry` for each game (sorted by digest), the table of
+ * game names (each terminated by a NUL) and finally the contents of the games
+ * themselves.  As with state files (see `state.h`), everything is written
+ * exactly as it is in memory, so packs use the byte order of the machine
+ * which wrote them.
+ */
+#ifndef CHIP8_PACK_H
+#define CHIP8_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+#include "sha1.h"
+
+/**
+ * The magic number at the start of every pack file.
+ */
+#define CHIP8_PACK_MAGIC "CHIP8PAK"
+/**
+ * The current version of the pack format.
+ *
+ * This must be incremented whenever the layout of the header or entries
+ * changes.
+ */
+#define CHIP8_PACK_VERSION 1
+/**
+ * The value of `byte_order` in a pack written on this machine.
+ */
+#define CHIP8_PACK_BYTE_ORDER UINT32_C(0x01020304)
+
+/**
+ * Flags describing the options a game should be run with by default.
+ */
+enum chip8_pack_flags {
+    CHIP8_PACK_SHIFT_QUIRKS = 1 << 0,
+    CHIP8_PACK_LOAD_QUIRKS = 1 << 1,
+};
+
+/**
+ * The header of a pack file.
+ */
+struct chip8_pack_header {
+    /**
+     * The magic number `CHIP8_PACK_MAGIC` (without the terminating NUL).
+     */
+    char magic[8];
+    /**
+     * The version of the pack format (`CHIP8_PACK_VERSION`).
+     */
+    uint32_t version;
+    /**
+     * The value `CHIP8_PACK_BYTE_ORDER`, in the byte order of the machine
+     * which wrote the pack.
+     */
+    uint32_t byte_order;
+    /**
+     * The number of games in the pack.
+     */
+    uint32_t n_entries;
+    /**
+     * The size of the name table, in bytes.
+     */
+    uint32_t names_size;
+};
+
+/**
+ * The index entry for a single game in a pack.
+ */
+struct chip8_pack_entry {
+    /**
+     * The SHA-1 digest of the game.
+     */
+    uint8_t sha1[CHIP8_SHA1_LEN];
+    /**
+     * A combination of `enum chip8_pack_flags` values.
+     */
+    uint32_t flags;
+    /**
+     * The position of the game in the pack file, in bytes.
+     */
+    uint32_t offset;
+    /**
+     * The length of the game, in bytes.
+     */
+    uint32_t len;
+    /**
+     * The position of the name of the game in the name table, in bytes.
+     */
+    uint32_t name;
+};
+
+/**
+ * A game to be written to a pack.
+ */
+struct chip8_pack_item {
+    /**
+     * The name of the game (usually the name of the file it came from).
+     */
+    const char *name;
+    const uint8_t *data;
+    size_t len;
+    /**
+     * A combination of `enum chip8_pack_flags` values.
+     */
+    uint32_t flags;
+};
+
+/**
+ * An open pack file.
+ */
+struct chip8_pack;
+
+/**
+ * Writes a pack file containing the given games.
+ *
+ * Games with the same contents as an earlier game in the list are left out,
+ * since they could never be found by digest.
+ *
+ * @return An error code.
+ */
+int chip8_pack_write(
+    const char *fname, const struct chip8_pack_item *items, size_t n_items);
+/**
+ * Opens and maps the given pack file, checking that its index is valid.
+ *
+ * @return The pack, or NULL if it could not be opened.
+ */
+struct chip8_pack *chip8_pack_open(const char *fname);
+void chip8_pack_close(struct chip8_pack *pack);
+/**
+ * Returns the number of games in the pack.
+ */
+size_t chip8_pack_size(const struct chip8_pack *pack);
+/**
+ * Returns the entry at the given index (in order of digest).
+ */
+const struct chip8_pack_entry *chip8_pack_get(
+    const struct chip8_pack *pack, size_t idx);
+/**
+ * Returns the entry of the game with the given digest, or NULL if there is no
+ * such game.
+ */
+const struct chip8_pack_entry *chip8_pack_find(
+    const struct chip8_pack *pack, const uint8_t sha1[CHIP8_SHA1_LEN]);
+/**
+ * Returns the entry of the game with the given name, or NULL if there is no
+ * such game.
+ *
+ * Unlike `chip8_pack_find`, this has to check every entry.
+ */
+const struct chip8_pack_entry *chip8_pack_find_name(
+    const struct chip8_pack *pack, const char *name);
+/**
+ * Returns the name of the given game.
+ */
+const char *chip8_pack_name(
+    const struct chip8_pack *pack, const struct chip8_pack_entry *entry);
+/**
+ * Returns the contents of the given game (`entry->len` bytes).
+ */
+const uint8_t *chip8_pack_data(
+    const struct chip8_pack *pack, const struct chip8_pack_entry *entry);
+/**
+ * Returns the given interpreter options, with the quirks which the given game
+ * needs enabled.
+ */
+struct chip8_options chip8_pack_options(
+    const struct chip8_pack_entry *entry, struct chip8_options opts);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * A history of recent interpreter states, for stepping backwards in time.
+ *
+ * The history is a ring buffer of snapshots (see `state.h`), one for each
+ * call to `chip8_rewind_push`.  Every so often a snapshot is stored as a
+ * keyframe; the ones in between are stored as the XOR of the snapshot with
+ * the preceding keyframe.  Since very little changes from one frame to the
+ * next, these deltas are almost entirely zero, and all snapshots (keyframes
+ * included) are run-length encoded to take advantage of this.  Restoring any
+ * snapshot thus takes one keyframe decode and at most one delta application.
+ */
+#ifndef CHIP8_REWIND_H
+#define CHIP8_REWIND_H
+
+#include <stddef.h>
+
+#include "interpreter.h"
+
+/**
+ * A rewind buffer.
+ */
+struct chip8_rewind;
+
+/**
+ * Returns a new, empty rewind buffer.
+ *
+ * @param capacity The maximum number of snapshots to keep.  Once the buffer is
+ * full, the oldest snapshots are discarded to make room for new ones.
+ * @param keyframe_interval The number of snapshots between keyframes.
+ */
+struct chip8_rewind *chip8_rewind_new(size_t capacity, size_t keyframe_interval);
+void chip8_rewind_destroy(struct chip8_rewind *rewind);
+/**
+ * Adds a snapshot of the current state of the given interpreter to the
+ * buffer.
+ */
+void chip8_rewind_push(struct chip8_rewind *rewind, const struct chip8 *chip);
+/**
+ * Restores the given interpreter to the most recent snapshot in the buffer and
+ * removes it from the buffer.
+ *
+ * @return An error code (nonzero if the buffer is empty, in which case the
+ * interpreter is not modified).
+ */
+int chip8_rewind_pop(struct chip8_rewind *rewind, struct chip8 *chip);
+/**
+ * Returns the number of snapshots in the buffer.
+ */
+size_t chip8_rewind_size(const struct chip8_rewind *rewind);
+/**
+ * Returns the total size of the encoded snapshots in the buffer, in bytes.
+ */
+size_t chip8_rewind_bytes(const struct chip8_rewind *rewind);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Reading ROM images from disk.
+ *
+ * Every tool which works with a game file used to read it in its own way
+ * (often a byte at a time).  Instead, a ROM is now opened once here: its size
+ * is checked against the space available for programs, and the file is mapped
+ * read-only into memory so that it can be handed to the interpreter with a
+ * single copy or examined directly by the disassembler.  If a file cannot be
+ * mapped (for example, if it is a pipe), it is read into a buffer instead, so
+ * callers never need to care which happened.
+ */
+#ifndef CHIP8_ROM_H
+#define CHIP8_ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A ROM image opened from a file.
+ */
+struct chip8_rom {
+    /**
+     * The contents of the ROM.
+     *
+     * At least `CHIP8_PROG_SIZE` bytes can be read from here, even if the ROM
+     * itself is shorter; anything past the end of the ROM reads as zero.
+     */
+    const uint8_t *data;
+    /**
+     * The length of the ROM, in bytes.
+     */
+    size_t len;
+    /**
+     * The mapping containing the data, or NULL if the data is in a buffer
+     * allocated with malloc.
+     */
+    void *map;
+    /**
+     * The length of the mapping.
+     */
+    size_t map_len;
+};
+
+/**
+ * Opens the ROM in the given file.
+ *
+ * @return An error code (nonzero if the file could not be read or is too big
+ * to be a Chip-8 program).
+ */
+int chip8_rom_open(struct chip8_rom *rom, const char *fname);
+/**
+ * Releases the memory used by a ROM.
+ */
+void chip8_rom_close(struct chip8_rom *rom);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * The SHA-1 hash function.
+ *
+ * This is only used to identify game files (see `pack.h`), not for anything
+ * which needs to be secure.
+ */
+#ifndef CHIP8_SHA1_H
+#define CHIP8_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The length of a SHA-1 digest, in bytes.
+ */
+#define CHIP8_SHA1_LEN 20
+/**
+ * The length of a SHA-1 digest written in hexadecimal, including the
+ * terminating NUL.
+ */
+#define CHIP8_SHA1_HEX_LEN (2 * CHIP8_SHA1_LEN + 1)
+
+/**
+ * Computes the SHA-1 digest of the given data.
+ */
+void chip8_sha1(const void *data, size_t len, uint8_t digest[CHIP8_SHA1_LEN]);
+/**
+ * Writes the given digest in hexadecimal (lowercase) to the given buffer.
+ */
+void chip8_sha1_format(
+    const uint8_t digest[CHIP8_SHA1_LEN], char hex[CHIP8_SHA1_HEX_LEN]);
+/**
+ * Parses a digest written in hexadecimal.
+ *
+ * @return An error code (nonzero if the string is not exactly 40 hexadecimal
+ * digits).
+ */
+int chip8_sha1_parse(const char *hex, uint8_t digest[CHIP8_SHA1_LEN]);
+
+#endif
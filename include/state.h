@@ -0,0 +1,161 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Saving and restoring snapshots of the interpreter state.
+ *
+ * A snapshot is a `struct chip8_state`, which has a fixed layout made up only
+ * of fixed-width fields (ordered so that there is no padding), and is written
+ * to disk exactly as it is in memory.  Loading a state file is therefore just
+ * a matter of mapping it into memory and checking the header; there is no
+ * parsing involved.  The price of this is that state files use the byte order
+ * of the machine that wrote them, and are rejected on machines with a
+ * different byte order.
+ */
+#ifndef CHIP8_STATE_H
+#define CHIP8_STATE_H
+
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * The magic number at the start of every state file.
+ */
+#define CHIP8_STATE_MAGIC "CHIP8STA"
+/**
+ * The current version of the state format.
+ *
+ * This must be incremented whenever the layout of `struct chip8_state`
+ * changes.
+ */
+#define CHIP8_STATE_VERSION 1
+/**
+ * The value of `byte_order` in a state written on this machine.
+ */
+#define CHIP8_STATE_BYTE_ORDER UINT32_C(0x01020304)
+
+/**
+ * Flags describing the options and modes stored in a state.
+ */
+enum chip8_state_flags {
+    CHIP8_STATE_HALTED = 1 << 0,
+    CHIP8_STATE_HIGHRES = 1 << 1,
+    CHIP8_STATE_SHIFT_QUIRKS = 1 << 2,
+    CHIP8_STATE_LOAD_QUIRKS = 1 << 3,
+    CHIP8_STATE_DELAY_DRAWS = 1 << 4,
+    CHIP8_STATE_VIRTUAL_CLOCK = 1 << 5,
+};
+
+/**
+ * A snapshot of the state of an interpreter.
+ */
+struct chip8_state {
+    /**
+     * The magic number `CHIP8_STATE_MAGIC` (without the terminating NUL).
+     */
+    char magic[8];
+    /**
+     * The version of the state format (`CHIP8_STATE_VERSION`).
+     */
+    uint32_t version;
+    /**
+     * The value `CHIP8_STATE_BYTE_ORDER`, in the byte order of the machine
+     * which wrote the state.
+     */
+    uint32_t byte_order;
+    /**
+     * The size of the whole state, in bytes.
+     */
+    uint32_t size;
+    /**
+     * A combination of `enum chip8_state_flags` values.
+     */
+    uint32_t flags;
+    /**
+     * The state of the random number generator.
+     */
+    uint64_t rand_state;
+    /**
+     * The total number of instructions executed.
+     */
+    uint64_t cycles;
+    /**
+     * The number of timer ticks (only meaningful with a virtual clock).
+     */
+    uint64_t timer_ticks;
+    /**
+     * The number of instructions executed since the last tick (only
+     * meaningful with a virtual clock).
+     */
+    uint64_t tick_cycles;
+    /**
+     * The number of instructions per tick with a virtual clock.
+     */
+    uint64_t cycles_per_frame;
+    /**
+     * The display (see `struct chip8`).
+     */
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WORDS];
+    /**
+     * The maximum depth of the call stack.
+     */
+    uint32_t stack_depth;
+    /**
+     * The number of entries in the call stack.
+     */
+    uint32_t stack_size;
+    /**
+     * The call stack.
+     */
+    uint16_t call_stack[CHIP8_STACK_MAX];
+    uint16_t pc;
+    uint16_t reg_i;
+    uint16_t key_states;
+    uint8_t reg_dt;
+    uint8_t reg_st;
+    uint8_t regs[16];
+    uint8_t rpl[8];
+    /**
+     * The internal memory.
+     */
+    uint8_t mem[CHIP8_MEM_SIZE];
+};
+
+/**
+ * Takes a snapshot of the state of the given interpreter.
+ */
+void chip8_state_capture(const struct chip8 *chip, struct chip8_state *state);
+/**
+ * Restores the given interpreter to the state in a snapshot.
+ *
+ * Everything in the snapshot replaces the current state of the interpreter,
+ * including the quirks options.  Options which only affect the host (such as
+ * whether to use JIT compilation) and breakpoints are left alone.  If the
+ * interpreter uses the system clock for its timers, the saved tick count is
+ * ignored.
+ *
+ * @return An error code (if the snapshot is invalid, the interpreter is not
+ * modified).
+ */
+int chip8_state_restore(struct chip8 *chip, const struct chip8_state *state);
+/**
+ * Saves the state of the given interpreter to a file.
+ *
+ * @return An error code.
+ */
+int chip8_save_state(const struct chip8 *chip, const char *fname);
+/**
+ * Restores the state of the given interpreter from a file written by
+ * `chip8_save_state`.
+ *
+ * @return An error code.
+ */
+int chip8_load_state(struct chip8 *chip, const char *fname);
+
+#endif
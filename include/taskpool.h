@@ -0,0 +1,48 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * A simple pool of threads for running many independent tasks.
+ *
+ * The tasks are identified by their indices, and are initially divided evenly
+ * between the threads.  When a thread runs out of tasks, it steals half of the
+ * remaining tasks of another thread, so that uneven workloads are still
+ * spread across all the threads.
+ */
+#ifndef CHIP8_TASKPOOL_H
+#define CHIP8_TASKPOOL_H
+
+#include <stddef.h>
+
+/**
+ * A task to be run by the pool.
+ *
+ * @param index The index of the task (from 0 up to the number of tasks).
+ * @param data The data pointer given to `taskpool_run`.
+ */
+typedef void (*taskpool_task)(size_t index, void *data);
+
+/**
+ * Returns the number of processors available, which is a sensible default for
+ * the number of threads to use.
+ */
+unsigned taskpool_default_threads(void);
+/**
+ * Runs the given task once for each index from 0 to `n_tasks - 1`, using up
+ * to `n_threads` threads (including the calling thread), and waits for all of
+ * them to finish.
+ *
+ * The order in which the tasks are run is unspecified, so the task function
+ * must be safe to call from several threads at once.
+ *
+ * @return An error code.
+ */
+int taskpool_run(
+    unsigned n_threads, size_t n_tasks, taskpool_task task, void *data);
+
+#endif
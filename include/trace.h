@@ -0,0 +1,148 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Recording a binary trace of every instruction executed.
+ *
+ * Formatting each instruction as text while the game is running is far too
+ * slow to be useful, so instead the interpreter stores a small fixed-size
+ * record for each one in an in-memory ring buffer.  The ring is divided into
+ * blocks, and whenever a block fills up it is handed over to a background
+ * thread which writes it to the trace file; the interpreter only has to wait
+ * if it gets a whole ring ahead of the disk.  The trace can then be turned
+ * into readable text at leisure using the chip8trace tool.
+ *
+ * A trace file is a `struct chip8_trace_header` followed by any number of
+ * `struct chip8_trace_record`s.  As with state files (see `state.h`), these
+ * are written exactly as they are in memory, so trace files use the byte
+ * order of the machine which wrote them.
+ */
+#ifndef CHIP8_TRACE_H
+#define CHIP8_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The magic number at the start of every trace file.
+ */
+#define CHIP8_TRACE_MAGIC "CHIP8TRC"
+/**
+ * The current version of the trace format.
+ *
+ * This must be incremented whenever the layout of the header or records
+ * changes.
+ */
+#define CHIP8_TRACE_VERSION 1
+/**
+ * The value of `byte_order` in a trace written on this machine.
+ */
+#define CHIP8_TRACE_BYTE_ORDER UINT32_C(0x01020304)
+
+/**
+ * Flags describing the options used to record a trace.
+ */
+enum chip8_trace_flags {
+    /**
+     * The game was run in shift quirks mode, which affects how opcodes should
+     * be decoded.
+     */
+    CHIP8_TRACE_SHIFT_QUIRKS = 1 << 0,
+};
+
+/**
+ * The header of a trace file.
+ */
+struct chip8_trace_header {
+    /**
+     * The magic number `CHIP8_TRACE_MAGIC` (without the terminating NUL).
+     */
+    char magic[8];
+    /**
+     * The version of the trace format (`CHIP8_TRACE_VERSION`).
+     */
+    uint32_t version;
+    /**
+     * The value `CHIP8_TRACE_BYTE_ORDER`, in the byte order of the machine
+     * which wrote the trace.
+     */
+    uint32_t byte_order;
+    /**
+     * The size of each record, in bytes.
+     */
+    uint32_t record_size;
+    /**
+     * A combination of `enum chip8_trace_flags` values.
+     */
+    uint32_t flags;
+};
+
+/**
+ * The record of a single executed instruction.
+ */
+struct chip8_trace_record {
+    /**
+     * The address of the instruction.
+     */
+    uint16_t pc;
+    /**
+     * The opcode of the instruction.
+     */
+    uint16_t opcode;
+    /**
+     * The value of the I register after the instruction was executed.
+     */
+    uint16_t reg_i;
+    /**
+     * The registers changed by the instruction (bit n is set if Vn changed).
+     */
+    uint16_t reg_mask;
+    /**
+     * The timer tick (frame) during which the instruction was executed.
+     */
+    uint32_t frame;
+};
+
+/**
+ * A trace being recorded.
+ */
+struct chip8_trace;
+
+/**
+ * Creates the trace file with the given name and starts the thread which
+ * writes to it.
+ *
+ * @param flags A combination of `enum chip8_trace_flags` values to store in
+ * the header.
+ * @return The new trace, or NULL if it could not be created.
+ */
+struct chip8_trace *chip8_trace_open(const char *fname, uint32_t flags);
+/**
+ * Writes out any records which are still in memory, stops the writer thread
+ * and closes the trace file.
+ *
+ * @return An error code (nonzero if any part of the trace could not be
+ * written).
+ */
+int chip8_trace_close(struct chip8_trace *trace);
+/**
+ * Adds a record to the trace.
+ */
+void chip8_trace_record(
+    struct chip8_trace *trace, const struct chip8_trace_record *record);
+/**
+ * Reads and checks the header of a trace file.
+ *
+ * @param fname The name of the file (for error messages).
+ * @return An error code.
+ */
+int chip8_trace_read_header(
+    FILE *input, const char *fname, struct chip8_trace_header *header);
+
+#endif
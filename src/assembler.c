@@ -114,6 +114,10 @@ struct instruction {
      * The location in memory for the final instruction after processing.
      */
     uint16_t pc;
+    /**
+     * A copy of the label associated with this instruction, or NULL.
+     */
+    char *label;
 };
 
 /**
@@ -455,6 +459,14 @@ int chip8asm_emit(struct chip8asm *chipasm, struct chip8asm_program *prog)
                 prog->len = mempos + 2;
             break;
         }
+
+        if (instr->label) {
+            prog->symbols = xrealloc(prog->symbols,
+                (prog->n_symbols + 1) * sizeof *prog->symbols);
+            prog->symbols[prog->n_symbols].name = xstrdup(instr->label);
+            prog->symbols[prog->n_symbols].addr = instr->pc;
+            prog->n_symbols++;
+        }
     }
 
     if (chipasm->if_level != 0)
@@ -733,6 +745,11 @@ struct chip8asm_program *chip8asm_program_new(void)
 
 void chip8asm_program_destroy(struct chip8asm_program *prog)
 {
+    if (!prog)
+        return;
+    for (size_t i = 0; i < prog->n_symbols; i++)
+        free(prog->symbols[i].name);
+    free(prog->symbols);
     free(prog);
 }
 
@@ -742,16 +759,29 @@ uint16_t chip8asm_program_opcode(
     return (uint16_t)prog->mem[addr] << 8 | prog->mem[addr + 1];
 }
 
+int chip8asm_program_write_symbols(
+    const struct chip8asm_program *prog, FILE *output)
+{
+    for (size_t i = 0; i < prog->n_symbols; i++)
+        fprintf(output, "%03X %s\n", (unsigned)prog->symbols[i].addr,
+            prog->symbols[i].name);
+
+    return ferror(output) ? 1 : 0;
+}
+
 static int chip8asm_add_instruction(
     struct chip8asm *chipasm, struct instruction instr)
 {
     /* Add label to ltable, if any */
+    instr.label = NULL;
     if (chipasm->line_label) {
         if (ltable_add(&chipasm->labels, chipasm->line_label, instr.pc)) {
             FAIL_MSG(chipasm->line, "duplicate label or variable '%s' found",
                 chipasm->line_label);
             return 1;
         }
+        /* The table now owns the label, so we need our own copy */
+        instr.label = xstrdup(chipasm->line_label);
         chipasm->line_label = NULL;
     }
     instructions_add(&chipasm->instructions, instr);
@@ -1368,9 +1398,11 @@ static void instructions_add(struct instructions *lst, struct instruction instr)
 
 static void instructions_clear(struct instructions *lst)
 {
-    for (size_t i = 0; i < lst->len; i++)
+    for (size_t i = 0; i < lst->len; i++) {
         for (int j = 0; j < lst->data[i].n_operands; j++)
             free(lst->data[i].operands[j]);
+        free(lst->data[i].label);
+    }
 
     free(lst->data);
     lst->data = NULL;
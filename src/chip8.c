@@ -9,34 +9,56 @@
 
 #include <errno.h>
 #include <getopt.h>
-#include <sched.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <SDL.h>
 #include <SDL_audio.h>
 
 #include "audio.h"
+#include "handoff.h"
 #include "interpreter.h"
 #include "log.h"
+#include "movie.h"
+#include "rewind.h"
+#include "state.h"
 
 static const char *HELP =
     "A Chip-8/Super-Chip interpreter.\n"
     "\n"
     "Options:\n"
+    "  -C, --checkpoint=FILE       set file for saving/loading state\n"
+    "  -c, --cycles=CYCLES         set instructions per frame (default 100)\n"
+    "  -E, --emulation-thread      run the game on its own thread\n"
     "  -f, --frequency=FREQ        set game timer frequency (in Hz)\n"
+    "  -H, --heatmap=FILE          write per-address execution counts to FILE\n"
     "  -h, --help                  show this help message and exit\n"
     "  -l, --load-quirks           enable load quirks mode\n"
+    "  -P, --profile               print an instruction profile on exit\n"
+    "  -p, --play=FILE             replay the input movie in FILE\n"
     "  -q, --shift-quirks          enable shift quirks mode\n"
+    "  -R, --rewind=SECONDS        set length of rewind history (0 to disable)\n"
+    "  -r, --record=FILE           record an input movie to FILE\n"
+    "  -S, --seed=SEED             set random number generator seed\n"
     "  -s, --scale=SCALE           set game display scale\n"
+    "  -T, --trace=FILE            record every instruction executed to FILE\n"
     "  -t, --tone=FREQ             set game buzzer tone (in Hz)\n"
     "  -u, --volume=VOL            set game buzzer volume (0-100)\n"
     "  -V, --version               show version information and exit\n"
-    "  -v, --verbose               increase verbosity\n";
+    "  -v, --verbose               increase verbosity\n"
+    "  -W, --window-surface        draw on the window surface instead of a texture\n";
 static const char *USAGE = "Usage: chip8 [OPTION...] FILE\n";
 static const char *VERSION_STRING = "chip8 " PROJECT_VERSION "\n";
 
+/**
+ * The number of input events which can be waiting for the emulation thread.
+ */
+#define INPUT_QUEUE_SIZE 256
+
 /**
  * Options that can be passed to the program.
  */
@@ -56,8 +78,25 @@ struct progopts {
     int scale;
     /**
      * The frequency (in Hz) of the game timer (default 60).
+     *
+     * This is also the rate at which frames are run and the display is
+     * refreshed.  If it is 0, frames are run as fast as possible.
      */
     long game_freq;
+    /**
+     * The number of instructions to execute per frame (default 100).
+     */
+    unsigned long cycles_per_frame;
+    /**
+     * Whether to run the game on a separate thread from the window (default
+     * false).
+     */
+    bool emulation_thread;
+    /**
+     * Whether to draw directly on the window surface rather than through a
+     * renderer (default false).
+     */
+    bool window_surface;
     /**
      * Whether to use load quirks mode (default false).
      */
@@ -66,6 +105,11 @@ struct progopts {
      * Whether to use shift quirks mode (default false).
      */
     bool shift_quirks;
+    /**
+     * Whether to profile the game and print the results on exit (default
+     * false).
+     */
+    bool profile;
     /**
      * The frequency (in Hz) of the game beeper (default 440).
      */
@@ -74,6 +118,45 @@ struct progopts {
      * The volume (from 0 to 100) of the game beeper (default 10).
      */
     int tone_vol;
+    /**
+     * Whether a random number generator seed was given.
+     *
+     * If not, a seed is chosen based on the current time.
+     */
+    bool has_seed;
+    /**
+     * The random number generator seed.
+     */
+    uint64_t seed;
+    /**
+     * The number of seconds of history to keep for rewinding (default 60).
+     *
+     * If this is 0, rewinding is disabled.
+     */
+    unsigned long rewind_secs;
+    /**
+     * The file to which the per-address execution counts are written on
+     * exit, or NULL.
+     */
+    char *heatmap;
+    /**
+     * The file to which a binary trace of the instructions executed is
+     * written, or NULL.
+     */
+    char *trace;
+    /**
+     * The file to which the game state is saved (using F5) and from which it
+     * is restored (at startup, if it exists, and using F9), or NULL.
+     */
+    char *checkpoint;
+    /**
+     * The file to which an input movie should be recorded, or NULL.
+     */
+    char *record;
+    /**
+     * The file from which an input movie should be replayed, or NULL.
+     */
+    char *play;
     /**
      * The filename of the game to load.
      */
@@ -97,10 +180,51 @@ struct surface {
      * The height of an in-game pixel in display pixels.
      */
     int yscale;
+};
+
+/**
+ * A running game, which belongs to whichever thread is running it.
+ */
+struct emulator {
+    const struct progopts *opts;
+    struct chip8 *chip;
+    /**
+     * The rewind history, or NULL if rewinding is disabled.
+     */
+    struct chip8_rewind *rewind;
+    /**
+     * The movie being recorded or played, or NULL.
+     */
+    struct chip8_movie *movie;
+    /**
+     * The number of frames of the movie recorded or played so far.
+     */
+    unsigned long movie_frame;
+    /**
+     * The position of the next key change in the movie (when playing).
+     */
+    size_t movie_cursor;
+    /**
+     * Whether the game is running backwards through its history.
+     */
+    bool rewinding;
+    /**
+     * Whether the game is over (because it halted, the movie ended, there was
+     * an error or the user quit).
+     */
+    bool finished;
+    /**
+     * The frames published by the emulation thread, if there is one.
+     */
+    struct chip8_triple_buffer *frames;
+    /**
+     * The input waiting for the emulation thread, if there is one.
+     */
+    struct chip8_input_queue *input;
     /**
-     * Whether the surface has been changed (set to true on every draw).
+     * The error code with which the emulation thread stopped.
      */
-    bool changed;
+    int retval;
 };
 
 /**
@@ -126,9 +250,22 @@ SDL_Keycode keymap[16] = {
 };
 
 /**
- * The underlying surface of the game window.
+ * The underlying surface of the game window, if it is drawn on directly.
  */
 static struct surface win_surface;
+/**
+ * The renderer for the game window, or NULL if the window surface is drawn on
+ * directly.
+ */
+static SDL_Renderer *renderer;
+/**
+ * The textures holding the visible part of the display, in low-resolution and
+ * high-resolution mode respectively.
+ *
+ * These are updated once per frame and then scaled up to fill the window by
+ * the renderer, so drawing costs the same whatever the scale.
+ */
+static SDL_Texture *textures[2];
 /**
  * The color to use for pixels which are on.
  */
@@ -137,29 +274,108 @@ static uint32_t oncolor;
  * The color to use for pixels which are off.
  */
 static uint32_t offcolor;
+/**
+ * The frame currently shown in the window.
+ */
+static struct chip8_frame presented;
+/**
+ * Whether the window actually shows `presented` (it doesn't to start with, or
+ * after something happens to the window).
+ */
+static bool presented_valid;
 
 /**
  * The SDL audio callback function.
  */
 static void audio_callback(void *userdata, uint8_t *stream, int len);
 /**
- * Turns on or off the given pixel on the display.  The fourth parameter
- * specifies whether the pixel should be drawn in high-resolution mode (in
- * low-resolution mode, in-game pixels are twice the size).
+ * Redraws the given rows of the Chip-8 display onto the window surface (bit
+ * `y` of `rows` corresponds to row `y`).
+ *
+ * In low-resolution mode, only the top-left quarter of the display is shown,
+ * with in-game pixels twice the size.
  */
-static void draw_pixel(int x, int y, bool on, bool high);
+static void draw_rows(const struct chip8_frame *frame, uint64_t rows);
+/**
+ * Redraws the whole window from the display texture for the given frame.
+ */
+static void draw_texture(const struct chip8_frame *frame);
 /**
  * Returns the surface corresponding to the window surface of the given window.
  */
 static struct surface get_window_surface(SDL_Window *window);
+/**
+ * Creates the renderer and display textures for the given window.
+ *
+ * @return An error code.
+ */
+static int create_renderer(SDL_Window *window);
+/**
+ * Destroys the renderer and display textures, if there are any.
+ */
+static void destroy_renderer(void);
 /**
  * Returns the default set of program options.
  */
 static struct progopts progopts_default(void);
 /**
- * Completely redraws the Chip-8 display onto the window surface.
+ * Sleeps until the given deadline, and then moves it on by one frame.
+ *
+ * If the deadline has already passed by more than a frame (for example,
+ * because the window was being dragged), it is reset to the current time, so
+ * that the game doesn't race to catch up.
+ */
+static void wait_frame(struct timespec *deadline, long freq);
+/**
+ * Handles an SDL event which concerns the window itself, or translates it
+ * into input for the game.
+ *
+ * @param[out] should_exit Set to true if the user asked to quit.
+ * @return Whether the event was translated into input (stored in `input`).
+ */
+static bool handle_event(const SDL_Event *e, SDL_Window *win,
+    const struct progopts *opts, struct chip8_input *input, bool *should_exit);
+/**
+ * Applies a single input event to the game.
+ */
+static void emulator_input(struct emulator *emu, struct chip8_input input);
+/**
+ * Runs a single frame of the game (or, when rewinding, goes back one frame).
+ *
+ * @return An error code.
+ */
+static int emulator_frame(struct emulator *emu);
+/**
+ * The body of the emulation thread, which runs frames of the game at the
+ * right pace and publishes each one, until the game is over or it is asked
+ * to quit.
+ */
+static void *emulator_thread(void *data);
+/**
+ * Shows the given frame in the window, unless none of its rows have changed
+ * since the last frame shown.
+ *
+ * When drawing on the window surface, only the rows which have changed are
+ * redrawn.
  */
-static void redraw_all(struct chip8 *chip);
+static void present(SDL_Window *win, SDL_AudioDeviceID audio_device,
+    const struct chip8_frame *frame);
+/**
+ * Runs the game and handles the window on the current thread, a frame at a
+ * time.
+ *
+ * @return An error code.
+ */
+static int run_frames(
+    struct emulator *emu, SDL_Window *win, SDL_AudioDeviceID audio_device);
+/**
+ * Runs the game on an emulation thread, while handling the window on the
+ * current thread.
+ *
+ * @return An error code.
+ */
+static int run_threaded(
+    struct emulator *emu, SDL_Window *win, SDL_AudioDeviceID audio_device);
 static int run(struct progopts opts);
 
 int main(int argc, char **argv)
@@ -167,35 +383,98 @@ int main(int argc, char **argv)
     struct progopts opts = progopts_default();
     int option;
     const struct option options[] = {
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"cycles", required_argument, NULL, 'c'},
+        {"emulation-thread", no_argument, NULL, 'E'},
         {"frequency", required_argument, NULL, 'f'},
+        {"heatmap", required_argument, NULL, 'H'},
         {"help", no_argument, NULL, 'h'},
         {"load-quirks", no_argument, NULL, 'l'},
+        {"profile", no_argument, NULL, 'P'},
+        {"play", required_argument, NULL, 'p'},
         {"shift-quirks", no_argument, NULL, 'q'},
+        {"rewind", required_argument, NULL, 'R'},
+        {"record", required_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, 'S'},
         {"scale", required_argument, NULL, 's'},
+        {"trace", required_argument, NULL, 'T'},
         {"tone", required_argument, NULL, 't'},
         {"volume", required_argument, NULL, 'u'},
         {"version", no_argument, NULL, 'V'},
-        {"verbose", no_argument, NULL, 'v'}, {0, 0, 0, 0},
+        {"verbose", no_argument, NULL, 'v'},
+        {"window-surface", no_argument, NULL, 'W'}, {0, 0, 0, 0},
     };
 
     log_init(argc >= 1 ? argv[0] : "chip8", stderr, LOG_WARNING);
 
-    while ((option = getopt_long(argc, argv, "f:hlqs:t:u:Vv", options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "C:c:Ef:H:hlPp:qR:r:S:s:T:t:u:VvW", options, NULL)) != -1) {
         char *numend;
 
         switch (option) {
+        case 'C':
+            opts.checkpoint = optarg;
+            break;
+        case 'c':
+            errno = 0;
+            opts.cycles_per_frame = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing cycle count: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0' || opts.cycles_per_frame == 0) {
+                log_error("Cycle count argument '%s' is invalid", optarg);
+                return 2;
+            }
+            break;
+        case 'E':
+            opts.emulation_thread = true;
+            break;
         case 'f':
             opts.game_freq = atol(optarg);
             break;
+        case 'H':
+            opts.heatmap = optarg;
+            break;
         case 'h':
             printf("%s%s", USAGE, HELP);
             return 0;
         case 'l':
             opts.load_quirks = true;
             break;
+        case 'P':
+            opts.profile = true;
+            break;
+        case 'p':
+            opts.play = optarg;
+            break;
         case 'q':
             opts.shift_quirks = true;
             break;
+        case 'R':
+            errno = 0;
+            opts.rewind_secs = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing rewind length: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0') {
+                log_error("Rewind length argument '%s' is invalid", optarg);
+                return 2;
+            }
+            break;
+        case 'r':
+            opts.record = optarg;
+            break;
+        case 'S':
+            errno = 0;
+            opts.seed = strtoull(optarg, &numend, 0);
+            if (errno != 0) {
+                log_error("Error processing seed: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0') {
+                log_error("Seed argument '%s' is invalid", optarg);
+                return 2;
+            }
+            opts.has_seed = true;
+            break;
         case 's':
             errno = 0;
             opts.scale = strtoul(optarg, &numend, 10);
@@ -207,6 +486,9 @@ int main(int argc, char **argv)
                 return 2;
             }
             break;
+        case 'T':
+            opts.trace = optarg;
+            break;
         case 't':
             errno = 0;
             opts.tone_freq = strtoul(optarg, &numend, 10);
@@ -227,6 +509,9 @@ int main(int argc, char **argv)
         case 'V':
             printf("%s", VERSION_STRING);
             return 0;
+        case 'W':
+            opts.window_surface = true;
+            break;
         case '?':
             fprintf(stderr, "%s", USAGE);
             return 2;
@@ -238,6 +523,10 @@ int main(int argc, char **argv)
         return 2;
     }
     opts.fname = argv[optind];
+    if (opts.record && opts.play) {
+        log_error("Cannot record and play a movie at the same time");
+        return 2;
+    }
 
     return run(opts);
 }
@@ -249,13 +538,48 @@ static void audio_callback(void *userdata, uint8_t *stream, int len)
     audio_ring_buffer_fill(ring, (int16_t *)stream, len / 2);
 }
 
-static void draw_pixel(int x, int y, bool on, bool high)
+static void draw_rows(const struct chip8_frame *frame, uint64_t rows)
 {
-    int xscale = high ? win_surface.xscale : win_surface.xscale * 2;
-    int yscale = high ? win_surface.yscale : win_surface.yscale * 2;
-    SDL_Rect draw_rect = {x * xscale, y * yscale, xscale, yscale};
-    SDL_FillRect(win_surface.surface, &draw_rect, on ? oncolor : offcolor);
-    win_surface.changed = true;
+    int scale = frame->highres ? 1 : 2;
+    int xscale = win_surface.xscale * scale;
+    int yscale = win_surface.yscale * scale;
+    int width = CHIP8_DISPLAY_WIDTH / scale;
+    int height = CHIP8_DISPLAY_HEIGHT / scale;
+
+    for (int y = 0; y < height; y++) {
+        SDL_Rect row_rect = {0, y * yscale, width * xscale, yscale};
+
+        if (!(rows & (UINT64_C(1) << y)))
+            continue;
+        SDL_FillRect(win_surface.surface, &row_rect, offcolor);
+        /* Each run of lit pixels can be filled in all at once */
+        for (int x = 0; x < width; x++) {
+            int start = x;
+
+            while (x < width && chip8_frame_get_pixel(frame, x, y))
+                x++;
+            if (x > start) {
+                SDL_Rect run_rect = {start * xscale, y * yscale, (x - start) * xscale, yscale};
+                SDL_FillRect(win_surface.surface, &run_rect, oncolor);
+            }
+        }
+    }
+}
+
+static void draw_texture(const struct chip8_frame *frame)
+{
+    SDL_Texture *texture = textures[frame->highres];
+    void *pixels;
+    int pitch;
+
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch)) {
+        log_error("Could not lock display texture: %s", SDL_GetError());
+        return;
+    }
+    /* A locked texture is write-only, so it has to be redrawn in full */
+    chip8_frame_to_pixels(frame, pixels, pitch, oncolor, offcolor);
+    SDL_UnlockTexture(texture);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
 }
 
 static struct surface get_window_surface(SDL_Window *window)
@@ -267,26 +591,351 @@ static struct surface get_window_surface(SDL_Window *window)
     return (struct surface){ surface, xscale, yscale };
 }
 
+static int create_renderer(SDL_Window *window)
+{
+    /* SDL falls back to its software renderer if there is nothing better */
+    if (!(renderer = SDL_CreateRenderer(window, -1, 0))) {
+        log_error("Could not create SDL renderer: %s", SDL_GetError());
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        int scale = i ? 1 : 2;
+
+        if (!(textures[i] = SDL_CreateTexture(renderer,
+                  SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                  CHIP8_DISPLAY_WIDTH / scale, CHIP8_DISPLAY_HEIGHT / scale))) {
+            log_error("Could not create display texture: %s", SDL_GetError());
+            destroy_renderer();
+            return 1;
+        }
+    }
+    oncolor = UINT32_C(0xFFFFFFFF);
+    offcolor = UINT32_C(0xFF000000);
+
+    return 0;
+}
+
+static void destroy_renderer(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (textures[i])
+            SDL_DestroyTexture(textures[i]);
+        textures[i] = NULL;
+    }
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+    renderer = NULL;
+}
+
+static void wait_frame(struct timespec *deadline, long freq)
+{
+    struct timespec now;
+    long frame_nanos = 1000000000L / freq;
+
+    deadline->tv_nsec += frame_nanos;
+    while (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - deadline->tv_sec) * 1000000000L +
+            (now.tv_nsec - deadline->tv_nsec) > frame_nanos) {
+        *deadline = now;
+        return;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) ==
+        EINTR)
+        ;
+}
+
 static struct progopts progopts_default(void)
 {
     return (struct progopts){
         .verbosity = 0,
         .scale = 6,
         .game_freq = 60,
+        .cycles_per_frame = 100,
+        .emulation_thread = false,
+        .window_surface = false,
         .load_quirks = false,
         .shift_quirks = false,
+        .profile = false,
         .tone_freq = 440,
         .tone_vol = 10,
+        .has_seed = false,
+        .seed = 0,
+        .rewind_secs = 60,
+        .heatmap = NULL,
+        .trace = NULL,
+        .checkpoint = NULL,
+        .record = NULL,
+        .play = NULL,
         .fname = NULL,
     };
 }
 
-static void redraw_all(struct chip8 *chip)
+static bool handle_event(const SDL_Event *e, SDL_Window *win,
+    const struct progopts *opts, struct chip8_input *input, bool *should_exit)
+{
+    switch (e->type) {
+    case SDL_QUIT:
+        *should_exit = true;
+        return false;
+    case SDL_WINDOWEVENT:
+        log_debug("Window changed; getting new surface and refreshing");
+        /*
+         * We need to force the window to refresh when something happens to
+         * it (e.g. it gets moved or resized) even if the game hasn't drawn
+         * anything new.  If we're drawing on the window surface, we also need
+         * to get a new one, since the old one is now invalid.
+         */
+        presented_valid = false;
+        if (!renderer)
+            win_surface = get_window_surface(win);
+        return false;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP: {
+        SDL_Keycode key = e->key.keysym.sym;
+        bool down = e->type == SDL_KEYDOWN;
+
+        if (opts->checkpoint && down && key == SDLK_F5) {
+            input->type = CHIP8_INPUT_SAVE_STATE;
+            return true;
+        } else if (opts->checkpoint && down && key == SDLK_F9) {
+            input->type = CHIP8_INPUT_LOAD_STATE;
+            return true;
+        } else if (key == SDLK_BACKSPACE) {
+            input->type = down ? CHIP8_INPUT_REWIND_START : CHIP8_INPUT_REWIND_STOP;
+            return true;
+        }
+        for (int i = 0; i < 16; i++)
+            if (key == keymap[i]) {
+                input->type = down ? CHIP8_INPUT_KEY_DOWN : CHIP8_INPUT_KEY_UP;
+                input->key = i;
+                return true;
+            }
+        return false;
+    }
+    default:
+        return false;
+    }
+}
+
+static void emulator_input(struct emulator *emu, struct chip8_input input)
+{
+    struct chip8 *chip = emu->chip;
+
+    switch (input.type) {
+    case CHIP8_INPUT_KEY_DOWN:
+        chip->key_states |= 1 << input.key;
+        break;
+    case CHIP8_INPUT_KEY_UP:
+        chip->key_states &= ~(1 << input.key);
+        break;
+    case CHIP8_INPUT_SAVE_STATE:
+        if (chip8_save_state(chip, emu->opts->checkpoint) == 0)
+            log_info("Saved state to '%s'", emu->opts->checkpoint);
+        break;
+    case CHIP8_INPUT_LOAD_STATE:
+        /* A failed load leaves the game as it was */
+        if (chip8_load_state(chip, emu->opts->checkpoint) == 0)
+            log_info("Restored state from '%s'", emu->opts->checkpoint);
+        break;
+    case CHIP8_INPUT_REWIND_START:
+        emu->rewinding = true;
+        break;
+    case CHIP8_INPUT_REWIND_STOP:
+        emu->rewinding = false;
+        break;
+    case CHIP8_INPUT_QUIT:
+        emu->finished = true;
+        break;
+    }
+}
+
+static int emulator_frame(struct emulator *emu)
+{
+    struct chip8 *chip = emu->chip;
+
+    if (emu->rewinding && emu->rewind) {
+        /* Go back one frame per frame, until we run out of history */
+        chip8_rewind_pop(emu->rewind, chip);
+        return 0;
+    }
+
+    /*
+     * Key changes only take effect between frames, so that they happen at
+     * the same point when a movie is replayed.
+     */
+    if (emu->movie && emu->opts->play) {
+        if (emu->movie_frame == emu->movie->frames) {
+            log_info("Movie finished");
+            emu->finished = true;
+            return 0;
+        }
+        chip->key_states = chip8_movie_keys(
+            emu->movie, emu->movie_frame, &emu->movie_cursor);
+        emu->movie_frame++;
+    } else if (emu->movie) {
+        chip8_movie_record(emu->movie, chip->key_states);
+        emu->movie_frame++;
+    }
+    if (chip8_run_frame(chip) & CHIP8_STOP_ERROR) {
+        log_error("Shutting down interpreter");
+        emu->finished = true;
+        return 1;
+    }
+    if (emu->rewind)
+        chip8_rewind_push(emu->rewind, chip);
+    if (chip->halted) {
+        log_info("Interpreter was halted");
+        emu->finished = true;
+    }
+
+    return 0;
+}
+
+static void *emulator_thread(void *data)
+{
+    struct emulator *emu = data;
+    struct timespec deadline;
+    struct chip8_input input;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for (unsigned long number = 0; !emu->finished; number++) {
+        struct chip8_frame *frame;
+
+        while (!emu->finished && chip8_input_queue_pop(emu->input, &input))
+            emulator_input(emu, input);
+        if (emu->finished)
+            break;
+        emu->retval = emulator_frame(emu);
+
+        frame = chip8_triple_buffer_back(emu->frames);
+        chip8_frame_capture(frame, emu->chip);
+        frame->number = number;
+        frame->last = emu->finished;
+        chip8_triple_buffer_publish(emu->frames);
+
+        if (!emu->finished && emu->opts->game_freq > 0)
+            wait_frame(&deadline, emu->opts->game_freq);
+    }
+
+    return NULL;
+}
+
+static void present(SDL_Window *win, SDL_AudioDeviceID audio_device,
+    const struct chip8_frame *frame)
+{
+    uint64_t dirty_rows = presented_valid ? frame->dirty_rows : UINT64_MAX;
+
+    /* Pause/unpause the audio track as needed */
+    SDL_PauseAudioDevice(audio_device, !frame->sound);
+    if (dirty_rows != 0 && renderer) {
+        draw_texture(frame);
+        SDL_RenderPresent(renderer);
+    } else if (dirty_rows != 0) {
+        draw_rows(frame, dirty_rows);
+        SDL_UpdateWindowSurface(win);
+    }
+    if (frame != &presented)
+        presented = *frame;
+    presented_valid = true;
+}
+
+static int run_frames(
+    struct emulator *emu, SDL_Window *win, SDL_AudioDeviceID audio_device)
+{
+    struct timespec deadline;
+    struct chip8_frame frame;
+    struct chip8_input input;
+    SDL_Event e;
+    bool should_exit = false;
+    int retval = 0;
+
+    /*
+     * Each time around the loop is one frame: input is handled, a frame's
+     * worth of instructions is run and the display is refreshed, and then we
+     * sleep until it's time for the next frame.
+     */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for (unsigned long number = 0; !should_exit && !emu->finished; number++) {
+        while (SDL_PollEvent(&e))
+            if (handle_event(&e, win, emu->opts, &input, &should_exit))
+                emulator_input(emu, input);
+        if ((retval = emulator_frame(emu)) != 0)
+            break;
+
+        chip8_frame_capture(&frame, emu->chip);
+        frame.number = number;
+        frame.last = emu->finished;
+        present(win, audio_device, &frame);
+
+        if (!emu->finished && emu->opts->game_freq > 0)
+            wait_frame(&deadline, emu->opts->game_freq);
+    }
+
+    return retval;
+}
+
+static int run_threaded(
+    struct emulator *emu, SDL_Window *win, SDL_AudioDeviceID audio_device)
 {
-    for (int i = 0; i < CHIP8_DISPLAY_WIDTH; i++)
-        for (int j = 0; j < CHIP8_DISPLAY_HEIGHT; j++) {
-            draw_pixel(i, j, chip->display[i][j], chip->highres);
+    pthread_t thread;
+    const struct chip8_frame *frame;
+    struct chip8_input input;
+    SDL_Event e;
+    /* Checking for a new frame twice per frame keeps the latency down */
+    int wait_ms = emu->opts->game_freq > 0 ? 500 / emu->opts->game_freq : 0;
+    bool should_exit = false;
+    bool stopped = false;
+    int retval = 0;
+
+    emu->frames = chip8_triple_buffer_new();
+    emu->input = chip8_input_queue_new(INPUT_QUEUE_SIZE);
+    if ((errno = pthread_create(&thread, NULL, emulator_thread, emu)) != 0) {
+        log_error("Could not start emulation thread: %s", strerror(errno));
+        retval = 1;
+        goto EXIT_HANDOFF_CREATED;
+    }
+
+    /*
+     * This thread only handles the window: input is passed on to the
+     * emulation thread, and the latest frame it has finished is presented.
+     * Neither ever waits for the other.
+     */
+    while (!should_exit) {
+        if (SDL_WaitEventTimeout(&e, wait_ms > 0 ? wait_ms : 1)) {
+            do {
+                if (handle_event(&e, win, emu->opts, &input, &should_exit) &&
+                    !chip8_input_queue_push(emu->input, input))
+                    log_warning("Input queue is full; dropping input");
+            } while (SDL_PollEvent(&e));
+        }
+        if ((frame = chip8_triple_buffer_take(emu->frames))) {
+            if (presented_valid && frame->number > presented.number + 1)
+                log_debug("Skipped %lu frames",
+                    frame->number - presented.number - 1);
+            present(win, audio_device, frame);
+            if (frame->last)
+                should_exit = stopped = true;
+        } else if (!presented_valid) {
+            present(win, audio_device, &presented);
         }
+    }
+
+    /* If the game is over, the emulation thread has stopped by itself */
+    input.type = CHIP8_INPUT_QUIT;
+    while (!stopped && !chip8_input_queue_push(emu->input, input))
+        SDL_Delay(1);
+    pthread_join(thread, NULL);
+    retval = emu->retval;
+
+EXIT_HANDOFF_CREATED:
+    chip8_input_queue_destroy(emu->input);
+    chip8_triple_buffer_destroy(emu->frames);
+    return retval;
 }
 
 static int run(struct progopts opts)
@@ -299,9 +948,10 @@ static int run(struct progopts opts)
     struct audio_ring_buffer *audio_ring;
     struct chip8_options chipopts = chip8_options_default();
     struct chip8 *chip;
-    FILE *input;
-    SDL_Event e;
-    bool should_exit = false;
+    struct chip8_rewind *rewind = NULL;
+    struct chip8_movie *movie = NULL;
+    struct chip8_trace *trace = NULL;
+    struct emulator emu;
     int retval = 0;
 
     /* Set correct log level */
@@ -315,12 +965,42 @@ static int run(struct progopts opts)
     /* Set options for the interpreter */
     chipopts.load_quirks = opts.load_quirks;
     chipopts.shift_quirks = opts.shift_quirks;
+    chipopts.profile = opts.profile || opts.heatmap;
     chipopts.timer_freq = opts.game_freq;
+    chipopts.seed = opts.has_seed ? opts.seed : (uint64_t)time(NULL);
+    /*
+     * The game runs a frame at a time, with the frames paced by the main
+     * loop, so it doesn't need to consult the clock itself.
+     */
+    chipopts.virtual_clock = true;
+    chipopts.cycles_per_frame = opts.cycles_per_frame;
+
+    /*
+     * Movies carry their own interpreter options, and anything which changes
+     * the game state behind the movie's back would break them.
+     */
+    if (opts.play) {
+        if (!(movie = chip8_movie_load(opts.play))) {
+            log_error("Could not load movie; aborting");
+            retval = 1;
+            goto ERROR_NOTHING_INITIALIZED;
+        }
+        chipopts = chip8_movie_options(movie, chipopts);
+    } else if (opts.record) {
+        movie = chip8_movie_new(chipopts);
+    }
+    if (movie) {
+        if (opts.checkpoint)
+            log_warning("Checkpoints are disabled while recording or playing a movie");
+        opts.checkpoint = NULL;
+        opts.rewind_secs = 0;
+    }
+    log_info("Using random seed %" PRIu64, chipopts.seed);
 
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
         log_error("Could not initialize SDL: %s", SDL_GetError());
         retval = 1;
-        goto ERROR_NOTHING_INITIALIZED;
+        goto ERROR_MOVIE_LOADED;
     }
     if (!(win = SDL_CreateWindow("Chip-8", SDL_WINDOWPOS_UNDEFINED,
             SDL_WINDOWPOS_UNDEFINED, win_width, win_height,
@@ -346,94 +1026,73 @@ static int run(struct progopts opts)
     }
 
     chip = chip8_new(chipopts);
-    chip->draw_callback = draw_pixel;
-    win_surface = get_window_surface(win);
-    oncolor = SDL_MapRGB(win_surface.surface->format, 255, 255, 255);
-    offcolor = SDL_MapRGB(win_surface.surface->format, 0, 0, 0);
-    redraw_all(chip);
-    SDL_UpdateWindowSurface(win);
-
-    if (!(input = fopen(opts.fname, "r"))) {
-        log_error("Failed to open game file; aborting");
-        retval = 1;
-        goto ERROR_CHIP8_CREATED;
+    /* One keyframe per second keeps the deltas small */
+    if (opts.rewind_secs > 0 && opts.game_freq > 0)
+        rewind = chip8_rewind_new(
+            opts.rewind_secs * opts.game_freq, opts.game_freq);
+    if (opts.window_surface || create_renderer(win)) {
+        if (!opts.window_surface)
+            log_warning("Falling back to drawing on the window surface");
+        win_surface = get_window_surface(win);
+        oncolor = SDL_MapRGB(win_surface.surface->format, 255, 255, 255);
+        offcolor = SDL_MapRGB(win_surface.surface->format, 0, 0, 0);
     }
-    if (chip8_load_from_file(chip, input)) {
+    present(win, audio_device, &presented);
+
+    if (chip8_load_from_path(chip, opts.fname)) {
         log_error("Could not load game; aborting");
-        fclose(input);
         retval = 1;
         goto ERROR_CHIP8_CREATED;
     }
-    fclose(input);
-
-    while (!should_exit) {
-        while (SDL_PollEvent(&e)) {
-            switch (e.type) {
-            case SDL_QUIT:
-                should_exit = true;
-                break;
-            case SDL_WINDOWEVENT:
-                log_debug("Window changed; getting new surface and refreshing");
-                /*
-                 * We need to force the window to refresh when something
-                 * happens to it (e.g. it gets moved or resized) even if the
-                 * interpreter hasn't gotten any new display information.
-                 */
-                chip->needs_full_redraw = true;
-                /*
-                 * We also need to get a new window surface, since the old one
-                 * is now invalid.
-                 */
-                win_surface = get_window_surface(win);
-                break;
-            case SDL_KEYDOWN: {
-                SDL_Keycode key = e.key.keysym.sym;
-
-                for (int i = 0; i < 16; i++)
-                    if (key == keymap[i])
-                        chip->key_states |= 1 << i;
-            } break;
-            case SDL_KEYUP: {
-                SDL_Keycode key = e.key.keysym.sym;
-
-                for (int i = 0; i < 16; i++)
-                    if (key == keymap[i])
-                        chip->key_states &= ~(1 << i);
-            } break;
-            }
-        }
-        if (chip8_step(chip) != 0) {
-            log_error("Shutting down interpreter");
+    if (opts.checkpoint && access(opts.checkpoint, F_OK) == 0) {
+        log_info("Restoring state from '%s'", opts.checkpoint);
+        if (chip8_load_state(chip, opts.checkpoint)) {
+            log_error("Could not restore state; aborting");
             retval = 1;
             goto ERROR_CHIP8_CREATED;
         }
-        /* Pause/unpause the audio track as needed */
-        SDL_PauseAudioDevice(audio_device, chip->reg_st == 0);
-        /* Refresh display as needed */
-        if (chip->needs_full_redraw) {
-            redraw_all(chip);
-            chip->needs_full_redraw = false;
-        }
-        if (win_surface.changed) {
-            SDL_UpdateWindowSurface(win);
-            win_surface.changed = false;
-        }
-        if (chip->halted) {
-            log_info("Interpreter was halted");
-            should_exit = true;
+    }
+    if (opts.trace) {
+        if (!(trace = chip8_trace_open(opts.trace,
+                  chip->opts.shift_quirks ? CHIP8_TRACE_SHIFT_QUIRKS : 0))) {
+            log_error("Could not start trace; aborting");
+            retval = 1;
+            goto ERROR_CHIP8_CREATED;
         }
-
-        sched_yield();
+        chip8_set_trace(chip, trace);
     }
 
+    emu = (struct emulator){
+        .opts = &opts,
+        .chip = chip,
+        .rewind = rewind,
+        .movie = movie,
+    };
+    retval = opts.emulation_thread ? run_threaded(&emu, win, audio_device)
+                                   : run_frames(&emu, win, audio_device);
+
 ERROR_CHIP8_CREATED:
+    /* A movie of a run which ended in an error is the most useful kind */
+    if (opts.record && chip8_movie_save(movie, opts.record) == 0)
+        log_info("Saved movie to '%s'", opts.record);
+    if (opts.profile)
+        chip8_profile_print(chip8_get_profile(chip), stdout);
+    if (opts.heatmap &&
+        chip8_profile_save_heatmap(chip8_get_profile(chip), opts.heatmap) == 0)
+        log_info("Saved heat map to '%s'", opts.heatmap);
+    chip8_rewind_destroy(rewind);
     chip8_destroy(chip);
+    if (trace && chip8_trace_close(trace) == 0)
+        log_info("Saved trace to '%s'", opts.trace);
     SDL_CloseAudioDevice(audio_device);
 ERROR_AUDIO_RING_CREATED:
     audio_ring_buffer_free(audio_ring);
+    destroy_renderer();
     SDL_DestroyWindow(win);
 ERROR_SDL_INITIALIZED:
     SDL_Quit();
+ERROR_MOVIE_LOADED:
+    chip8_movie_free(movie);
 ERROR_NOTHING_INITIALIZED:
     return retval;
 }
@@ -36,6 +36,7 @@ static const char *HELP =
     "FILE is provided, or if FILE is '-'.\n"
     "\n"
     "Options:\n"
+    "  -m, --map=FILE         write a symbol map to FILE\n"
     "  -o, --output=OUTPUT    set output file name\n"
     "  -q, --shift-quirks     enable shift quirks mode\n"
     "  -v, --verbose          increase verbosity\n"
@@ -65,6 +66,12 @@ struct progopts {
      * For consistency, this should be heap-allocated memory.
      */
     char *output;
+    /**
+     * The name of the file to which a symbol map should be written, or NULL.
+     *
+     * For consistency, this should be heap-allocated memory.
+     */
+    char *map;
     /**
      * The input file name.
      *
@@ -87,7 +94,8 @@ int main(int argc, char **argv)
 {
     int option;
     struct progopts opts = progopts_default();
-    const struct option options[] = {{"output", required_argument, NULL, 'o'},
+    const struct option options[] = {{"map", required_argument, NULL, 'm'},
+        {"output", required_argument, NULL, 'o'},
         {"shift-quirks", no_argument, NULL, 'q'},
         {"verbose", no_argument, NULL, 'v'}, {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'V'}, {0, 0, 0, 0}};
@@ -95,8 +103,12 @@ int main(int argc, char **argv)
 
     log_init(argc >= 1 ? argv[0] : "chip8asm", stderr, LOG_WARNING);
 
-    while ((option = getopt_long(argc, argv, "o:qvhV", options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "m:o:qvhV", options, NULL)) != -1) {
         switch (option) {
+        case 'm':
+            free(opts.map);
+            opts.map = xstrdup(optarg);
+            break;
         case 'o':
             free(opts.output);
             opts.output = xstrdup(optarg);
@@ -140,6 +152,7 @@ int main(int argc, char **argv)
 
 EXIT:
     free(opts.output);
+    free(opts.map);
     free(opts.input);
     return retval;
 }
@@ -147,7 +160,8 @@ EXIT:
 static struct progopts progopts_default(void)
 {
     return (struct progopts){
-        .verbosity = 0, .shift_quirks = false, .input = NULL, .output = NULL};
+        .verbosity = 0, .shift_quirks = false, .input = NULL, .output = NULL,
+        .map = NULL};
 }
 
 static char *replace_extension(const char *fname)
@@ -170,7 +184,7 @@ static int run(struct progopts opts)
     struct chip8asm *chipasm;
     struct chip8asm_options asmopts;
     struct chip8asm_program *prog;
-    FILE *input, *output;
+    FILE *input, *output, *map;
     char str[MAXLINE];
     int err;
     int retval = 0;
@@ -231,6 +245,20 @@ static int run(struct progopts opts)
         goto EXIT_OUTPUT_OPENED;
     }
 
+    if (opts.map) {
+        if (!(map = fopen(opts.map, "w"))) {
+            log_error(
+                "Could not open symbol map for writing: %s", strerror(errno));
+            retval = 1;
+            goto EXIT_OUTPUT_OPENED;
+        }
+        err = chip8asm_program_write_symbols(prog, map);
+        if (fclose(map) != 0 || err) {
+            log_error("Error writing to symbol map: %s", strerror(errno));
+            retval = 1;
+        }
+    }
+
 EXIT_OUTPUT_OPENED:
     if (output != stdout)
         fclose(output);
@@ -0,0 +1,521 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interpreter.h"
+#include "log.h"
+#include "memory.h"
+#include "movie.h"
+#include "pack.h"
+#include "rom.h"
+#include "taskpool.h"
+
+static const char *HELP =
+    "Runs many Chip-8/Super-Chip interpreters in parallel without a display.\n"
+    "\n"
+    "Options:\n"
+    "  -c, --cycles=CYCLES         set instructions per frame (default 100)\n"
+    "  -f, --frames=FRAMES         set number of frames to run (default 600)\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -J, --jit                   enable JIT compilation\n"
+    "  -j, --jobs=JOBS             set number of threads to use\n"
+    "  -l, --load-quirks           enable load quirks mode\n"
+    "  -n, --instances=N           set number of instances per file (default 1)\n"
+    "  -P, --pack=PACK             take games from the pack file PACK\n"
+    "  -p, --play=MOVIE            replay the input movie MOVIE\n"
+    "  -q, --shift-quirks          enable shift quirks mode\n"
+    "  -S, --seed=SEED             set base random number seed (default 0)\n"
+    "  -V, --version               show version information and exit\n"
+    "  -v, --verbose               increase verbosity\n";
+static const char *USAGE = "Usage: chip8batch [OPTION...] FILE...\n"
+                           "       chip8batch [OPTION...] -P PACK [GAME...]\n";
+static const char *VERSION_STRING = "chip8batch " PROJECT_VERSION "\n";
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The number of instructions to execute per frame (default 100).
+     */
+    unsigned long cycles_per_frame;
+    /**
+     * The number of frames to run each instance for (default 600).
+     */
+    unsigned long frames;
+    /**
+     * The number of threads to use (default: one per processor).
+     */
+    unsigned long jobs;
+    /**
+     * The number of instances to run for each game file (default 1).
+     */
+    unsigned long instances;
+    /**
+     * The random number generator seed for the first instance of each game
+     * (default 0); instance `n` uses `seed + n`, unless a movie is being
+     * replayed.
+     */
+    uint64_t seed;
+    /**
+     * The file from which to load an input movie to replay, or NULL.
+     */
+    char *play;
+    /**
+     * The pack file from which to take games, or NULL.
+     */
+    char *pack;
+    /**
+     * Whether to enable JIT compilation (default false).
+     */
+    bool jit;
+    /**
+     * Whether to use load quirks mode (default false).
+     */
+    bool load_quirks;
+    /**
+     * Whether to use shift quirks mode (default false).
+     */
+    bool shift_quirks;
+};
+
+/**
+ * A game which has been read into memory.
+ */
+struct rom {
+    /**
+     * The name of the file (or of the game in the pack).
+     */
+    const char *fname;
+    /**
+     * The entry of the game in the pack, or NULL if it is not from a pack.
+     */
+    const struct chip8_pack_entry *entry;
+    /**
+     * The memory image which every instance running the game starts from.
+     */
+    struct chip8_image image;
+};
+
+/**
+ * The final state of an interpreter instance.
+ */
+enum batch_status {
+    /**
+     * The instance was still running after the requested number of frames.
+     */
+    BATCH_RUNNING,
+    /**
+     * The game exited.
+     */
+    BATCH_HALTED,
+    /**
+     * The instance stopped because of an error.
+     */
+    BATCH_ERROR,
+};
+
+/**
+ * The results of running a single instance.
+ */
+struct batch_result {
+    enum batch_status status;
+    /**
+     * The number of frames which were completed.
+     */
+    unsigned long frames;
+    /**
+     * The number of instructions executed.
+     */
+    uint64_t cycles;
+    /**
+     * A hash of the final contents of the display.
+     */
+    uint64_t display_hash;
+};
+
+/**
+ * Everything the worker threads need to run the instances.
+ *
+ * Instance `i` runs the game `roms[i / opts.instances]`, and stores its results
+ * in `results[i]`; nothing else is shared between threads.
+ */
+struct batch {
+    struct progopts opts;
+    struct chip8_options chipopts;
+    const struct rom *roms;
+    /**
+     * The input movie to replay, or NULL.
+     */
+    const struct chip8_movie *movie;
+    struct batch_result *results;
+    /**
+     * The pool from which the instances are taken (with room for one per
+     * thread, since each thread only runs one instance at a time).
+     */
+    struct chip8_pool *pool;
+};
+
+static struct progopts progopts_default(void);
+/**
+ * Parses a positive integer option argument.
+ *
+ * @return An error code.
+ */
+static int parse_count(const char *arg, const char *what, unsigned long *value);
+/**
+ * Returns the name of the given status, for output.
+ */
+static const char *batch_status_string(enum batch_status status);
+/**
+ * Returns a hash of the contents of the display (using FNV-1a).
+ */
+static uint64_t display_hash(const struct chip8 *chip);
+/**
+ * Runs a single instance (used as the task for the thread pool).
+ */
+static void run_instance(size_t index, void *batch);
+/**
+ * Opens a game, either from a file or from a pack.
+ *
+ * @param pack The pack to take the game from, or NULL to read it from a file.
+ * @param name The name of the file or of the game in the pack, or the SHA-1
+ * digest of the game in the pack (in hexadecimal).  If this is NULL, the game
+ * at index `idx` in the pack is used instead.
+ * @return An error code.
+ */
+static int rom_open(struct rom *rom, const struct chip8_pack *pack,
+    const char *name, size_t idx);
+static int run(struct progopts opts, int n_files, char **fnames);
+
+int main(int argc, char **argv)
+{
+    struct progopts opts = progopts_default();
+    int option;
+    const struct option options[] = {
+        {"cycles", required_argument, NULL, 'c'},
+        {"frames", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {"jit", no_argument, NULL, 'J'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"load-quirks", no_argument, NULL, 'l'},
+        {"instances", required_argument, NULL, 'n'},
+        {"pack", required_argument, NULL, 'P'},
+        {"play", required_argument, NULL, 'p'},
+        {"shift-quirks", no_argument, NULL, 'q'},
+        {"seed", required_argument, NULL, 'S'},
+        {"version", no_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'}, {0, 0, 0, 0},
+    };
+
+    log_init(argc >= 1 ? argv[0] : "chip8batch", stderr, LOG_WARNING);
+
+    while ((option = getopt_long(argc, argv, "c:f:hJj:ln:P:p:qS:Vv", options, NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            if (parse_count(optarg, "cycle count", &opts.cycles_per_frame))
+                return 2;
+            break;
+        case 'f':
+            if (parse_count(optarg, "frame count", &opts.frames))
+                return 2;
+            break;
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            return 0;
+        case 'J':
+            opts.jit = true;
+            break;
+        case 'j':
+            if (parse_count(optarg, "job count", &opts.jobs))
+                return 2;
+            break;
+        case 'l':
+            opts.load_quirks = true;
+            break;
+        case 'n':
+            if (parse_count(optarg, "instance count", &opts.instances))
+                return 2;
+            break;
+        case 'P':
+            opts.pack = optarg;
+            break;
+        case 'p':
+            opts.play = optarg;
+            break;
+        case 'q':
+            opts.shift_quirks = true;
+            break;
+        case 'S': {
+            char *numend;
+
+            errno = 0;
+            opts.seed = strtoull(optarg, &numend, 0);
+            if (errno != 0 || *numend != '\0') {
+                log_error("Invalid seed '%s'", optarg);
+                return 2;
+            }
+        } break;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            return 0;
+        case 'v':
+            opts.verbosity++;
+            break;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            return 2;
+        }
+    }
+
+    /* Without any names, every game in the pack is run */
+    if (optind >= argc && !opts.pack) {
+        fprintf(stderr, "%s", USAGE);
+        return 2;
+    }
+
+    return run(opts, argc - optind, argv + optind);
+}
+
+static struct progopts progopts_default(void)
+{
+    return (struct progopts){
+        .verbosity = 0,
+        .cycles_per_frame = 100,
+        .frames = 600,
+        .jobs = taskpool_default_threads(),
+        .instances = 1,
+        .seed = 0,
+        .play = NULL,
+        .pack = NULL,
+        .jit = false,
+        .load_quirks = false,
+        .shift_quirks = false,
+    };
+}
+
+static int parse_count(const char *arg, const char *what, unsigned long *value)
+{
+    char *numend;
+
+    errno = 0;
+    *value = strtoul(arg, &numend, 10);
+    if (errno != 0) {
+        log_error("Error processing %s: %s", what, strerror(errno));
+        return 1;
+    } else if (*numend != '\0' || *value == 0) {
+        log_error("Invalid %s '%s'", what, arg);
+        return 1;
+    }
+
+    return 0;
+}
+
+static const char *batch_status_string(enum batch_status status)
+{
+    switch (status) {
+    case BATCH_RUNNING:
+        return "running";
+    case BATCH_HALTED:
+        return "halted";
+    case BATCH_ERROR:
+        return "error";
+    default:
+        return "unknown";
+    }
+}
+
+static uint64_t display_hash(const struct chip8 *chip)
+{
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++)
+        for (int w = 0; w < CHIP8_DISPLAY_WORDS; w++)
+            for (int b = 0; b < 8; b++) {
+                hash ^= (chip->display[y][w] >> (56 - 8 * b)) & 0xFF;
+                hash *= UINT64_C(0x100000001B3);
+            }
+
+    return hash;
+}
+
+static void run_instance(size_t index, void *batch)
+{
+    struct batch *b = batch;
+    const struct rom *rom = &b->roms[index / b->opts.instances];
+    struct batch_result *result = &b->results[index];
+    struct chip8_options chipopts = b->chipopts;
+    struct chip8 *chip;
+    size_t cursor = 0;
+
+    /* A movie records the quirks it needs, which take precedence */
+    if (rom->entry && !b->movie)
+        chipopts = chip8_pack_options(rom->entry, chipopts);
+    /* Every instance of a movie keeps the recorded seed */
+    if (!b->movie)
+        chipopts.seed = b->opts.seed + index % b->opts.instances;
+    if (!(chip = chip8_pool_alloc(b->pool, chipopts, &rom->image))) {
+        log_error("No interpreter available for instance %zu of '%s'",
+            index % b->opts.instances, rom->fname);
+        result->status = BATCH_ERROR;
+        return;
+    }
+
+    result->status = BATCH_RUNNING;
+    while (result->frames < b->opts.frames) {
+        unsigned stopped;
+
+        if (b->movie)
+            chip->key_states =
+                chip8_movie_keys(b->movie, result->frames, &cursor);
+        stopped = chip8_run_frame(chip);
+
+        if (stopped & CHIP8_STOP_ERROR) {
+            log_info("Instance %zu of '%s' stopped with an error",
+                index % b->opts.instances, rom->fname);
+            result->status = BATCH_ERROR;
+            break;
+        } else if (stopped & CHIP8_STOP_HALT) {
+            result->status = BATCH_HALTED;
+            break;
+        }
+        result->frames++;
+    }
+
+    result->cycles = chip->cycles;
+    result->display_hash = display_hash(chip);
+    chip8_pool_free(b->pool, chip);
+}
+
+static int rom_open(struct rom *rom, const struct chip8_pack *pack,
+    const char *name, size_t idx)
+{
+    uint8_t sha1[CHIP8_SHA1_LEN];
+
+    if (!pack) {
+        struct chip8_rom file;
+        int retval;
+
+        if (chip8_rom_open(&file, name))
+            return 1;
+        rom->fname = name;
+        retval = chip8_image_init(&rom->image, file.data, file.len);
+        chip8_rom_close(&file);
+        return retval;
+    }
+
+    if (!name)
+        rom->entry = chip8_pack_get(pack, idx);
+    else if (chip8_sha1_parse(name, sha1) == 0)
+        rom->entry = chip8_pack_find(pack, sha1);
+    else
+        rom->entry = chip8_pack_find_name(pack, name);
+    if (!rom->entry) {
+        log_error("There is no game '%s' in the pack", name);
+        return 1;
+    }
+    rom->fname = chip8_pack_name(pack, rom->entry);
+
+    return chip8_image_init(
+        &rom->image, chip8_pack_data(pack, rom->entry), rom->entry->len);
+}
+
+static int run(struct progopts opts, int n_files, char **fnames)
+{
+    struct batch batch;
+    struct chip8_pack *pack = NULL;
+    struct rom *roms;
+    size_t n_roms = n_files;
+    size_t n_instances;
+    struct chip8_movie *movie = NULL;
+    int retval = 0;
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity == 2)
+        log_set_level(LOG_DEBUG);
+    else if (opts.verbosity >= 3)
+        log_set_level(LOG_TRACE);
+
+    if (opts.pack) {
+        if (!(pack = chip8_pack_open(opts.pack)))
+            return 1;
+        if (n_files == 0 && (n_roms = chip8_pack_size(pack)) == 0) {
+            log_error("Pack '%s' is empty", opts.pack);
+            chip8_pack_close(pack);
+            return 1;
+        }
+    }
+    roms = xcalloc(n_roms, sizeof *roms);
+    n_instances = n_roms * opts.instances;
+    for (size_t i = 0; i < n_roms; i++)
+        if (rom_open(&roms[i], pack, n_files > 0 ? fnames[i] : NULL, i)) {
+            retval = 1;
+            goto EXIT_ROMS_READ;
+        }
+
+    batch.chipopts = chip8_options_default();
+    batch.chipopts.virtual_clock = true;
+    batch.chipopts.cycles_per_frame = opts.cycles_per_frame;
+    batch.chipopts.jit = opts.jit;
+    batch.chipopts.load_quirks = opts.load_quirks;
+    batch.chipopts.shift_quirks = opts.shift_quirks;
+    /* The movie determines everything that affects the outcome */
+    if (opts.play) {
+        if (!(movie = chip8_movie_load(opts.play))) {
+            retval = 1;
+            goto EXIT_ROMS_READ;
+        }
+        batch.chipopts = chip8_movie_options(movie, batch.chipopts);
+        opts.frames = movie->frames;
+    }
+    batch.opts = opts;
+    batch.roms = roms;
+    batch.movie = movie;
+    batch.results = xcalloc(n_instances, sizeof *batch.results);
+    batch.pool = chip8_pool_new(opts.jobs);
+
+    log_info("Running %zu instances for %lu frames using %lu threads",
+        n_instances, opts.frames, opts.jobs);
+    if (taskpool_run(opts.jobs, n_instances, run_instance, &batch)) {
+        retval = 1;
+        goto EXIT_RESULTS_CREATED;
+    }
+
+    for (size_t i = 0; i < n_instances; i++) {
+        struct batch_result *result = &batch.results[i];
+
+        printf("%s\t%zu\t%s\t%lu\t%" PRIu64 "\t%016" PRIx64 "\n",
+            roms[i / opts.instances].fname, i % opts.instances,
+            batch_status_string(result->status), result->frames,
+            result->cycles, result->display_hash);
+        if (result->status == BATCH_ERROR)
+            retval = 1;
+    }
+
+EXIT_RESULTS_CREATED:
+    chip8_pool_destroy(batch.pool);
+    free(batch.results);
+    chip8_movie_free(movie);
+EXIT_ROMS_READ:
+    free(roms);
+    chip8_pack_close(pack);
+    return retval;
+}
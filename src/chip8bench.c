@@ -0,0 +1,433 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "interpreter.h"
+#include "log.h"
+#include "memory.h"
+
+static const char *HELP =
+    "Measures the speed of the Chip-8/Super-Chip interpreter.\n"
+    "\n"
+    "Options:\n"
+    "  -c, --cycles=CYCLES         set instructions to run per game (default 10000000)\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -J, --jit                   enable JIT compilation\n"
+    "  -V, --version               show version information and exit\n"
+    "  -v, --verbose               increase verbosity\n";
+static const char *USAGE = "Usage: chip8bench [OPTION...] FILE|DIR...\n";
+static const char *VERSION_STRING = "chip8bench " PROJECT_VERSION "\n";
+
+/**
+ * The number of instructions per frame.
+ */
+#define BENCH_CYCLES_PER_FRAME 100
+/**
+ * The number of nanoseconds in a second.
+ */
+#define NANOS_IN_SECOND 1000000000L
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The number of instructions to run each game for (default 10000000).
+     */
+    unsigned long cycles;
+    /**
+     * Whether to enable JIT compilation (default false).
+     */
+    bool jit;
+};
+
+/**
+ * The results of benchmarking a single game.
+ */
+struct bench_result {
+    /**
+     * The name of the game file.
+     */
+    char *fname;
+    /**
+     * Whether the game stopped early (by exiting or with an error).
+     */
+    bool stopped;
+    /**
+     * Whether the game stopped because of an error.
+     */
+    bool error;
+    /**
+     * The number of instructions executed.
+     */
+    uint64_t cycles;
+    /**
+     * The number of sprites drawn.
+     */
+    uint64_t draws;
+    /**
+     * The time taken, in nanoseconds.
+     */
+    uint64_t nanos;
+};
+
+/**
+ * A growable list of game files.
+ */
+struct file_list {
+    char **fnames;
+    size_t len;
+    size_t cap;
+};
+
+static struct progopts progopts_default(void);
+/**
+ * Adds the given file to the list, or every game file in it if it is a
+ * directory.
+ *
+ * Only files without an extension, or with one of the usual game file
+ * extensions, are taken from directories, so that documentation and
+ * subdirectories of sources are skipped.
+ *
+ * @return An error code.
+ */
+static int file_list_add(struct file_list *list, const char *path);
+/**
+ * Adds a copy of the given file name to the list.
+ */
+static void file_list_push(struct file_list *list, const char *fname);
+/**
+ * Returns whether the given file name looks like a game file.
+ */
+static bool is_game_name(const char *name);
+/**
+ * Compares two file names (for qsort).
+ */
+static int compare_fnames(const void *a, const void *b);
+/**
+ * Returns the key states to use for the given frame.
+ *
+ * The script presses each key in turn for four frames and then releases it
+ * for four frames, so that games which wait for input keep making progress.
+ */
+static uint16_t scripted_keys(unsigned long frame);
+/**
+ * Returns the current value of the monotonic clock, in nanoseconds.
+ */
+static uint64_t now_nanos(void);
+/**
+ * Runs a single game and records the results.
+ *
+ * @return An error code.
+ */
+static int bench_file(const struct progopts *opts, struct bench_result *result);
+/**
+ * Writes the given string to the output as a JSON string literal.
+ */
+static void print_json_string(const char *s);
+/**
+ * Writes the measurements derived from the given totals as JSON object
+ * members.
+ */
+static void print_json_rates(uint64_t cycles, uint64_t draws, uint64_t nanos);
+static int run(struct progopts opts, int n_paths, char **paths);
+
+int main(int argc, char **argv)
+{
+    struct progopts opts = progopts_default();
+    int option;
+    const struct option options[] = {
+        {"cycles", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {"jit", no_argument, NULL, 'J'},
+        {"version", no_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'}, {0, 0, 0, 0},
+    };
+
+    log_init(argc >= 1 ? argv[0] : "chip8bench", stderr, LOG_WARNING);
+
+    while ((option = getopt_long(argc, argv, "c:hJVv", options, NULL)) != -1) {
+        char *numend;
+
+        switch (option) {
+        case 'c':
+            errno = 0;
+            opts.cycles = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing cycle count: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0' || opts.cycles == 0) {
+                log_error("Invalid cycle count '%s'", optarg);
+                return 2;
+            }
+            break;
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            return 0;
+        case 'J':
+            opts.jit = true;
+            break;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            return 0;
+        case 'v':
+            opts.verbosity++;
+            break;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            return 2;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "%s", USAGE);
+        return 2;
+    }
+
+    return run(opts, argc - optind, argv + optind);
+}
+
+static struct progopts progopts_default(void)
+{
+    return (struct progopts){
+        .verbosity = 0,
+        .cycles = 10000000,
+        .jit = false,
+    };
+}
+
+static int file_list_add(struct file_list *list, const char *path)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+
+    if (stat(path, &st) != 0) {
+        log_error("Could not access '%s': %s", path, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        file_list_push(list, path);
+        return 0;
+    }
+
+    if (!(dir = opendir(path))) {
+        log_error("Could not open directory '%s': %s", path, strerror(errno));
+        return 1;
+    }
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        char *fname;
+
+        if (!is_game_name(entry->d_name))
+            continue;
+        fname = xmalloc(len);
+        snprintf(fname, len, "%s/%s", path, entry->d_name);
+        if (stat(fname, &st) == 0 && S_ISREG(st.st_mode))
+            file_list_push(list, fname);
+        free(fname);
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+static void file_list_push(struct file_list *list, const char *fname)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 32;
+        list->fnames = xrealloc(list->fnames, list->cap * sizeof *list->fnames);
+    }
+    list->fnames[list->len++] = xstrdup(fname);
+}
+
+static bool is_game_name(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    if (name[0] == '.')
+        return false;
+    return !ext || strcmp(ext, ".ch8") == 0 || strcmp(ext, ".c8") == 0 ||
+        strcmp(ext, ".sc8") == 0;
+}
+
+static int compare_fnames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static uint16_t scripted_keys(unsigned long frame)
+{
+    return frame % 8 < 4 ? 1 << (frame / 8 % 16) : 0;
+}
+
+static uint64_t now_nanos(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NANOS_IN_SECOND + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_file(const struct progopts *opts, struct bench_result *result)
+{
+    struct chip8_options chipopts = chip8_options_default();
+    struct chip8 *chip;
+    unsigned long frame = 0;
+    uint64_t start;
+    int retval = 0;
+
+    /* Everything that could vary between runs is fixed */
+    chipopts.virtual_clock = true;
+    chipopts.cycles_per_frame = BENCH_CYCLES_PER_FRAME;
+    chipopts.seed = 0;
+    /* Skipped iterations would count as instructions which never ran */
+    chipopts.skip_idle = false;
+    chipopts.jit = opts->jit;
+    chip = chip8_new(chipopts);
+
+    if (chip8_load_from_path(chip, result->fname)) {
+        log_error("Could not load game file '%s'", result->fname);
+        retval = 1;
+        goto EXIT_CHIP8_CREATED;
+    }
+
+    start = now_nanos();
+    while (chip->cycles < opts->cycles) {
+        unsigned stopped;
+
+        chip->key_states = scripted_keys(frame++);
+        stopped = chip8_run_frame(chip);
+        if (stopped & (CHIP8_STOP_HALT | CHIP8_STOP_ERROR)) {
+            log_info("Game '%s' stopped after %" PRIu64 " instructions",
+                result->fname, chip->cycles);
+            result->stopped = true;
+            result->error = stopped & CHIP8_STOP_ERROR;
+            break;
+        }
+    }
+    result->nanos = now_nanos() - start;
+    result->cycles = chip->cycles;
+    result->draws = chip->draws;
+
+EXIT_CHIP8_CREATED:
+    chip8_destroy(chip);
+    return retval;
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", (unsigned)(unsigned char)*s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_json_rates(uint64_t cycles, uint64_t draws, uint64_t nanos)
+{
+    double seconds = (double)nanos / NANOS_IN_SECOND;
+
+    printf("\"instructions\": %" PRIu64 ", ", cycles);
+    printf("\"draws\": %" PRIu64 ", ", draws);
+    printf("\"seconds\": %.6f, ", seconds);
+    printf("\"mips\": %.3f, ", nanos ? cycles / seconds / 1e6 : 0.0);
+    printf("\"ns_per_instruction\": %.3f, ",
+        cycles ? (double)nanos / cycles : 0.0);
+    printf("\"draws_per_second\": %.1f", nanos ? draws / seconds : 0.0);
+}
+
+static int run(struct progopts opts, int n_paths, char **paths)
+{
+    struct file_list files = {NULL, 0, 0};
+    struct bench_result *results;
+    uint64_t total_cycles = 0, total_draws = 0, total_nanos = 0;
+    struct rusage usage;
+    int retval = 0;
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity == 2)
+        log_set_level(LOG_DEBUG);
+    else if (opts.verbosity >= 3)
+        log_set_level(LOG_TRACE);
+
+    for (int i = 0; i < n_paths; i++)
+        if (file_list_add(&files, paths[i])) {
+            retval = 1;
+            goto EXIT_FILES_LISTED;
+        }
+    /* Directory order is arbitrary, but the output shouldn't be */
+    qsort(files.fnames, files.len, sizeof *files.fnames, compare_fnames);
+
+    results = xcalloc(files.len, sizeof *results);
+    for (size_t i = 0; i < files.len; i++) {
+        results[i].fname = files.fnames[i];
+        if (bench_file(&opts, &results[i])) {
+            retval = 1;
+            goto EXIT_RESULTS_CREATED;
+        }
+        total_cycles += results[i].cycles;
+        total_draws += results[i].draws;
+        total_nanos += results[i].nanos;
+    }
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\n");
+    printf("  \"version\": ");
+    print_json_string(PROJECT_VERSION);
+    printf(",\n  \"jit\": %s,\n", opts.jit ? "true" : "false");
+    printf("  \"cycles_per_game\": %lu,\n", opts.cycles);
+    printf("  \"games\": [\n");
+    for (size_t i = 0; i < files.len; i++) {
+        struct bench_result *result = &results[i];
+
+        printf("    {\"file\": ");
+        print_json_string(result->fname);
+        printf(", \"status\": \"%s\", ",
+            result->error ? "error" : result->stopped ? "halted" : "running");
+        print_json_rates(result->cycles, result->draws, result->nanos);
+        printf("}%s\n", i + 1 < files.len ? "," : "");
+    }
+    printf("  ],\n");
+    printf("  \"total\": {");
+    print_json_rates(total_cycles, total_draws, total_nanos);
+    printf("},\n");
+    /* On Linux, ru_maxrss is in kilobytes */
+    printf("  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+    printf("}\n");
+
+EXIT_RESULTS_CREATED:
+    free(results);
+EXIT_FILES_LISTED:
+    for (size_t i = 0; i < files.len; i++)
+        free(files.fnames[i]);
+    free(files.fnames);
+    return retval;
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "log.h"
+#include "memory.h"
+
+static const char *HELP =
+    "Ranks the subroutines of a Chip-8/Super-Chip game by execution count.\n"
+    "\n"
+    "Options:\n"
+    "  -d, --disasm=FILE           take symbols from chip8disasm output FILE\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -m, --map=FILE              take symbols from chip8asm symbol map FILE\n"
+    "  -n, --top=N                 show only the N busiest subroutines\n"
+    "  -V, --version               show version information and exit\n"
+    "  -v, --verbose               increase verbosity\n";
+static const char *USAGE = "Usage: chip8heat [OPTION...] HEATMAP\n";
+static const char *VERSION_STRING = "chip8heat " PROJECT_VERSION "\n";
+
+/**
+ * The maximum length of a line in an input file.
+ */
+#define LINE_MAX_LEN 256
+/**
+ * The name given to code which comes before the first symbol.
+ */
+#define NO_SYMBOL "(none)"
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The chip8disasm output from which to take symbols, or NULL.
+     */
+    char *disasm;
+    /**
+     * The chip8asm symbol map from which to take symbols, or NULL.
+     */
+    char *map;
+    /**
+     * The number of subroutines to show (default 0, meaning all of them).
+     */
+    unsigned long top;
+    /**
+     * The heat map written by the interpreter.
+     */
+    char *heatmap;
+};
+
+/**
+ * A symbol, along with the execution counts attributed to it.
+ *
+ * Every executed address is attributed to the closest symbol at or before it.
+ */
+struct symbol {
+    char *name;
+    uint16_t addr;
+    /**
+     * The total number of instructions executed under this symbol.
+     */
+    uint64_t count;
+    /**
+     * The address under this symbol which was executed the most.
+     */
+    uint16_t hottest;
+    uint64_t hottest_count;
+};
+
+/**
+ * A growable list of symbols.
+ */
+struct symbol_list {
+    struct symbol *data;
+    size_t len;
+    size_t cap;
+};
+
+static struct progopts progopts_default(void);
+/**
+ * Adds a symbol with the given name and address to the list.
+ */
+static void symbol_list_add(
+    struct symbol_list *list, const char *name, uint16_t addr);
+static void symbol_list_free(struct symbol_list *list);
+/**
+ * Reads symbols from a symbol map written by chip8asm.
+ *
+ * @return An error code.
+ */
+static int read_map(struct symbol_list *list, const char *fname);
+/**
+ * Reads symbols from the labels in the output of chip8disasm.
+ *
+ * @return An error code.
+ */
+static int read_disasm(struct symbol_list *list, const char *fname);
+/**
+ * Reads a heat map written by the interpreter.
+ *
+ * @param[out] counts The execution count of each address.
+ * @return An error code.
+ */
+static int read_heatmap(uint64_t *counts, const char *fname);
+/**
+ * Compares two symbols by address (for qsort).
+ */
+static int compare_addrs(const void *a, const void *b);
+/**
+ * Compares two symbols by count, highest first (for qsort).
+ */
+static int compare_counts(const void *a, const void *b);
+static int run(struct progopts opts);
+
+int main(int argc, char **argv)
+{
+    struct progopts opts = progopts_default();
+    int option;
+    const struct option options[] = {
+        {"disasm", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {"map", required_argument, NULL, 'm'},
+        {"top", required_argument, NULL, 'n'},
+        {"version", no_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'}, {0, 0, 0, 0},
+    };
+
+    log_init(argc >= 1 ? argv[0] : "chip8heat", stderr, LOG_WARNING);
+
+    while ((option = getopt_long(argc, argv, "d:hm:n:Vv", options, NULL)) != -1) {
+        char *numend;
+
+        switch (option) {
+        case 'd':
+            opts.disasm = optarg;
+            break;
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            return 0;
+        case 'm':
+            opts.map = optarg;
+            break;
+        case 'n':
+            errno = 0;
+            opts.top = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing count: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0') {
+                log_error("Count argument '%s' is invalid", optarg);
+                return 2;
+            }
+            break;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            return 0;
+        case 'v':
+            opts.verbosity++;
+            break;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            return 2;
+        }
+    }
+
+    if (opts.disasm && opts.map) {
+        log_error("Only one of --disasm and --map may be given");
+        return 2;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "%s", USAGE);
+        return 2;
+    }
+    opts.heatmap = argv[optind];
+
+    return run(opts);
+}
+
+static struct progopts progopts_default(void)
+{
+    return (struct progopts){
+        .verbosity = 0,
+        .disasm = NULL,
+        .map = NULL,
+        .top = 0,
+        .heatmap = NULL,
+    };
+}
+
+static void symbol_list_add(
+    struct symbol_list *list, const char *name, uint16_t addr)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 64;
+        list->data = xrealloc(list->data, list->cap * sizeof *list->data);
+    }
+    list->data[list->len++] = (struct symbol){
+        .name = xstrdup(name),
+        .addr = addr,
+        .count = 0,
+        .hottest = addr,
+        .hottest_count = 0,
+    };
+}
+
+static void symbol_list_free(struct symbol_list *list)
+{
+    for (size_t i = 0; i < list->len; i++)
+        free(list->data[i].name);
+    free(list->data);
+}
+
+static int read_map(struct symbol_list *list, const char *fname)
+{
+    FILE *input;
+    char line[LINE_MAX_LEN];
+    char name[LINE_MAX_LEN];
+    int line_num = 0;
+    int retval = 0;
+
+    if (!(input = fopen(fname, "r"))) {
+        log_error("Could not open symbol map '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof line, input)) {
+        unsigned addr;
+
+        line_num++;
+        if (sscanf(line, "%x %s", &addr, name) != 2 ||
+            addr >= CHIP8_MEM_SIZE) {
+            log_error("%s:%d: invalid symbol", fname, line_num);
+            retval = 1;
+            goto EXIT_FILE_OPENED;
+        }
+        symbol_list_add(list, name, addr);
+    }
+    if (ferror(input)) {
+        log_error("Error reading from symbol map '%s'", fname);
+        retval = 1;
+    }
+
+EXIT_FILE_OPENED:
+    fclose(input);
+    return retval;
+}
+
+static int read_disasm(struct symbol_list *list, const char *fname)
+{
+    FILE *input;
+    char line[LINE_MAX_LEN];
+    int retval = 0;
+
+    if (!(input = fopen(fname, "r"))) {
+        log_error("Could not open disassembly '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    /*
+     * Labels are the only things which start at the beginning of a line, and
+     * they are named after their addresses relative to the start of the
+     * program.
+     */
+    while (fgets(line, sizeof line, input)) {
+        unsigned addr;
+        int len = 0;
+
+        if (sscanf(line, "L%3x:%n", &addr, &len) == 1 && len == 5 &&
+            addr < CHIP8_MEM_SIZE - CHIP8_PROG_START) {
+            line[4] = '\0';
+            symbol_list_add(list, line, CHIP8_PROG_START + addr);
+        }
+    }
+    if (ferror(input)) {
+        log_error("Error reading from disassembly '%s'", fname);
+        retval = 1;
+    }
+
+    fclose(input);
+    return retval;
+}
+
+static int read_heatmap(uint64_t *counts, const char *fname)
+{
+    FILE *input;
+    char line[LINE_MAX_LEN];
+    int line_num = 0;
+    int retval = 0;
+
+    if (!(input = fopen(fname, "r"))) {
+        log_error("Could not open heat map '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof line, input)) {
+        unsigned addr;
+        uint64_t count;
+
+        line_num++;
+        if (sscanf(line, "%x %" SCNu64, &addr, &count) != 2 ||
+            addr >= CHIP8_MEM_SIZE) {
+            log_error("%s:%d: invalid heat map entry", fname, line_num);
+            retval = 1;
+            goto EXIT_FILE_OPENED;
+        }
+        counts[addr] += count;
+    }
+    if (ferror(input)) {
+        log_error("Error reading from heat map '%s'", fname);
+        retval = 1;
+    }
+
+EXIT_FILE_OPENED:
+    fclose(input);
+    return retval;
+}
+
+static int compare_addrs(const void *a, const void *b)
+{
+    const struct symbol *sa = a, *sb = b;
+
+    return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+    const struct symbol *sa = a, *sb = b;
+
+    if (sa->count != sb->count)
+        return sa->count < sb->count ? 1 : -1;
+    return compare_addrs(a, b);
+}
+
+static int run(struct progopts opts)
+{
+    static uint64_t counts[CHIP8_MEM_SIZE];
+    struct symbol_list symbols = {0};
+    uint64_t total = 0;
+    size_t shown;
+    int retval = 0;
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity == 2)
+        log_set_level(LOG_DEBUG);
+    else if (opts.verbosity >= 3)
+        log_set_level(LOG_TRACE);
+
+    if (read_heatmap(counts, opts.heatmap)) {
+        retval = 1;
+        goto EXIT_SYMBOLS_CREATED;
+    }
+    if ((opts.map && read_map(&symbols, opts.map)) ||
+        (opts.disasm && read_disasm(&symbols, opts.disasm))) {
+        retval = 1;
+        goto EXIT_SYMBOLS_CREATED;
+    }
+    if (!opts.map && !opts.disasm) {
+        /* Without any symbols, the best we can do is rank single addresses */
+        for (unsigned addr = 0; addr < CHIP8_MEM_SIZE; addr++) {
+            char name[8];
+
+            if (counts[addr] == 0)
+                continue;
+            snprintf(name, sizeof name, "L%03X",
+                (addr - CHIP8_PROG_START) & 0xFFF);
+            symbol_list_add(&symbols, name, addr);
+        }
+    }
+    log_info("Read %zu symbols", symbols.len);
+    qsort(symbols.data, symbols.len, sizeof *symbols.data, compare_addrs);
+    if (symbols.len == 0 || symbols.data[0].addr != 0) {
+        symbol_list_add(&symbols, NO_SYMBOL, 0);
+        qsort(symbols.data, symbols.len, sizeof *symbols.data, compare_addrs);
+    }
+
+    /* Both lists are in order of address, so we can walk them together */
+    for (size_t addr = 0, sym = 0; addr < CHIP8_MEM_SIZE; addr++) {
+        struct symbol *s;
+
+        while (sym + 1 < symbols.len && symbols.data[sym + 1].addr <= addr)
+            sym++;
+        if (counts[addr] == 0)
+            continue;
+        s = &symbols.data[sym];
+        s->count += counts[addr];
+        if (counts[addr] > s->hottest_count) {
+            s->hottest = addr;
+            s->hottest_count = counts[addr];
+        }
+        total += counts[addr];
+    }
+    qsort(symbols.data, symbols.len, sizeof *symbols.data, compare_counts);
+
+    printf("%-20s %4s %14s %7s %7s %7s\n", "SYMBOL", "ADDR", "COUNT", "%",
+        "HOTTEST", "%");
+    shown = opts.top > 0 && opts.top < symbols.len ? opts.top : symbols.len;
+    for (size_t i = 0; i < shown && symbols.data[i].count > 0; i++) {
+        const struct symbol *s = &symbols.data[i];
+
+        printf("%-20s  %03X %14" PRIu64 " %7.2f     %03X %7.2f\n", s->name,
+            (unsigned)s->addr, s->count, 100.0 * s->count / total,
+            (unsigned)s->hottest, 100.0 * s->hottest_count / s->count);
+    }
+    printf("%-20s %4s %14" PRIu64 "\n", "TOTAL", "", total);
+
+EXIT_SYMBOLS_CREATED:
+    symbol_list_free(&symbols);
+    return retval;
+}
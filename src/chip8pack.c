@@ -0,0 +1,385 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "memory.h"
+#include "pack.h"
+#include "rom.h"
+
+static const char *HELP =
+    "Packs Chip-8/Super-Chip game files into a single indexed file.\n"
+    "\n"
+    "Options:\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -l, --load-quirks           run the games which follow in load quirks mode\n"
+    "  -o, --output=FILE           write the pack to FILE\n"
+    "  -q, --shift-quirks          run the games which follow in shift quirks mode\n"
+    "  -t, --list                  list the contents of a pack\n"
+    "  -V, --version               show version information and exit\n"
+    "  -v, --verbose               increase verbosity\n";
+static const char *USAGE = "Usage: chip8pack [OPTION...] -o PACK FILE|DIR...\n"
+                           "       chip8pack -t PACK\n";
+static const char *VERSION_STRING = "chip8pack " PROJECT_VERSION "\n";
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The pack file to write, or NULL.
+     */
+    char *output;
+    /**
+     * Whether to list the contents of a pack rather than create one.
+     */
+    bool list;
+};
+
+/**
+ * A file or directory given on the command line.
+ */
+struct path {
+    const char *path;
+    /**
+     * The quirks options which were given before the path.
+     */
+    uint32_t flags;
+};
+
+/**
+ * A game file to be packed.
+ */
+struct game {
+    char *fname;
+    struct chip8_rom rom;
+    /**
+     * A combination of `enum chip8_pack_flags` values.
+     */
+    uint32_t flags;
+};
+
+/**
+ * A growable list of game files.
+ */
+struct game_list {
+    struct game *games;
+    size_t len;
+    size_t cap;
+};
+
+static struct progopts progopts_default(void);
+/**
+ * Adds the given file to the list, or every game file in it (and its
+ * subdirectories) if it is a directory.
+ *
+ * As with chip8bench, only files without an extension, or with one of the
+ * usual game file extensions, are taken from directories, so that
+ * documentation is skipped.  The `.c8` extension is not included here,
+ * though, since that is what the assembler sources in a game collection
+ * usually use.
+ *
+ * @return An error code.
+ */
+static int game_list_add(
+    struct game_list *list, const char *path, uint32_t flags);
+/**
+ * Opens the given game file and adds it to the list.
+ *
+ * @param from_dir Whether the file was found in a directory, in which case
+ * files which are too big to be games are skipped rather than being an error.
+ * @return An error code.
+ */
+static int game_list_push(
+    struct game_list *list, const char *fname, uint32_t flags, bool from_dir);
+static void game_list_clear(struct game_list *list);
+/**
+ * Returns whether the given file name looks like a game file.
+ */
+static bool is_game_name(const char *name);
+/**
+ * Compares two file names (for qsort).
+ */
+static int compare_fnames(const void *a, const void *b);
+/**
+ * Writes a pack containing the games in the given paths.
+ */
+static int run_pack(struct progopts opts, int n_paths, struct path *paths);
+/**
+ * Prints the contents of the given pack.
+ */
+static int run_list(const char *fname);
+
+int main(int argc, char **argv)
+{
+    struct progopts opts = progopts_default();
+    struct path *paths = xcalloc(argc, sizeof *paths);
+    int n_paths = 0;
+    uint32_t flags = 0;
+    int option;
+    int retval;
+    const struct option options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"load-quirks", no_argument, NULL, 'l'},
+        {"output", required_argument, NULL, 'o'},
+        {"shift-quirks", no_argument, NULL, 'q'},
+        {"list", no_argument, NULL, 't'},
+        {"version", no_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'}, {0, 0, 0, 0},
+    };
+
+    log_init(argc >= 1 ? argv[0] : "chip8pack", stderr, LOG_WARNING);
+
+    /*
+     * The quirks options only apply to the paths which follow them, so the
+     * leading '-' asks getopt_long to return the paths in order (as option 1)
+     * instead of moving them to the end.
+     */
+    while ((option = getopt_long(argc, argv, "-hlo:qtVv", options, NULL)) !=
+        -1) {
+        switch (option) {
+        case 1:
+            paths[n_paths].path = optarg;
+            paths[n_paths].flags = flags;
+            n_paths++;
+            break;
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            retval = 0;
+            goto EXIT_PATHS_CREATED;
+        case 'l':
+            flags |= CHIP8_PACK_LOAD_QUIRKS;
+            break;
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'q':
+            flags |= CHIP8_PACK_SHIFT_QUIRKS;
+            break;
+        case 't':
+            opts.list = true;
+            break;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            retval = 0;
+            goto EXIT_PATHS_CREATED;
+        case 'v':
+            opts.verbosity++;
+            break;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            retval = 2;
+            goto EXIT_PATHS_CREATED;
+        }
+    }
+    /* Anything after "--" is left for us */
+    for (; optind < argc; optind++) {
+        paths[n_paths].path = argv[optind];
+        paths[n_paths].flags = flags;
+        n_paths++;
+    }
+
+    if (opts.list ? opts.output || n_paths != 1
+                  : !opts.output || n_paths == 0) {
+        fprintf(stderr, "%s", USAGE);
+        retval = 2;
+        goto EXIT_PATHS_CREATED;
+    }
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity == 2)
+        log_set_level(LOG_DEBUG);
+    else if (opts.verbosity >= 3)
+        log_set_level(LOG_TRACE);
+
+    retval = opts.list ? run_list(paths[0].path)
+                       : run_pack(opts, n_paths, paths);
+
+EXIT_PATHS_CREATED:
+    free(paths);
+    return retval;
+}
+
+static struct progopts progopts_default(void)
+{
+    return (struct progopts){
+        .verbosity = 0,
+        .output = NULL,
+        .list = false,
+    };
+}
+
+static int game_list_add(
+    struct game_list *list, const char *path, uint32_t flags)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+    char **names = NULL;
+    size_t n_names = 0, cap_names = 0;
+    int retval = 0;
+
+    if (stat(path, &st) != 0) {
+        log_error("Could not access '%s': %s", path, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return game_list_push(list, path, flags, false);
+
+    if (!(dir = opendir(path))) {
+        log_error("Could not open directory '%s': %s", path, strerror(errno));
+        return 1;
+    }
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (n_names == cap_names) {
+            cap_names = cap_names ? 2 * cap_names : 32;
+            names = xrealloc(names, cap_names * sizeof *names);
+        }
+        names[n_names++] = xstrdup(entry->d_name);
+    }
+    closedir(dir);
+    /* Directory order is arbitrary, but the pack shouldn't be */
+    if (n_names > 0)
+        qsort(names, n_names, sizeof *names, compare_fnames);
+
+    for (size_t i = 0; i < n_names; i++) {
+        size_t len = strlen(path) + strlen(names[i]) + 2;
+        char *fname = xmalloc(len);
+
+        snprintf(fname, len, "%s/%s", path, names[i]);
+        if (retval == 0 && stat(fname, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                retval = game_list_add(list, fname, flags);
+            else if (S_ISREG(st.st_mode) && is_game_name(names[i]))
+                retval = game_list_push(list, fname, flags, true);
+        }
+        free(fname);
+        free(names[i]);
+    }
+    free(names);
+
+    return retval;
+}
+
+static int game_list_push(
+    struct game_list *list, const char *fname, uint32_t flags, bool from_dir)
+{
+    struct stat st;
+    struct game *game;
+
+    if (from_dir && stat(fname, &st) == 0 && st.st_size > CHIP8_PROG_SIZE) {
+        log_info("Skipping '%s', which is too big to be a game", fname);
+        return 0;
+    }
+    if (list->len == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 32;
+        list->games = xrealloc(list->games, list->cap * sizeof *list->games);
+    }
+    game = &list->games[list->len];
+    if (chip8_rom_open(&game->rom, fname))
+        return 1;
+    game->fname = xstrdup(fname);
+    game->flags = flags;
+    list->len++;
+    log_debug("Adding '%s'", fname);
+
+    return 0;
+}
+
+static void game_list_clear(struct game_list *list)
+{
+    for (size_t i = 0; i < list->len; i++) {
+        chip8_rom_close(&list->games[i].rom);
+        free(list->games[i].fname);
+    }
+    free(list->games);
+    list->games = NULL;
+    list->len = list->cap = 0;
+}
+
+static bool is_game_name(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    return !ext || strcmp(ext, ".ch8") == 0 || strcmp(ext, ".sc8") == 0;
+}
+
+static int compare_fnames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int run_pack(struct progopts opts, int n_paths, struct path *paths)
+{
+    struct game_list games = {NULL, 0, 0};
+    struct chip8_pack_item *items;
+    int retval = 0;
+
+    for (int i = 0; i < n_paths; i++)
+        if (game_list_add(&games, paths[i].path, paths[i].flags)) {
+            retval = 1;
+            goto EXIT_GAMES_LISTED;
+        }
+
+    if (games.len == 0) {
+        log_error("No game files found");
+        retval = 1;
+        goto EXIT_GAMES_LISTED;
+    }
+    items = xcalloc(games.len, sizeof *items);
+    for (size_t i = 0; i < games.len; i++) {
+        items[i].name = games.games[i].fname;
+        items[i].data = games.games[i].rom.data;
+        items[i].len = games.games[i].rom.len;
+        items[i].flags = games.games[i].flags;
+    }
+    retval = chip8_pack_write(opts.output, items, games.len);
+    free(items);
+
+EXIT_GAMES_LISTED:
+    game_list_clear(&games);
+    return retval;
+}
+
+static int run_list(const char *fname)
+{
+    struct chip8_pack *pack;
+
+    if (!(pack = chip8_pack_open(fname)))
+        return 1;
+
+    for (size_t i = 0; i < chip8_pack_size(pack); i++) {
+        const struct chip8_pack_entry *entry = chip8_pack_get(pack, i);
+        char hex[CHIP8_SHA1_HEX_LEN];
+
+        chip8_sha1_format(entry->sha1, hex);
+        printf("%s\t%lu\t%s%s%s\t%s\n", hex, (unsigned long)entry->len,
+            entry->flags & CHIP8_PACK_LOAD_QUIRKS ? "l" : "",
+            entry->flags & CHIP8_PACK_SHIFT_QUIRKS ? "q" : "",
+            entry->flags ? "" : "-", chip8_pack_name(pack, entry));
+    }
+
+    chip8_pack_close(pack);
+    return 0;
+}
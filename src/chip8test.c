@@ -13,12 +13,23 @@
  * return 0 on success or 1 on failure, and they should be registered in the
  * `main` function of this file.
  */
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "assembler.h"
+#include "handoff.h"
 #include "interpreter.h"
 #include "log.h"
+#include "movie.h"
+#include "pack.h"
+#include "rewind.h"
+#include "rom.h"
+#include "state.h"
+#include "trace.h"
 
 #define TEST_RUN(test) testing_run(#test, test)
 #define ASSERT(cond)                                                           \
@@ -46,6 +57,28 @@ static void testing_setup(void);
 static int testing_teardown(void);
 
 static struct chip8_options chip8_options_testing(void);
+/**
+ * Logs a series of multi-part messages (for `test_log`).
+ */
+static void *log_thread(void *data);
+/**
+ * Publishes a series of numbered frames to a triple buffer and then pushes a
+ * series of numbered events to an input queue (for `test_handoff`).
+ */
+static void *handoff_thread(void *data);
+
+/**
+ * The number of frames and events sent by `handoff_thread`.
+ */
+#define HANDOFF_COUNT 10000
+
+/**
+ * The structures shared with `handoff_thread`.
+ */
+struct handoff {
+    struct chip8_triple_buffer *frames;
+    struct chip8_input_queue *input;
+};
 
 /**
  * Tests Chip-8 arithmetic instruction evaluation.
@@ -71,26 +104,102 @@ int test_asm_fail(void);
  * Tests conditional assembly (IFDEF, etc.).
  */
 int test_asm_if(void);
+/**
+ * Tests the symbols recorded for labeled instructions.
+ */
+int test_asm_symbols(void);
 /**
  * Tests Chip-8 comparison instruction evaluation.
  */
 int test_comparison(void);
+/**
+ * Tests invalidation of the decoded instruction cache.
+ */
+int test_decode_cache(void);
 /**
  * Tests Chip-8 display instruction evaluation.
  */
 int test_display(void);
+/**
+ * Tests passing frames and input between threads.
+ */
+int test_handoff(void);
+/**
+ * Tests that skipping idle loops gives the same results as running them.
+ */
+int test_idle(void);
 /**
  * Tests the evaluation of various jump instructions.
  */
 int test_jp(void);
+/**
+ * Tests that compiled code behaves the same as the interpreter.
+ */
+int test_jit(void);
 /**
  * Tests Chip-8 memory instruction evaluation.
  */
 int test_ld(void);
+/**
+ * Tests that messages logged from several threads are written whole.
+ */
+int test_log(void);
+/**
+ * Tests recording and replaying input movies.
+ */
+int test_movie(void);
+/**
+ * Tests writing game packs and looking up the games in them.
+ */
+int test_pack(void);
+/**
+ * Tests taking instances from a pool and giving them back.
+ */
+int test_pool(void);
+/**
+ * Tests that profiling counts instructions without changing behavior.
+ */
+int test_profile(void);
 /**
  * Tests shift and load quirks mode behavior.
  */
 int test_quirks(void);
+/**
+ * Tests that a reset instance behaves like a new one.
+ */
+int test_reset(void);
+/**
+ * Tests stepping backwards with the rewind buffer.
+ */
+int test_rewind(void);
+/**
+ * Tests that the random number generator is deterministic.
+ */
+int test_rnd(void);
+/**
+ * Tests opening ROM images and loading them into the interpreter.
+ */
+int test_rom(void);
+/**
+ * Tests running several instructions at once.
+ */
+int test_run(void);
+/**
+ * Tests the stop conditions of chip8_run_until.
+ */
+int test_run_until(void);
+/**
+ * Tests saving and restoring the interpreter state.
+ */
+int test_state(void);
+/**
+ * Tests recording a binary execution trace.
+ */
+int test_trace(void);
+/**
+ * Tests the timers when using a virtual clock.
+ */
+int test_virtual_clock(void);
 
 int main(int argc, char **argv)
 {
@@ -102,11 +211,30 @@ int main(int argc, char **argv)
     TEST_RUN(test_asm_eval);
     TEST_RUN(test_asm_fail);
     TEST_RUN(test_asm_if);
+    TEST_RUN(test_asm_symbols);
     TEST_RUN(test_comparison);
+    TEST_RUN(test_decode_cache);
     TEST_RUN(test_display);
+    TEST_RUN(test_handoff);
+    TEST_RUN(test_idle);
+    TEST_RUN(test_jit);
     TEST_RUN(test_jp);
     TEST_RUN(test_ld);
+    TEST_RUN(test_log);
+    TEST_RUN(test_movie);
+    TEST_RUN(test_pack);
+    TEST_RUN(test_pool);
+    TEST_RUN(test_profile);
     TEST_RUN(test_quirks);
+    TEST_RUN(test_reset);
+    TEST_RUN(test_rewind);
+    TEST_RUN(test_rnd);
+    TEST_RUN(test_rom);
+    TEST_RUN(test_run);
+    TEST_RUN(test_run_until);
+    TEST_RUN(test_state);
+    TEST_RUN(test_trace);
+    TEST_RUN(test_virtual_clock);
     return testing_teardown();
 }
 
@@ -408,6 +536,39 @@ int test_asm_if(void)
     return 0;
 }
 
+int test_asm_symbols(void)
+{
+    struct chip8asm *chipasm = chip8asm_new(chip8asm_options_default());
+    struct chip8asm_program *prog = chip8asm_program_new();
+
+    ASSERT(chipasm != NULL && prog != NULL);
+
+    chip8asm_process_line(chipasm, "start: LD V0, 0");
+    chip8asm_process_line(chipasm, "LIMIT = 10");
+    chip8asm_process_line(chipasm, "DEFINE UNUSED");
+    chip8asm_process_line(chipasm, "loop:");
+    chip8asm_process_line(chipasm, "  ADD V0, 1");
+    chip8asm_process_line(chipasm, "  SE V0, LIMIT");
+    chip8asm_process_line(chipasm, "  JP loop");
+    chip8asm_process_line(chipasm, "data: DB 1");
+    chip8asm_process_line(chipasm, "done: EXIT");
+
+    ASSERT(chip8asm_emit(chipasm, prog) == 0);
+    ASSERT_EQ_UINT(prog->n_symbols, 4);
+    ASSERT(!strcmp(prog->symbols[0].name, "start"));
+    ASSERT_EQ_UINT(prog->symbols[0].addr, 0x200);
+    ASSERT(!strcmp(prog->symbols[1].name, "loop"));
+    ASSERT_EQ_UINT(prog->symbols[1].addr, 0x202);
+    ASSERT(!strcmp(prog->symbols[2].name, "data"));
+    ASSERT_EQ_UINT(prog->symbols[2].addr, 0x208);
+    ASSERT(!strcmp(prog->symbols[3].name, "done"));
+    ASSERT_EQ_UINT(prog->symbols[3].addr, 0x20A);
+
+    chip8asm_program_destroy(prog);
+    chip8asm_destroy(chipasm);
+    return 0;
+}
+
 int test_comparison(void)
 {
     struct chip8_options opts = chip8_options_testing();
@@ -440,12 +601,48 @@ int test_comparison(void)
     return 0;
 }
 
+int test_decode_cache(void)
+{
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    uint8_t prog[] = {
+        0x60, 0x12, /* LD V0, #12 */
+        0x61, 0x34, /* LD V1, #34 */
+        0xA2, 0x08, /* LD I, #208 */
+        0xF1, 0x55, /* LD [I], V1 */
+        0x00, 0xE0, /* CLS (overwritten with JP #234) */
+    };
+
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+
+    /* Make sure the instruction to be overwritten is in the cache */
+    chip->pc = 0x208;
+    ASSERT_EQ_UINT(chip8_current_instr(chip).op, OP_CLS);
+    chip->pc = 0x200;
+
+    for (int i = 0; i < 4; i++)
+        ASSERT(chip8_step(chip) == 0);
+    ASSERT_EQ_UINT(chip8_current_instr(chip).op, OP_JP);
+    ASSERT(chip8_step(chip) == 0);
+    ASSERT_EQ_UINT(chip->pc, 0x234);
+
+    /* Overwriting the current instruction must also take effect */
+    chip8_execute_opcode(chip, 0x6577);
+    ASSERT_EQ_UINT(chip->regs[REG_V5], 0x77);
+    chip->pc = 0x234;
+    chip8_execute_opcode(chip, 0x6588);
+    ASSERT_EQ_UINT(chip->regs[REG_V5], 0x88);
+
+    chip8_destroy(chip);
+    return 0;
+}
+
 int test_display(void)
 {
 /* Compares the 8-byte-long row starting at (x, y) from the display */
 #define ASSERT_EQ_ROW(x, y, row) \
     for (int i = 0; i < 8; i++) \
-        ASSERT_EQ_UINT(chip->display[(x) + i][(y)], (row)[i]);
+        ASSERT_EQ_UINT(chip8_get_pixel(chip, (x) + i, (y)), (row)[i]);
 
     struct chip8 *chip = chip8_new(chip8_options_testing());
     /* The three rows of the sprite */
@@ -470,8 +667,14 @@ int test_display(void)
     /* LD I, #A00 */
     chip8_execute_opcode(chip, 0xAA00);
 
+    /* Everything starts out needing to be drawn */
+    ASSERT(chip8_take_dirty_rows(chip) == UINT64_MAX);
+    ASSERT(chip8_take_dirty_rows(chip) == 0);
+
     /* DRW V0, V1, 3 */
     chip8_execute_opcode(chip, 0xD013);
+    /* Only the rows covered by the sprite have changed */
+    ASSERT_EQ_UINT(chip8_take_dirty_rows(chip), 0x1C);
     /* Make sure all three rows were drawn correctly */
     ASSERT_EQ_ROW(1, 2, row1);
     ASSERT_EQ_ROW(1, 3, row2);
@@ -481,7 +684,7 @@ int test_display(void)
     /* There should be nothing left in the area we shifted from. */
     for (int x = 1; x < 5; x++)
         for (int y = 2; y <= 4; y++)
-            ASSERT_EQ_UINT(chip->display[x][y], 0);
+            ASSERT_EQ_UINT(chip8_get_pixel(chip, x, y), 0);
     ASSERT_EQ_ROW(5, 2, row1);
     ASSERT_EQ_ROW(5, 3, row2);
     ASSERT_EQ_ROW(5, 4, row3);
@@ -507,7 +710,7 @@ int test_display(void)
     chip8_execute_opcode(chip, 0x00E0);
     for (int i = 0; i < CHIP8_DISPLAY_WIDTH; i++)
         for (int j = 0; j < CHIP8_DISPLAY_HEIGHT; j++)
-            ASSERT_EQ_UINT(chip->display[i][j], 0);
+            ASSERT_EQ_UINT(chip8_get_pixel(chip, i, j), 0);
     /* DRW V0, V1, 0 */
     chip8_execute_opcode(chip, 0xD010);
     /* Now we should have a 16x16 sprite */
@@ -521,6 +724,38 @@ int test_display(void)
     ASSERT_EQ_ROW(9, 2, row_zero);
     ASSERT_EQ_ROW(1, 3, row_zero);
 
+    /* Sprites crossing the middle of the display (and a word boundary) */
+    /* LD V0, 60 */
+    chip8_execute_opcode(chip, 0x603C);
+    /* DRW V0, V1, 3 */
+    chip8_execute_opcode(chip, 0xD013);
+    ASSERT_EQ_ROW(60, 2, row1);
+    ASSERT_EQ_ROW(60, 3, row2);
+    ASSERT_EQ_ROW(60, 4, row3);
+    ASSERT_EQ_UINT(chip->regs[REG_VF], 0);
+    /* SCL moves it back across the boundary */
+    chip8_execute_opcode(chip, 0x00FC);
+    ASSERT_EQ_ROW(56, 2, row1);
+    for (int i = 64; i < 68; i++)
+        ASSERT_EQ_UINT(chip8_get_pixel(chip, i, 2), 0);
+    /* Drawing over part of it causes a collision */
+    /* LD V0, 59 */
+    chip8_execute_opcode(chip, 0x603B);
+    /* DRW V0, V1, 1 */
+    chip8_execute_opcode(chip, 0xD011);
+    ASSERT_EQ_UINT(chip->regs[REG_VF], 1);
+    /* CLS */
+    chip8_execute_opcode(chip, 0x00E0);
+    /* Sprites are clipped at the right edge */
+    /* LD V0, 124 */
+    chip8_execute_opcode(chip, 0x607C);
+    /* DRW V0, V1, 1 */
+    chip8_execute_opcode(chip, 0xD011);
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQ_UINT(chip8_get_pixel(chip, 124 + i, 2), row1[i]);
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQ_UINT(chip8_get_pixel(chip, i, 2), 0);
+
     chip8_destroy(chip);
     return 0;
 #undef ASSERT_EQ_ROW
@@ -547,9 +782,284 @@ int test_jp(void)
     /* RET */
     chip8_execute_opcode(chip, 0x00EE);
     ASSERT_EQ_UINT(chip->pc, 0x402);
+    ASSERT_EQ_UINT(chip->stack_size, 0);
+    /* RET with nothing to return to */
+    ASSERT(chip8_execute_opcode(chip, 0x00EE) != 0);
+    chip8_destroy(chip);
+
+    /* The call stack is limited to 16 entries by default */
+    chip = chip8_new(chip8_options_testing());
+    ASSERT(chip != NULL);
+    for (int i = 0; i < 16; i++) {
+        /* CALL #200 */
+        ASSERT(chip8_execute_opcode(chip, 0x2200) == 0);
+    }
+    ASSERT_EQ_UINT(chip->stack_size, 16);
+    ASSERT(chip8_execute_opcode(chip, 0x2200) != 0);
+    ASSERT_EQ_UINT(chip->stack_size, 16);
+    chip8_destroy(chip);
+
+    return 0;
+}
+
+int test_handoff(void)
+{
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    struct chip8_frame a, b;
+    struct handoff handoff;
+    const struct chip8_frame *frame;
+    struct chip8_input input;
+    /* An extra column makes sure the pitch is respected */
+    uint32_t pixels[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WIDTH + 1];
+    pthread_t thread;
+    unsigned long last = 0;
+    unsigned long n_events = 0;
+
+    ASSERT(chip != NULL);
+    /* DRW V0, V0, 1 (drawing the top of the 0 sprite) */
+    chip8_execute_opcode(chip, 0xD001);
+    chip8_frame_capture(&a, chip);
+    ASSERT(chip8_frame_get_pixel(&a, 0, 0));
+    ASSERT(!chip8_frame_get_pixel(&a, 4, 0));
+    ASSERT(!a.highres);
+    ASSERT(a.dirty_rows == UINT64_MAX);
+    chip8_frame_capture(&b, chip);
+    ASSERT_EQ_UINT((unsigned)b.dirty_rows, 0);
+    /* DRW V0, V0, 2 (erasing the top row and drawing the second) */
+    chip8_execute_opcode(chip, 0xD002);
+    chip8_frame_capture(&b, chip);
+    ASSERT_EQ_UINT((unsigned)b.dirty_rows, 0x3);
+    chip8_destroy(chip);
+
+    /* Only the visible part of the display is converted */
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++)
+        for (int x = 0; x < CHIP8_DISPLAY_WIDTH + 1; x++)
+            pixels[y][x] = 7;
+    chip8_frame_to_pixels(&a, &pixels[0][0], sizeof pixels[0], 1, 0);
+    ASSERT_EQ_UINT(pixels[0][0], 1);
+    ASSERT_EQ_UINT(pixels[0][3], 1);
+    ASSERT_EQ_UINT(pixels[0][4], 0);
+    ASSERT_EQ_UINT(pixels[1][0], 0);
+    ASSERT_EQ_UINT(pixels[31][63], 0);
+    ASSERT_EQ_UINT(pixels[0][64], 7);
+    ASSERT_EQ_UINT(pixels[32][0], 7);
+    a.highres = true;
+    chip8_frame_to_pixels(&a, &pixels[0][0], sizeof pixels[0], 1, 0);
+    ASSERT_EQ_UINT(pixels[0][0], 1);
+    ASSERT_EQ_UINT(pixels[0][64], 0);
+    ASSERT_EQ_UINT(pixels[63][127], 0);
+    ASSERT_EQ_UINT(pixels[0][128], 7);
+
+    /*
+     * Only the latest frame is taken, and only once, but it includes the
+     * changes from the frames before it which were skipped
+     */
+    handoff.frames = chip8_triple_buffer_new();
+    ASSERT(chip8_triple_buffer_take(handoff.frames) == NULL);
+    for (unsigned long i = 0; i < 3; i++) {
+        chip8_triple_buffer_back(handoff.frames)->number = i;
+        chip8_triple_buffer_back(handoff.frames)->dirty_rows = 1 << i;
+        chip8_triple_buffer_publish(handoff.frames);
+    }
+    ASSERT((frame = chip8_triple_buffer_take(handoff.frames)) != NULL);
+    ASSERT_EQ_UINT((unsigned)frame->number, 2);
+    ASSERT_EQ_UINT((unsigned)frame->dirty_rows, 0x7);
+    ASSERT(chip8_triple_buffer_back(handoff.frames) != frame);
+    ASSERT(chip8_triple_buffer_take(handoff.frames) == NULL);
+    /* The writer only finds out that a frame was taken one frame later */
+    for (unsigned i = 3; i < 5; i++) {
+        chip8_triple_buffer_back(handoff.frames)->dirty_rows = 1 << i;
+        chip8_triple_buffer_publish(handoff.frames);
+        ASSERT((frame = chip8_triple_buffer_take(handoff.frames)) != NULL);
+    }
+    ASSERT_EQ_UINT((unsigned)frame->dirty_rows, 0x18);
+
+    /* The queue holds at least as much as was asked for, in order */
+    handoff.input = chip8_input_queue_new(3);
+    input.type = CHIP8_INPUT_KEY_DOWN;
+    for (input.key = 0; chip8_input_queue_push(handoff.input, input); input.key++)
+        ;
+    ASSERT_EQ_UINT(input.key, 4);
+    for (unsigned key = 0; key < 4; key++) {
+        ASSERT(chip8_input_queue_pop(handoff.input, &input));
+        ASSERT_EQ_UINT(input.key, key);
+    }
+    ASSERT(!chip8_input_queue_pop(handoff.input, &input));
+    chip8_input_queue_destroy(handoff.input);
+
+    /*
+     * Frames must arrive whole and in order (though some may be skipped), and
+     * events must all arrive in order.
+     */
+    handoff.input = chip8_input_queue_new(16);
+    ASSERT(pthread_create(&thread, NULL, handoff_thread, &handoff) == 0);
+    while (last < HANDOFF_COUNT - 1) {
+        if (!(frame = chip8_triple_buffer_take(handoff.frames))) {
+            sched_yield();
+            continue;
+        }
+        ASSERT(frame->number > last || frame->number == 0);
+        ASSERT(frame->display[0][0] == frame->number);
+        ASSERT(frame->display[CHIP8_DISPLAY_HEIGHT - 1][0] == frame->number);
+        for (unsigned long i = last + 1; i <= frame->number; i++)
+            ASSERT(frame->dirty_rows & UINT64_C(1) << i % 64);
+        last = frame->number;
+    }
+    while (n_events < HANDOFF_COUNT) {
+        if (!chip8_input_queue_pop(handoff.input, &input)) {
+            sched_yield();
+            continue;
+        }
+        ASSERT_EQ_UINT(input.key, n_events % 16);
+        n_events++;
+    }
+    pthread_join(thread, NULL);
+    chip8_input_queue_destroy(handoff.input);
+    chip8_triple_buffer_destroy(handoff.frames);
+
+    return 0;
+}
+
+int test_idle(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *slow, *spin;
+    uint8_t prog[] = {
+        0x60, 0x05, /* LD V0, 5 */
+        0xF0, 0x15, /* LD DT, V0 */
+        0xF1, 0x07, /* wait: LD V1, DT */
+        0x31, 0x00, /* SE V1, 0 */
+        0x12, 0x04, /* JP wait */
+        0x62, 0x07, /* LD V2, 7 */
+        0xE2, 0xA1, /* key: SKNP V2 */
+        0x12, 0x12, /* JP pressed */
+        0x12, 0x0C, /* JP key */
+        0xF3, 0x0A, /* pressed: LD V3, K */
+        0xF4, 0x0A, /* LD V4, K */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+    opts.cycles_per_frame = 1000;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    /* Profiling runs one instruction at a time, so nothing is skipped */
+    opts.profile = true;
+    slow = chip8_new(opts);
+    ASSERT(slow != NULL);
+    /* Nor is it when skipping is turned off */
+    opts.profile = false;
+    opts.skip_idle = false;
+    spin = chip8_new(opts);
+    ASSERT(spin != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    ASSERT(chip8_load_from_bytes(slow, prog, sizeof prog) == 0);
+    ASSERT(chip8_load_from_bytes(spin, prog, sizeof prog) == 0);
+
+    for (int frame = 0; frame < 12; frame++) {
+        /* Key 7 is taken by the first LD VX, K, so the second waits for 3 */
+        if (frame == 8)
+            chip->key_states = slow->key_states = spin->key_states = 1 << 0x7;
+        else if (frame == 10)
+            chip->key_states = slow->key_states = spin->key_states = 1 << 0x3;
+        chip8_run_frame(chip);
+        chip8_run_frame(slow);
+        chip8_run_frame(spin);
+        ASSERT_EQ_UINT(chip->pc, slow->pc);
+        ASSERT_EQ_UINT((unsigned)chip->cycles, (unsigned)slow->cycles);
+        ASSERT_EQ_UINT(chip->reg_dt, slow->reg_dt);
+        ASSERT(memcmp(chip->regs, slow->regs, sizeof chip->regs) == 0);
+        ASSERT_EQ_UINT(spin->pc, slow->pc);
+        ASSERT_EQ_UINT((unsigned)spin->cycles, (unsigned)slow->cycles);
+    }
+    ASSERT(chip->halted);
+    ASSERT_EQ_UINT(chip->regs[REG_V3], 0x7);
+    ASSERT_EQ_UINT(chip->regs[REG_V4], 0x3);
 
+    chip8_destroy(spin);
+    chip8_destroy(slow);
     chip8_destroy(chip);
+    return 0;
+}
+
+int test_jit(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *jit_chip;
+    uint8_t arith[] = {
+        0x60, 0x37, /* LD V0, #37 */
+        0x61, 0xC9, /* LD V1, #C9 */
+        0x62, 0x00, /* LD V2, 0 */
+        0x80, 0x14, /* loop: ADD V0, V1 */
+        0x81, 0x05, /* SUB V1, V0 */
+        0x83, 0x00, /* LD V3, V0 */
+        0x83, 0x06, /* SHR V3 */
+        0x84, 0x1E, /* SHL V4, V1 */
+        0x81, 0x07, /* SUBN V1, V0 */
+        0x80, 0x12, /* AND V0, V1 */
+        0x85, 0x03, /* XOR V5, V0 */
+        0x86, 0x31, /* OR V6, V3 */
+        0x75, 0x11, /* ADD V5, #11 */
+        0x8F, 0x54, /* ADD VF, V5 */
+        0xA3, 0x00, /* LD I, #300 */
+        0xF0, 0x1E, /* ADD I, V0 */
+        0x72, 0x01, /* ADD V2, 1 */
+        0x32, 0x40, /* SE V2, #40 */
+        0x12, 0x06, /* JP loop */
+        0x00, 0xFD, /* EXIT */
+    };
+    uint8_t selfmod[] = {
+        0x73, 0x01, /* loop: ADD V3, 1 */
+        0x65, 0x06, /* LD V5, 6 (rewritten to LD V5, #20) */
+        0x86, 0x54, /* ADD V6, V5 */
+        0x60, 0x65, /* LD V0, #65 */
+        0x61, 0x20, /* LD V1, #20 */
+        0xA2, 0x02, /* LD I, #202 */
+        0xF1, 0x55, /* LD [I], V1 */
+        0x33, 0x02, /* SE V3, 2 */
+        0x12, 0x00, /* JP loop */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    if (!chip8_jit_supported()) {
+        log_info("JIT compilation is not supported; skipping");
+        return 0;
+    }
+
+    for (int quirks = 0; quirks <= 1; quirks++) {
+        opts.shift_quirks = quirks;
+        opts.jit = false;
+        chip = chip8_new(opts);
+        opts.jit = true;
+        jit_chip = chip8_new(opts);
+        ASSERT(chip != NULL && jit_chip != NULL && jit_chip->jit != NULL);
+        ASSERT(chip8_load_from_bytes(chip, arith, sizeof arith) == 0);
+        ASSERT(chip8_load_from_bytes(jit_chip, arith, sizeof arith) == 0);
+
+        ASSERT(chip8_run(chip, 10000) == 0);
+        ASSERT(chip8_run(jit_chip, 10000) == 0);
+        ASSERT(chip->halted && jit_chip->halted);
+        for (int i = 0; i < 16; i++)
+            ASSERT_EQ_UINT(jit_chip->regs[i], chip->regs[i]);
+        ASSERT_EQ_UINT(jit_chip->reg_i, chip->reg_i);
+        ASSERT_EQ_UINT(jit_chip->pc, chip->pc);
+
+        chip8_destroy(chip);
+        chip8_destroy(jit_chip);
+    }
 
+    /* Compiled code must be discarded when the program modifies itself */
+    opts.jit = true;
+    jit_chip = chip8_new(opts);
+    ASSERT(jit_chip != NULL);
+    ASSERT(chip8_load_from_bytes(jit_chip, selfmod, sizeof selfmod) == 0);
+    ASSERT(chip8_run(jit_chip, 10000) == 0);
+    ASSERT(jit_chip->halted);
+    ASSERT_EQ_UINT(jit_chip->regs[REG_V5], 0x20);
+    ASSERT_EQ_UINT(jit_chip->regs[REG_V6], 0x26);
+
+    chip8_destroy(jit_chip);
     return 0;
 }
 
@@ -624,6 +1134,281 @@ int test_ld(void)
     return 0;
 }
 
+int test_log(void)
+{
+    FILE *output = tmpfile();
+    pthread_t threads[4];
+    char line[256];
+    unsigned lines = 0;
+
+    ASSERT(output != NULL);
+    log_set_output(output);
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, log_thread, NULL);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    /* This waits for everything to be written to the old output */
+    log_set_output(stdout);
+
+    fseek(output, 0, SEEK_SET);
+    while (fgets(line, sizeof line, output)) {
+        const char *msg = strstr(line, "INFO: ");
+
+        ASSERT(msg != NULL);
+        ASSERT(!strcmp(msg, "INFO: one two three\n"));
+        lines++;
+    }
+    fclose(output);
+    ASSERT_EQ_UINT(lines, 4 * 100);
+
+    return 0;
+}
+
+int test_movie(void)
+{
+    const char *fname = "chip8test-movie.tmp";
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+    struct chip8_movie *movie, *loaded;
+    uint8_t prog[] = {
+        0xA2, 0x0E, /* LD I, sprite */
+        0x62, 0x05, /* LD V2, 5 */
+        0xC0, 0x3F, /* loop: RND V0, #3F */
+        0xC1, 0x1F, /* RND V1, #1F */
+        0xE2, 0xA1, /* SKNP V2 */
+        0xD0, 0x11, /* DRW V0, V1, 1 */
+        0x12, 0x04, /* JP loop */
+        0xA5, 0x00, /* sprite */
+    };
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WORDS];
+    uint64_t cycles;
+    unsigned long frames;
+    size_t cursor = 0;
+
+    opts.seed = 1234;
+    opts.shift_quirks = true;
+    opts.cycles_per_frame = 30;
+    movie = chip8_movie_new(opts);
+    ASSERT(movie != NULL);
+    chip = chip8_new(chip8_movie_options(movie, opts));
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    for (int frame = 0; frame < 60; frame++) {
+        chip->key_states = frame >= 10 && frame < 30 ? 1 << 5 : 0;
+        chip8_movie_record(movie, chip->key_states);
+        ASSERT(!(chip8_run_frame(chip) & CHIP8_STOP_ERROR));
+    }
+    memcpy(display, chip->display, sizeof display);
+    cycles = chip->cycles;
+    chip8_destroy(chip);
+    ASSERT_EQ_UINT((unsigned)movie->frames, 60);
+    ASSERT_EQ_UINT((unsigned)movie->n_inputs, 3);
+    ASSERT_EQ_UINT(chip8_movie_keys(movie, 9, &cursor), 0);
+    ASSERT_EQ_UINT(chip8_movie_keys(movie, 10, &cursor), 1 << 5);
+    ASSERT_EQ_UINT(chip8_movie_keys(movie, 29, &cursor), 1 << 5);
+    ASSERT_EQ_UINT(chip8_movie_keys(movie, 59, &cursor), 0);
+
+    /* Replaying the saved movie gives exactly the same results */
+    ASSERT(chip8_movie_save(movie, fname) == 0);
+    chip8_movie_free(movie);
+    loaded = chip8_movie_load(fname);
+    remove(fname);
+    ASSERT(loaded != NULL);
+    ASSERT(loaded->shift_quirks);
+    ASSERT(!loaded->load_quirks);
+    chip = chip8_new(chip8_movie_options(loaded, chip8_options_testing()));
+    ASSERT(chip != NULL);
+    ASSERT_EQ_UINT((unsigned)chip->opts.seed, 1234);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    ASSERT(!(chip8_movie_replay(loaded, chip, &frames) &
+        (CHIP8_STOP_HALT | CHIP8_STOP_ERROR)));
+    ASSERT_EQ_UINT((unsigned)frames, 60);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, (unsigned)cycles);
+    ASSERT(memcmp(display, chip->display, sizeof display) == 0);
+
+    chip8_destroy(chip);
+    chip8_movie_free(loaded);
+    return 0;
+}
+
+int test_pack(void)
+{
+    const char *fname = "chip8test-pack.tmp";
+    uint8_t game1[] = {0x60, 0x12, 0x12, 0x02};
+    uint8_t game2[] = {0x00, 0xFF, 0x00, 0xFD};
+    struct chip8_pack_item items[] = {
+        {"chip8/GAME1", game1, sizeof game1, 0},
+        {"superchip/GAME2", game2, sizeof game2,
+            CHIP8_PACK_SHIFT_QUIRKS | CHIP8_PACK_LOAD_QUIRKS},
+        {"chip8/COPY", game1, sizeof game1, CHIP8_PACK_LOAD_QUIRKS},
+    };
+    /* The digest of "abc", from FIPS 180-2 */
+    const char *abc = "a9993e364706816aba3e25717850c26c9cd0d89d";
+    uint8_t sha1[CHIP8_SHA1_LEN];
+    char hex[CHIP8_SHA1_HEX_LEN];
+    struct chip8_pack *pack;
+    const struct chip8_pack_entry *entry;
+    struct chip8_options opts;
+    FILE *out;
+
+    chip8_sha1("abc", 3, sha1);
+    chip8_sha1_format(sha1, hex);
+    ASSERT(strcmp(hex, abc) == 0);
+    ASSERT(chip8_sha1_parse(abc, sha1) == 0);
+    ASSERT(chip8_sha1_parse("a9993e", sha1) != 0);
+
+    /* The copy of the first game is left out */
+    log_set_output(NULL);
+    ASSERT(chip8_pack_write(fname, items, 3) == 0);
+    log_set_output(stdout);
+    ASSERT((pack = chip8_pack_open(fname)) != NULL);
+    ASSERT_EQ_UINT((unsigned)chip8_pack_size(pack), 2);
+    ASSERT(chip8_pack_find_name(pack, "chip8/COPY") == NULL);
+
+    chip8_sha1(game1, sizeof game1, sha1);
+    ASSERT((entry = chip8_pack_find(pack, sha1)) != NULL);
+    ASSERT(strcmp(chip8_pack_name(pack, entry), "chip8/GAME1") == 0);
+    ASSERT_EQ_UINT(entry->len, sizeof game1);
+    ASSERT(memcmp(chip8_pack_data(pack, entry), game1, sizeof game1) == 0);
+    opts = chip8_pack_options(entry, chip8_options_testing());
+    ASSERT(!opts.shift_quirks && !opts.load_quirks);
+
+    ASSERT((entry = chip8_pack_find_name(pack, "superchip/GAME2")) != NULL);
+    ASSERT(memcmp(chip8_pack_data(pack, entry), game2, sizeof game2) == 0);
+    opts = chip8_pack_options(entry, chip8_options_testing());
+    ASSERT(opts.shift_quirks && opts.load_quirks);
+
+    sha1[0] ^= 0xFF;
+    ASSERT(chip8_pack_find(pack, sha1) == NULL);
+    chip8_pack_close(pack);
+
+    /* Missing and truncated files are rejected; empty packs are fine */
+    log_set_output(NULL);
+    ASSERT(chip8_pack_open("chip8test-nonexistent.tmp") == NULL);
+    ASSERT(chip8_pack_write(fname, NULL, 0) == 0);
+    ASSERT((pack = chip8_pack_open(fname)) != NULL);
+    ASSERT_EQ_UINT((unsigned)chip8_pack_size(pack), 0);
+    chip8_pack_close(pack);
+    ASSERT((out = fopen(fname, "wb")) != NULL);
+    ASSERT(fwrite(CHIP8_PACK_MAGIC, 1, 8, out) == 8);
+    ASSERT(fclose(out) == 0);
+    ASSERT(chip8_pack_open(fname) == NULL);
+    log_set_output(stdout);
+
+    remove(fname);
+
+    return 0;
+}
+
+int test_pool(void)
+{
+    struct chip8_pool *pool = chip8_pool_new(2);
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *a, *b;
+    struct chip8_image image;
+    struct chip8_profile *profile;
+    uint8_t prog[] = {
+        0x60, 0x34, /* LD V0, #34 */
+    };
+
+    ASSERT(pool != NULL);
+    ASSERT(chip8_image_init(&image, prog, sizeof prog) == 0);
+    ASSERT((a = chip8_pool_alloc(pool, opts, NULL)) != NULL);
+    ASSERT((b = chip8_pool_alloc(pool, opts, &image)) != NULL);
+    ASSERT(a != b);
+    ASSERT((uintptr_t)a % 64 == 0 && (uintptr_t)b % 64 == 0);
+    ASSERT(chip8_pool_alloc(pool, opts, NULL) == NULL);
+    ASSERT_EQ_UINT(b->mem[0x200], 0x60);
+    ASSERT(chip8_step(b) == 0);
+    ASSERT_EQ_UINT(b->regs[0], 0x34);
+
+    /* A returned instance comes back as good as new */
+    ASSERT(chip8_execute_opcode(a, 0x6012) == 0);
+    ASSERT_EQ_UINT(a->regs[0], 0x12);
+    a->breakpoints[0x100] = true;
+    chip8_pool_free(pool, a);
+    ASSERT((a = chip8_pool_alloc(pool, opts, NULL)) != NULL);
+    ASSERT_EQ_UINT(a->regs[0], 0);
+    ASSERT_EQ_UINT(a->pc, 0x200);
+    ASSERT_EQ_UINT(a->mem[0x200], 0);
+    ASSERT(!a->breakpoints[0x100]);
+
+    /* It keeps its profile, but not what was in it */
+    chip8_pool_free(pool, a);
+    opts.profile = true;
+    ASSERT((a = chip8_pool_alloc(pool, opts, &image)) != NULL);
+    profile = a->profile;
+    ASSERT(profile != NULL);
+    ASSERT(chip8_step(a) == 0);
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_LD_BYTE - OP_INVALID], 1);
+    chip8_pool_free(pool, a);
+    ASSERT((a = chip8_pool_alloc(pool, opts, &image)) != NULL);
+    ASSERT(a->profile == profile);
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_LD_BYTE - OP_INVALID], 0);
+    chip8_pool_free(pool, a);
+    opts.profile = false;
+    ASSERT((a = chip8_pool_alloc(pool, opts, NULL)) != NULL);
+    ASSERT(a->profile == NULL);
+
+    /* Instances still in use are cleaned up with the pool */
+    chip8_pool_free(pool, b);
+    chip8_pool_destroy(pool);
+
+    return 0;
+}
+
+int test_profile(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *plain;
+    const struct chip8_profile *profile;
+    uint8_t prog[] = {
+        0x60, 0x00, /* LD V0, 0 */
+        0x70, 0x01, /* loop: ADD V0, 1 */
+        0x30, 0x0A, /* SE V0, 10 */
+        0x12, 0x02, /* JP loop */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    plain = chip8_new(opts);
+    ASSERT(plain != NULL);
+    ASSERT(chip8_get_profile(plain) == NULL);
+    opts.profile = true;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT((profile = chip8_get_profile(chip)) != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    ASSERT(chip8_load_from_bytes(plain, prog, sizeof prog) == 0);
+
+    /* Stop reasons are the same as without profiling */
+    ASSERT(chip8_set_breakpoint(chip, 0x206, true) == 0);
+    ASSERT(chip8_set_breakpoint(plain, 0x206, true) == 0);
+    ASSERT_EQ_UINT(chip8_run_until(chip, 100, CHIP8_STOP_BREAKPOINT),
+        chip8_run_until(plain, 100, CHIP8_STOP_BREAKPOINT));
+    ASSERT_EQ_UINT(chip->pc, 0x206);
+    ASSERT_EQ_UINT(chip8_run_until(chip, 5, 0), chip8_run_until(plain, 5, 0));
+    ASSERT_EQ_UINT(chip->pc, plain->pc);
+    ASSERT(chip8_set_breakpoint(chip, 0x206, false) == 0);
+    ASSERT_EQ_UINT(chip8_run_until(chip, 100, 0), CHIP8_STOP_HALT);
+    ASSERT_EQ_UINT(chip->regs[0], 10);
+
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_LD_BYTE - OP_INVALID], 1);
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_ADD_BYTE - OP_INVALID], 10);
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_SE_BYTE - OP_INVALID], 10);
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_JP - OP_INVALID], 9);
+    ASSERT_EQ_UINT((unsigned)profile->counts[OP_EXIT - OP_INVALID], 1);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 31);
+    ASSERT(profile->samples[OP_LD_BYTE - OP_INVALID] == 1);
+    ASSERT_EQ_UINT((unsigned)profile->addr_counts[0x200 / 2], 1);
+    ASSERT_EQ_UINT((unsigned)profile->addr_counts[0x202 / 2], 10);
+    ASSERT_EQ_UINT((unsigned)profile->addr_counts[0x206 / 2], 9);
+    ASSERT_EQ_UINT((unsigned)profile->addr_counts[0x20A / 2], 0);
+
+    chip8_destroy(plain);
+    chip8_destroy(chip);
+    return 0;
+}
+
 int test_quirks(void)
 {
     struct chip8 *chip;
@@ -661,6 +1446,585 @@ int test_quirks(void)
     return 0;
 }
 
+int test_reset(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *fresh;
+    struct chip8_image image;
+    uint8_t prog[] = {
+        0x00, 0xFF, /* HIGH */
+        0xA2, 0x0C, /* LD I, data */
+        0xC0, 0xFF, /* loop: RND V0, #FF */
+        0xF0, 0x55, /* LD [I], V0 */
+        0x22, 0x0E, /* CALL sub */
+        0x12, 0x04, /* JP loop */
+        0x00, 0x00, /* data */
+        0x00, 0xEE, /* sub: RET */
+    };
+
+    opts.virtual_clock = true;
+    opts.seed = 7;
+    ASSERT(chip8_image_init(&image, prog, sizeof prog) == 0);
+    ASSERT_EQ_UINT((unsigned)image.len, sizeof prog);
+    chip = chip8_new(opts);
+    fresh = chip8_new(opts);
+    ASSERT(chip8_load_from_bytes(fresh, prog, sizeof prog) == 0);
+
+    /* The game writes to its own memory, which must not survive a reset */
+    chip8_reset(chip, &image);
+    ASSERT(chip8_run(chip, 101) == 0);
+    ASSERT(chip->highres);
+    chip8_reset(chip, &image);
+    ASSERT(!chip->highres);
+    ASSERT_EQ_UINT(chip->pc, 0x200);
+    ASSERT_EQ_UINT(chip->stack_size, 0);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 0);
+    ASSERT(memcmp(chip->mem, fresh->mem, sizeof chip->mem) == 0);
+
+    ASSERT(chip8_run(chip, 101) == 0);
+    ASSERT(chip8_run(fresh, 101) == 0);
+    ASSERT(memcmp(chip->regs, fresh->regs, sizeof chip->regs) == 0);
+    ASSERT(memcmp(chip->mem, fresh->mem, sizeof chip->mem) == 0);
+    ASSERT_EQ_UINT(chip->stack_size, fresh->stack_size);
+
+    /* Resetting with no image leaves only the hex sprites */
+    chip8_reset(chip, NULL);
+    ASSERT_EQ_UINT(chip->mem[0x200], 0);
+    ASSERT_EQ_UINT(chip->mem[0], 0xF0);
+
+    log_set_output(NULL);
+    ASSERT(chip8_image_init(&image, prog, CHIP8_PROG_SIZE + 1) != 0);
+    log_set_output(stdout);
+
+    chip8_destroy(fresh);
+    chip8_destroy(chip);
+
+    return 0;
+}
+
+int test_rewind(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+    struct chip8_rewind *rewind;
+    struct chip8_state *states = malloc(50 * sizeof *states);
+    struct chip8_state *state = malloc(sizeof *state);
+    uint8_t prog[] = {
+        0xA2, 0x0A, /* LD I, sprite */
+        0xC0, 0x3F, /* loop: RND V0, #3F */
+        0xC1, 0x1F, /* RND V1, #1F */
+        0xD0, 0x11, /* DRW V0, V1, 1 */
+        0x12, 0x02, /* JP loop */
+        0xA5, 0x00, /* sprite */
+    };
+    size_t kept;
+
+    ASSERT(states != NULL && state != NULL);
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+    opts.cycles_per_frame = 20;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    rewind = chip8_rewind_new(20, 8);
+    ASSERT(rewind != NULL);
+    ASSERT(chip8_rewind_pop(rewind, chip) != 0);
+
+    for (int i = 0; i < 50; i++) {
+        chip8_rewind_push(rewind, chip);
+        chip8_state_capture(chip, &states[i]);
+        chip8_run_frame(chip);
+    }
+    /* Once full, a whole keyframe's worth of snapshots is dropped at a time */
+    kept = chip8_rewind_size(rewind);
+    ASSERT(kept > 20 - 8 && kept <= 20);
+    ASSERT(chip8_rewind_bytes(rewind) < kept * sizeof *state / 4);
+
+    /* Go back a few frames and run forward again before going all the way */
+    for (int i = 49; i > 45; i--) {
+        ASSERT(chip8_rewind_pop(rewind, chip) == 0);
+        chip8_state_capture(chip, state);
+        ASSERT(memcmp(state, &states[i], sizeof *state) == 0);
+    }
+    chip8_rewind_push(rewind, chip);
+    chip8_run_frame(chip);
+    ASSERT(chip8_rewind_pop(rewind, chip) == 0);
+    chip8_state_capture(chip, state);
+    ASSERT(memcmp(state, &states[46], sizeof *state) == 0);
+    for (size_t i = 45; i >= 50 - kept; i--) {
+        ASSERT(chip8_rewind_pop(rewind, chip) == 0);
+        chip8_state_capture(chip, state);
+        ASSERT(memcmp(state, &states[i], sizeof *state) == 0);
+    }
+    ASSERT_EQ_UINT((unsigned)chip8_rewind_size(rewind), 0);
+    ASSERT(chip8_rewind_pop(rewind, chip) != 0);
+
+    chip8_rewind_destroy(rewind);
+    chip8_destroy(chip);
+    free(state);
+    free(states);
+    return 0;
+}
+
+int test_rnd(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chips[3];
+    uint8_t prog[] = {
+        0xC0, 0xFF, /* loop: RND V0, #FF */
+        0xC1, 0x0F, /* RND V1, #0F */
+        0x12, 0x00, /* JP loop */
+    };
+    bool differs = false;
+
+    for (int i = 0; i < 3; i++) {
+        opts.seed = i < 2 ? 1234 : 5678;
+        chips[i] = chip8_new(opts);
+        ASSERT(chips[i] != NULL);
+        ASSERT(chip8_load_from_bytes(chips[i], prog, sizeof prog) == 0);
+    }
+    for (int n = 0; n < 100; n++) {
+        for (int i = 0; i < 3; i++)
+            ASSERT(chip8_run(chips[i], 3) == 0);
+        /* The same seed always gives the same numbers */
+        ASSERT_EQ_UINT(chips[0]->regs[REG_V0], chips[1]->regs[REG_V0]);
+        ASSERT_EQ_UINT(chips[0]->regs[REG_V1], chips[1]->regs[REG_V1]);
+        /* The mask applies */
+        ASSERT(chips[0]->regs[REG_V1] <= 0x0F);
+        differs = differs || chips[0]->regs[REG_V0] != chips[2]->regs[REG_V0];
+    }
+    /* A different seed gives different numbers */
+    ASSERT(differs);
+
+    for (int i = 0; i < 3; i++)
+        chip8_destroy(chips[i]);
+    return 0;
+}
+
+int test_rom(void)
+{
+    const char *fname = "chip8test-rom.tmp";
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    struct chip8_rom rom;
+    uint8_t prog[] = {
+        0x60, 0x12, /* LD V0, #12 */
+        0x71, 0x01, /* ADD V1, 1 */
+    };
+    uint8_t big[CHIP8_PROG_SIZE + 1] = {0};
+    FILE *out;
+
+    ASSERT(chip != NULL);
+    ASSERT((out = fopen(fname, "wb")) != NULL);
+    ASSERT(fwrite(prog, 1, sizeof prog, out) == sizeof prog);
+    ASSERT(fclose(out) == 0);
+
+    ASSERT(chip8_rom_open(&rom, fname) == 0);
+    ASSERT_EQ_UINT((unsigned)rom.len, sizeof prog);
+    ASSERT(memcmp(rom.data, prog, sizeof prog) == 0);
+    /* The rest of the program area reads as zero */
+    for (size_t i = sizeof prog; i < CHIP8_PROG_SIZE; i++)
+        ASSERT_EQ_UINT(rom.data[i], 0);
+    chip8_rom_close(&rom);
+
+    ASSERT(chip8_load_from_path(chip, fname) == 0);
+    ASSERT(memcmp(chip->mem + CHIP8_PROG_START, prog, sizeof prog) == 0);
+    ASSERT(chip8_run(chip, 2) == 0);
+    ASSERT_EQ_UINT(chip->regs[0], 0x12);
+    ASSERT_EQ_UINT(chip->regs[1], 0x01);
+
+    /* An empty file is a valid (if useless) ROM */
+    ASSERT((out = fopen(fname, "wb")) != NULL);
+    ASSERT(fclose(out) == 0);
+    ASSERT(chip8_rom_open(&rom, fname) == 0);
+    ASSERT_EQ_UINT((unsigned)rom.len, 0);
+    chip8_rom_close(&rom);
+
+    /* Programs which don't fit in memory are rejected */
+    ASSERT((out = fopen(fname, "wb")) != NULL);
+    ASSERT(fwrite(big, 1, sizeof big, out) == sizeof big);
+    ASSERT(fclose(out) == 0);
+    log_set_output(NULL);
+    ASSERT(chip8_rom_open(&rom, fname) != 0);
+    ASSERT(chip8_load_from_path(chip, fname) != 0);
+    ASSERT(chip8_load_from_bytes(chip, big, sizeof big) != 0);
+    log_set_output(stdout);
+
+    remove(fname);
+    chip8_destroy(chip);
+
+    return 0;
+}
+
+int test_run(void)
+{
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    uint8_t prog[] = {
+        0x60, 0x00, /* LD V0, 0 */
+        0x61, 0x0A, /* LD V1, 10 */
+        0x70, 0x03, /* loop: ADD V0, 3 */
+        0x71, 0xFF, /* ADD V1, #FF */
+        0x31, 0x00, /* SE V1, 0 */
+        0x12, 0x04, /* JP loop */
+        0xF2, 0x0A, /* LD V2, K */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+
+    /* Running a limited number of cycles */
+    ASSERT(chip8_run(chip, 3) == 0);
+    ASSERT_EQ_UINT(chip->pc, 0x206);
+    ASSERT_EQ_UINT(chip->regs[REG_V0], 3);
+    /* Execution should stop when waiting for a key */
+    ASSERT(chip8_run(chip, 1000) == 0);
+    ASSERT_EQ_UINT(chip->pc, 0x20C);
+    ASSERT_EQ_UINT(chip->regs[REG_V0], 30);
+    ASSERT_EQ_UINT(chip->regs[REG_V1], 0);
+    ASSERT(chip8_run(chip, 1000) == 0);
+    ASSERT_EQ_UINT(chip->pc, 0x20C);
+    /* And continue until the program exits once one is pressed */
+    chip->key_states = 1 << 0xB;
+    ASSERT(chip8_run(chip, 1000) == 0);
+    ASSERT(chip->halted);
+    ASSERT_EQ_UINT(chip->pc, 0x210);
+    ASSERT_EQ_UINT(chip->regs[REG_V2], 0xB);
+
+    /* RET with an empty call stack is an error */
+    chip->halted = false;
+    chip8_execute_opcode(chip, 0x00EE);
+    ASSERT(chip8_run(chip, 1) != 0);
+
+    chip8_destroy(chip);
+    return 0;
+}
+
+int test_run_until(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+    uint8_t prog[] = {
+        0x60, 0x00, /* LD V0, 0 */
+        0x61, 0x00, /* LD V1, 0 */
+        0x70, 0x01, /* loop: ADD V0, 1 */
+        0x71, 0x02, /* ADD V1, 2 */
+        0x30, 0x05, /* SE V0, 5 */
+        0x12, 0x04, /* JP loop */
+        0x00, 0xE0, /* CLS */
+        0xF2, 0x0A, /* LD V2, K */
+        0x00, 0xFD, /* EXIT */
+    };
+    uint8_t scroll_prog[] = {
+        0x60, 0x00, /* LD V0, 0 */
+        0x00, 0xFB, /* SCR */
+        0x70, 0x01, /* loop: ADD V0, 1 */
+        0x12, 0x04, /* JP loop */
+    };
+
+    /* Breakpoints must also work when the recompiler is enabled */
+    for (int jit = 0; jit < 2; jit++) {
+        opts.jit = jit;
+        chip = chip8_new(opts);
+        ASSERT(chip != NULL);
+        ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+
+        ASSERT(chip8_set_breakpoint(chip, 0x206, true) == 0);
+        ASSERT(chip8_set_breakpoint(chip, 0x207, true) != 0);
+        ASSERT_EQ_UINT(chip8_run_until(chip, 1000, CHIP8_STOP_BREAKPOINT), CHIP8_STOP_BREAKPOINT);
+        ASSERT_EQ_UINT(chip->pc, 0x206);
+        ASSERT_EQ_UINT(chip->regs[REG_V0], 1);
+        ASSERT_EQ_UINT(chip->regs[REG_V1], 0);
+        /* Resuming executes the instruction at the breakpoint */
+        ASSERT_EQ_UINT(chip8_run_until(chip, 1000, CHIP8_STOP_BREAKPOINT), CHIP8_STOP_BREAKPOINT);
+        ASSERT_EQ_UINT(chip->pc, 0x206);
+        ASSERT_EQ_UINT(chip->regs[REG_V0], 2);
+        ASSERT_EQ_UINT(chip->regs[REG_V1], 2);
+        /* Breakpoints are ignored unless requested */
+        ASSERT_EQ_UINT(chip8_run_until(chip, 3, 0), CHIP8_STOP_CYCLES);
+        ASSERT_EQ_UINT(chip->pc, 0x204);
+        ASSERT(chip8_set_breakpoint(chip, 0x206, false) == 0);
+
+        /* Drawing */
+        ASSERT_EQ_UINT(chip8_run_until(chip, 1000, CHIP8_STOP_DRAW | CHIP8_STOP_BREAKPOINT), CHIP8_STOP_DRAW);
+        ASSERT_EQ_UINT(chip->pc, 0x20E);
+        ASSERT_EQ_UINT(chip->regs[REG_V0], 5);
+        ASSERT_EQ_UINT(chip->regs[REG_V1], 10);
+
+        /* Waiting for a key uses up cycles unless we stop */
+        ASSERT_EQ_UINT(chip8_run_until(chip, 50, 0), CHIP8_STOP_CYCLES);
+        ASSERT_EQ_UINT(chip->pc, 0x20E);
+        ASSERT_EQ_UINT(chip8_run_until(chip, 50, CHIP8_STOP_KEY_WAIT), CHIP8_STOP_KEY_WAIT);
+        ASSERT_EQ_UINT(chip->pc, 0x20E);
+        chip->key_states = 1 << 0x4;
+        ASSERT_EQ_UINT(chip8_run_until(chip, 50, CHIP8_STOP_KEY_WAIT), CHIP8_STOP_HALT);
+        ASSERT_EQ_UINT(chip->regs[REG_V2], 0x4);
+        ASSERT_EQ_UINT(chip8_run_until(chip, 50, 0), CHIP8_STOP_HALT);
+
+        /* Errors */
+        chip->halted = false;
+        chip8_execute_opcode(chip, 0x00EE);
+        ASSERT(chip8_run_until(chip, 1, 0) & CHIP8_STOP_ERROR);
+        chip8_destroy(chip);
+    }
+
+    /* Frames, using the virtual clock */
+    opts = chip8_options_testing();
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+    opts.cycles_per_frame = 10;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    ASSERT_EQ_UINT(chip8_run_until(chip, 4, CHIP8_STOP_FRAME), CHIP8_STOP_CYCLES);
+    ASSERT_EQ_UINT(chip8_run_frame(chip), CHIP8_STOP_FRAME);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 10);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 1);
+    ASSERT_EQ_UINT(chip8_run_frame(chip), CHIP8_STOP_FRAME);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 20);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 2);
+    chip8_destroy(chip);
+
+    /* A delayed draw ends the frame early */
+    opts.delay_draws = true;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, scroll_prog, sizeof scroll_prog) == 0);
+    ASSERT_EQ_UINT(chip8_run_frame(chip), CHIP8_STOP_FRAME);
+    ASSERT_EQ_UINT(chip->pc, 0x204);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 2);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 1);
+    ASSERT_EQ_UINT(chip8_run_frame(chip), CHIP8_STOP_FRAME);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 12);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 2);
+    chip8_destroy(chip);
+
+    return 0;
+}
+
+int test_state(void)
+{
+    const char *fname = "chip8test-state.tmp";
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *copy;
+    struct chip8_state *state = malloc(sizeof *state);
+    FILE *output;
+    uint8_t prog[] = {
+        0x00, 0xFF, /* HIGH */
+        0xA2, 0x10, /* LD I, sprite */
+        0xC0, 0x7F, /* loop: RND V0, #7F */
+        0xC1, 0x3F, /* RND V1, #3F */
+        0xD0, 0x11, /* DRW V0, V1, 1 */
+        0x22, 0x0E, /* CALL sub */
+        0x12, 0x04, /* JP loop */
+        0x00, 0xEE, /* sub: RET */
+        0xA5, 0x00, /* sprite */
+    };
+    uint8_t wait_prog[] = {
+        0x60, 0x01, /* LD V0, 1 */
+        0xF1, 0x0A, /* LD V1, K */
+        0x12, 0x04, /* loop: JP loop */
+    };
+    uint8_t regs[16];
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WORDS];
+
+    ASSERT(state != NULL);
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+    opts.seed = 42;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    ASSERT(chip8_run(chip, 102) == 0);
+    ASSERT_EQ_UINT(chip->stack_size, 1);
+
+    /* Running again from a snapshot gives the same results */
+    chip8_state_capture(chip, state);
+    ASSERT(chip8_run(chip, 500) == 0);
+    memcpy(regs, chip->regs, sizeof regs);
+    memcpy(display, chip->display, sizeof display);
+    ASSERT(chip8_state_restore(chip, state) == 0);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 102);
+    ASSERT_EQ_UINT(chip->stack_size, 1);
+    ASSERT(chip8_run(chip, 500) == 0);
+    ASSERT(memcmp(regs, chip->regs, sizeof regs) == 0);
+    ASSERT(memcmp(display, chip->display, sizeof display) == 0);
+
+    /* Likewise when going through a file and a fresh interpreter */
+    ASSERT(chip8_save_state(chip, fname) == 0);
+    ASSERT(chip8_run(chip, 500) == 0);
+    opts.seed = 0;
+    opts.shift_quirks = true;
+    copy = chip8_new(opts);
+    ASSERT(copy != NULL);
+    ASSERT(chip8_load_state(copy, fname) == 0);
+    ASSERT(!copy->opts.shift_quirks);
+    ASSERT(copy->highres);
+    ASSERT(chip8_run(copy, 500) == 0);
+    ASSERT_EQ_UINT(copy->pc, chip->pc);
+    ASSERT_EQ_UINT((unsigned)copy->cycles, (unsigned)chip->cycles);
+    ASSERT_EQ_UINT((unsigned)copy->timer_ticks, (unsigned)chip->timer_ticks);
+    ASSERT(memcmp(copy->regs, chip->regs, sizeof copy->regs) == 0);
+    ASSERT(memcmp(copy->display, chip->display, sizeof copy->display) == 0);
+    ASSERT(memcmp(copy->mem, chip->mem, sizeof copy->mem) == 0);
+    remove(fname);
+
+    /* Invalid states are rejected without changing anything */
+    chip8_state_capture(chip, state);
+    state->version++;
+    ASSERT(chip8_state_restore(copy, state) != 0);
+    state->version--;
+    state->stack_size = CHIP8_STACK_MAX + 1;
+    copy->pc = 0x300;
+    ASSERT(chip8_state_restore(copy, state) != 0);
+    ASSERT_EQ_UINT(copy->pc, 0x300);
+    state->stack_size = 0;
+    state->cycles_per_frame = 0;
+    ASSERT(chip8_state_restore(copy, state) != 0);
+    ASSERT_EQ_UINT((unsigned)copy->opts.cycles_per_frame,
+        (unsigned)chip->opts.cycles_per_frame);
+    ASSERT_EQ_UINT(copy->pc, 0x300);
+    /* A file is checked just the same */
+    ASSERT((output = fopen(fname, "wb")) != NULL);
+    ASSERT(fwrite(state, sizeof *state, 1, output) == 1);
+    ASSERT(fclose(output) == 0);
+    ASSERT(chip8_load_state(copy, fname) != 0);
+    ASSERT_EQ_UINT(copy->pc, 0x300);
+    remove(fname);
+    chip8_destroy(copy);
+    chip8_destroy(chip);
+
+    /* A key wait on the last cycle of a frame can be saved and resumed */
+    opts = chip8_options_testing();
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+    opts.cycles_per_frame = 2;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, wait_prog, sizeof wait_prog) == 0);
+    ASSERT_EQ_UINT(chip8_run_until(chip, 10, CHIP8_STOP_KEY_WAIT),
+        CHIP8_STOP_KEY_WAIT);
+    ASSERT_EQ_UINT((unsigned)chip->tick_cycles, 2);
+    ASSERT(chip8_save_state(chip, fname) == 0);
+    copy = chip8_new(opts);
+    ASSERT(copy != NULL);
+    ASSERT(chip8_load_state(copy, fname) == 0);
+    remove(fname);
+    ASSERT_EQ_UINT(copy->pc, 0x202);
+    /* Both finish the saved frame, then run the next one the same way */
+    chip->key_states = copy->key_states = 1 << 0x7;
+    ASSERT_EQ_UINT(chip8_run_frame(chip), CHIP8_STOP_FRAME);
+    ASSERT_EQ_UINT(chip8_run_frame(copy), CHIP8_STOP_FRAME);
+    ASSERT_EQ_UINT(copy->regs[REG_V1], 0x7);
+    ASSERT_EQ_UINT(copy->pc, chip->pc);
+    ASSERT_EQ_UINT((unsigned)copy->cycles, (unsigned)chip->cycles);
+    ASSERT_EQ_UINT((unsigned)copy->timer_ticks, (unsigned)chip->timer_ticks);
+    ASSERT_EQ_UINT((unsigned)copy->tick_cycles, (unsigned)chip->tick_cycles);
+    chip8_destroy(copy);
+    chip8_destroy(chip);
+
+    free(state);
+    return 0;
+}
+
+int test_trace(void)
+{
+    const char *fname = "chip8test-trace.tmp";
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip = chip8_new(opts);
+    struct chip8_trace *trace;
+    struct chip8_trace_header header;
+    struct chip8_trace_record *records = malloc(10001 * sizeof *records);
+    FILE *input;
+    uint8_t prog[] = {
+        0x60, 0x05, /* LD V0, 5 */
+        0xA3, 0x00, /* LD I, #300 */
+        0x70, 0x01, /* loop: ADD V0, 1 */
+        0x12, 0x04, /* JP loop */
+    };
+
+    ASSERT(chip != NULL && records != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    ASSERT((trace = chip8_trace_open(fname, CHIP8_TRACE_SHIFT_QUIRKS)) != NULL);
+    chip8_set_trace(chip, trace);
+    /* Enough instructions to fill several blocks of the ring */
+    ASSERT_EQ_UINT(chip8_run_until(chip, 10000, 0), CHIP8_STOP_CYCLES);
+    chip8_set_trace(chip, NULL);
+    ASSERT(chip8_trace_close(trace) == 0);
+
+    ASSERT((input = fopen(fname, "rb")) != NULL);
+    ASSERT(chip8_trace_read_header(input, fname, &header) == 0);
+    ASSERT_EQ_UINT(header.flags, CHIP8_TRACE_SHIFT_QUIRKS);
+    ASSERT_EQ_UINT(fread(records, sizeof *records, 10001, input), 10000);
+    fclose(input);
+    remove(fname);
+
+    ASSERT_EQ_UINT(records[0].pc, 0x200);
+    ASSERT_EQ_UINT(records[0].opcode, 0x6005);
+    ASSERT_EQ_UINT(records[0].reg_mask, 1 << REG_V0);
+    ASSERT_EQ_UINT(records[1].reg_i, 0x300);
+    ASSERT_EQ_UINT(records[1].reg_mask, 0);
+    ASSERT_EQ_UINT(records[9998].pc, 0x204);
+    ASSERT_EQ_UINT(records[9998].opcode, 0x7001);
+    ASSERT_EQ_UINT(records[9998].reg_mask, 1 << REG_V0);
+    ASSERT_EQ_UINT(records[9999].pc, 0x206);
+    ASSERT_EQ_UINT(records[9999].reg_mask, 0);
+
+    free(records);
+    chip8_destroy(chip);
+    return 0;
+}
+
+int test_virtual_clock(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+    uint8_t prog[] = {
+        0x60, 0x05, /* LD V0, 5 */
+        0xF0, 0x15, /* LD DT, V0 */
+        0xF1, 0x07, /* loop: LD V1, DT */
+        0x31, 0x00, /* SE V1, 0 */
+        0x12, 0x04, /* JP loop */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+    opts.cycles_per_frame = 10;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+
+    /* The delay timer should tick once every 10 instructions */
+    ASSERT(chip8_run(chip, 25) == 0);
+    ASSERT_EQ_UINT(chip->reg_dt, 3);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 2);
+    ASSERT_EQ_UINT((unsigned)chip->tick_cycles, 5);
+    /* It reaches zero after 50 instructions, and the loop exits shortly after */
+    ASSERT(chip8_run(chip, 1000) == 0);
+    ASSERT(chip->halted);
+    ASSERT_EQ_UINT(chip->reg_dt, 0);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 5);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 53);
+    chip8_destroy(chip);
+
+    /* A delayed draw instruction waits for the next tick */
+    opts.delay_draws = true;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    /* LD V0, 3 */
+    chip8_execute_opcode(chip, 0x6003);
+    /* LD ST, V0 */
+    chip8_execute_opcode(chip, 0xF018);
+    /* DRW V0, V0, 1 */
+    chip8_execute_opcode(chip, 0xD001);
+    ASSERT_EQ_UINT(chip->reg_st, 2);
+    ASSERT_EQ_UINT((unsigned)chip->timer_ticks, 1);
+    ASSERT_EQ_UINT((unsigned)chip->tick_cycles, 0);
+    chip8_destroy(chip);
+
+    return 0;
+}
+
 static void testing_run(const char *name, int (*test)(void))
 {
     int res;
@@ -674,6 +2038,43 @@ static void testing_run(const char *name, int (*test)(void))
     }
 }
 
+static void *log_thread(void *data)
+{
+    (void)data;
+    for (int i = 0; i < 100; i++) {
+        log_message_begin(LOG_INFO);
+        log_message_part("one");
+        log_message_part(" two");
+        log_message_part(" %s", "three");
+        log_message_end();
+    }
+
+    return NULL;
+}
+
+static void *handoff_thread(void *data)
+{
+    struct handoff *handoff = data;
+    struct chip8_input input = {CHIP8_INPUT_KEY_DOWN, 0};
+
+    for (unsigned long i = 0; i < HANDOFF_COUNT; i++) {
+        struct chip8_frame *frame = chip8_triple_buffer_back(handoff->frames);
+
+        frame->number = i;
+        frame->dirty_rows = UINT64_C(1) << i % 64;
+        frame->display[0][0] = i;
+        frame->display[CHIP8_DISPLAY_HEIGHT - 1][0] = i;
+        chip8_triple_buffer_publish(handoff->frames);
+    }
+    for (unsigned long i = 0; i < HANDOFF_COUNT; i++) {
+        input.key = i % 16;
+        while (!chip8_input_queue_push(handoff->input, input))
+            sched_yield();
+    }
+
+    return NULL;
+}
+
 static void testing_setup(void)
 {
     log_debug("Starting tests");
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "log.h"
+#include "trace.h"
+
+static const char *HELP =
+    "Prints a Chip-8/Super-Chip execution trace in readable form.\n"
+    "\n"
+    "Options:\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -V, --version               show version information and exit\n"
+    "  -v, --verbose               increase verbosity\n";
+static const char *USAGE = "Usage: chip8trace [OPTION...] FILE\n";
+static const char *VERSION_STRING = "chip8trace " PROJECT_VERSION "\n";
+
+/**
+ * The number of records to read at once.
+ */
+#define READ_RECORDS 4096
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The trace file to print.
+     */
+    char *fname;
+};
+
+static struct progopts progopts_default(void);
+/**
+ * Prints a single trace record.
+ */
+static void print_record(
+    const struct chip8_trace_record *record, bool shift_quirks);
+static int run(struct progopts opts);
+
+int main(int argc, char **argv)
+{
+    struct progopts opts = progopts_default();
+    int option;
+    const struct option options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'}, {0, 0, 0, 0},
+    };
+
+    log_init(argc >= 1 ? argv[0] : "chip8trace", stderr, LOG_WARNING);
+
+    while ((option = getopt_long(argc, argv, "hVv", options, NULL)) != -1) {
+        switch (option) {
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            return 0;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            return 0;
+        case 'v':
+            opts.verbosity++;
+            break;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "%s", USAGE);
+        return 2;
+    }
+    opts.fname = argv[optind];
+
+    return run(opts);
+}
+
+static struct progopts progopts_default(void)
+{
+    return (struct progopts){
+        .verbosity = 0,
+        .fname = NULL,
+    };
+}
+
+static void print_record(
+    const struct chip8_trace_record *record, bool shift_quirks)
+{
+    char buf[100];
+
+    chip8_instruction_format(
+        chip8_instruction_from_opcode(record->opcode, shift_quirks), NULL, buf,
+        sizeof buf);
+    printf("%10lu  %03X  %04X  %-20s I=%03X", (unsigned long)record->frame,
+        (unsigned)record->pc, (unsigned)record->opcode, buf,
+        (unsigned)record->reg_i);
+    for (int r = 0; r < 16; r++)
+        if (record->reg_mask & (1 << r))
+            printf(" V%X", (unsigned)r);
+    putchar('\n');
+}
+
+static int run(struct progopts opts)
+{
+    static struct chip8_trace_record records[READ_RECORDS];
+    struct chip8_trace_header header;
+    FILE *input;
+    size_t n;
+    int retval = 0;
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity == 2)
+        log_set_level(LOG_DEBUG);
+    else if (opts.verbosity >= 3)
+        log_set_level(LOG_TRACE);
+
+    if (!(input = fopen(opts.fname, "rb"))) {
+        log_error("Could not open trace file '%s': %s", opts.fname,
+            strerror(errno));
+        return 1;
+    }
+    if (chip8_trace_read_header(input, opts.fname, &header)) {
+        retval = 1;
+        goto EXIT_FILE_OPENED;
+    }
+
+    printf("%10s  %-3s  %-4s  %-20s %s\n", "FRAME", "PC", "OP", "INSTRUCTION",
+        "EFFECT");
+    while ((n = fread(records, sizeof *records, READ_RECORDS, input)) > 0)
+        for (size_t i = 0; i < n; i++)
+            print_record(
+                &records[i], header.flags & CHIP8_TRACE_SHIFT_QUIRKS);
+    if (ferror(input)) {
+        log_error("Error reading from trace file '%s'", opts.fname);
+        retval = 1;
+    }
+
+EXIT_FILE_OPENED:
+    fclose(input);
+    return retval;
+}
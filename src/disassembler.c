@@ -10,11 +10,11 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 
 #include "instruction.h"
 #include "log.h"
 #include "memory.h"
+#include "rom.h"
 
 /**
  * An ordered collection of jump and return points.
@@ -75,12 +75,18 @@ struct chip8disasm {
      * the reserved 512 bytes of interpreter memory), but that all the
      * addresses referred to by instructions in the program *will* be offset by
      * these 512 bytes.
+     *
+     * This points into `rom`.
      */
-    uint8_t *mem;
+    const uint8_t *mem;
     /**
      * The length of the program being disassembled.
      */
     size_t proglen;
+    /**
+     * The ROM image containing the program.
+     */
+    struct chip8_rom rom;
     /**
      * The list of jump/return points.
      */
@@ -152,34 +158,14 @@ struct chip8disasm *chip8disasm_from_file(
     struct chip8disasm_options opts, const char *fname)
 {
     struct chip8disasm *disasm;
-    struct stat stats;
-    FILE *input;
 
     disasm = xcalloc(1, sizeof *disasm);
     disasm->opts = opts;
-    /* Figure out how long the program is */
-    if (stat(fname, &stats) != 0) {
-        log_error("Could not stat '%s': %s", fname, strerror(errno));
-        goto FAIL;
-    }
-    disasm->proglen = stats.st_size;
-    if (disasm->proglen > CHIP8_PROG_SIZE) {
-        log_error("Input program is too large");
+    /* The program is only ever read, so it can be used straight from the map */
+    if (chip8_rom_open(&disasm->rom, fname))
         goto FAIL;
-    }
-    disasm->mem = xmalloc(disasm->proglen);
-    /* Read in the program data */
-    if ((input = fopen(fname, "r")) == NULL) {
-        log_error("Could not open input file '%s': %s", fname, strerror(errno));
-        goto FAIL;
-    }
-    fread(disasm->mem, 1, disasm->proglen, input);
-    if (ferror(input)) {
-        log_error("Error reading from file '%s': %s", fname, strerror(errno));
-        fclose(input);
-        goto FAIL;
-    }
-    fclose(input);
+    disasm->mem = disasm->rom.data;
+    disasm->proglen = disasm->rom.len;
 
     jpret_list_init(&disasm->jpret_list, 64);
     jpret_list_init(&disasm->label_list, 64);
@@ -197,7 +183,7 @@ void chip8disasm_destroy(struct chip8disasm *disasm)
 {
     if (!disasm)
         return;
-    free(disasm->mem);
+    chip8_rom_close(&disasm->rom);
     jpret_list_clear(&disasm->jpret_list);
     jpret_list_clear(&disasm->label_list);
     free(disasm);
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "handoff.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+/**
+ * The size of a cache line (or at least a common one), in bytes.
+ */
+#define HANDOFF_CACHE_LINE 64
+/**
+ * The flag set in the middle index of a triple buffer when it holds a frame
+ * which the reader hasn't taken yet.
+ */
+#define TRIPLE_BUFFER_FRESH 4
+
+/*
+ * The handoff needs atomic operations, which C99 doesn't have, so without the
+ * GCC builtins each structure falls back to protecting them with a mutex.
+ */
+#if defined(__GNUC__)
+#define LOAD(ptr, lock) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE(ptr, val, lock) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define EXCHANGE(ptr, val, lock)                                               \
+    __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#else
+#define LOAD(ptr, lock) locked_load((ptr), (lock))
+#define STORE(ptr, val, lock) locked_exchange((ptr), (val), (lock))
+#define EXCHANGE(ptr, val, lock) locked_exchange((ptr), (val), (lock))
+#endif
+
+struct chip8_triple_buffer {
+    struct chip8_frame frames[3];
+    /**
+     * The index of the frame being written.
+     */
+    size_t back;
+    /**
+     * The index of the frame held by the reader.
+     */
+    size_t front;
+    /**
+     * The index of the frame which is neither being written nor held by the
+     * reader, along with `TRIPLE_BUFFER_FRESH` if it was published after the
+     * reader last took a frame.
+     *
+     * This is the only part shared between the threads; the writer and reader
+     * each swap their own frame with it.
+     */
+    size_t middle;
+    /**
+     * The changed rows of the frames published since the one the reader is
+     * last known to have taken, to be added to the next frame published (used
+     * only by the writer).
+     */
+    uint64_t pending_rows;
+    pthread_mutex_t lock;
+};
+
+struct chip8_input_queue {
+    struct chip8_input *events;
+    /**
+     * One less than the capacity, which is a power of two.
+     */
+    size_t mask;
+    /**
+     * The number of events ever popped (written only by the consumer).
+     */
+    size_t head;
+    /* The head and tail are written by different threads */
+    char pad[HANDOFF_CACHE_LINE - sizeof(size_t)];
+    /**
+     * The number of events ever pushed (written only by the producer).
+     */
+    size_t tail;
+    pthread_mutex_t lock;
+};
+
+#if !defined(__GNUC__)
+static size_t locked_load(size_t *ptr, pthread_mutex_t *lock);
+static size_t locked_exchange(size_t *ptr, size_t val, pthread_mutex_t *lock);
+#endif
+
+void chip8_frame_capture(struct chip8_frame *frame, struct chip8 *chip)
+{
+    memcpy(frame->display, chip->display, sizeof frame->display);
+    frame->dirty_rows = chip8_take_dirty_rows(chip);
+    frame->highres = chip->highres;
+    frame->sound = chip->reg_st != 0;
+    frame->halted = chip->halted;
+}
+
+bool chip8_frame_get_pixel(const struct chip8_frame *frame, int x, int y)
+{
+    return (frame->display[y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+void chip8_frame_to_pixels(const struct chip8_frame *frame, uint32_t *pixels,
+    size_t pitch, uint32_t on, uint32_t off)
+{
+    int scale = frame->highres ? 1 : 2;
+    int width = CHIP8_DISPLAY_WIDTH / scale;
+    int height = CHIP8_DISPLAY_HEIGHT / scale;
+
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t *)((char *)pixels + y * pitch);
+
+        for (int x = 0; x < width; x++)
+            /* Remember that the leftmost pixel is the most significant bit */
+            row[x] = (frame->display[y][x / 64] >> (63 - x % 64)) & 1 ? on
+                                                                      : off;
+    }
+}
+
+struct chip8_triple_buffer *chip8_triple_buffer_new(void)
+{
+    struct chip8_triple_buffer *buf = xcalloc(1, sizeof *buf);
+
+    buf->back = 0;
+    buf->middle = 1;
+    buf->front = 2;
+    pthread_mutex_init(&buf->lock, NULL);
+
+    return buf;
+}
+
+void chip8_triple_buffer_destroy(struct chip8_triple_buffer *buf)
+{
+    if (!buf)
+        return;
+    pthread_mutex_destroy(&buf->lock);
+    free(buf);
+}
+
+struct chip8_frame *chip8_triple_buffer_back(struct chip8_triple_buffer *buf)
+{
+    return &buf->frames[buf->back];
+}
+
+void chip8_triple_buffer_publish(struct chip8_triple_buffer *buf)
+{
+    uint64_t rows = buf->frames[buf->back].dirty_rows;
+    size_t old;
+
+    /*
+     * The previous frame may yet be replaced by this one, so this one has to
+     * include its changes (and those of any frames it replaced) in case it
+     * is.
+     */
+    buf->frames[buf->back].dirty_rows |= buf->pending_rows;
+    old = EXCHANGE(&buf->middle, buf->back | TRIPLE_BUFFER_FRESH, &buf->lock);
+    buf->back = old & ~(size_t)TRIPLE_BUFFER_FRESH;
+    /* If it wasn't fresh any more, the reader took it and is up to date */
+    buf->pending_rows = old & TRIPLE_BUFFER_FRESH
+        ? buf->pending_rows | rows : rows;
+}
+
+const struct chip8_frame *chip8_triple_buffer_take(
+    struct chip8_triple_buffer *buf)
+{
+    size_t old;
+
+    if (!(LOAD(&buf->middle, &buf->lock) & TRIPLE_BUFFER_FRESH))
+        return NULL;
+    /* Only the writer can change the middle frame, and it keeps it fresh */
+    old = EXCHANGE(&buf->middle, buf->front, &buf->lock);
+    buf->front = old & ~(size_t)TRIPLE_BUFFER_FRESH;
+
+    return &buf->frames[buf->front];
+}
+
+struct chip8_input_queue *chip8_input_queue_new(size_t capacity)
+{
+    struct chip8_input_queue *queue = xcalloc(1, sizeof *queue);
+    size_t size = 1;
+
+    while (size < capacity)
+        size *= 2;
+    queue->events = xcalloc(size, sizeof *queue->events);
+    queue->mask = size - 1;
+    pthread_mutex_init(&queue->lock, NULL);
+
+    return queue;
+}
+
+void chip8_input_queue_destroy(struct chip8_input_queue *queue)
+{
+    if (!queue)
+        return;
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->events);
+    free(queue);
+}
+
+bool chip8_input_queue_push(
+    struct chip8_input_queue *queue, struct chip8_input input)
+{
+    size_t tail = queue->tail;
+
+    if (tail - LOAD(&queue->head, &queue->lock) > queue->mask)
+        return false;
+    queue->events[tail & queue->mask] = input;
+    STORE(&queue->tail, tail + 1, &queue->lock);
+
+    return true;
+}
+
+bool chip8_input_queue_pop(
+    struct chip8_input_queue *queue, struct chip8_input *input)
+{
+    size_t head = queue->head;
+
+    if (head == LOAD(&queue->tail, &queue->lock))
+        return false;
+    *input = queue->events[head & queue->mask];
+    STORE(&queue->head, head + 1, &queue->lock);
+
+    return true;
+}
+
+#if !defined(__GNUC__)
+static size_t locked_load(size_t *ptr, pthread_mutex_t *lock)
+{
+    size_t val;
+
+    pthread_mutex_lock(lock);
+    val = *ptr;
+    pthread_mutex_unlock(lock);
+
+    return val;
+}
+
+static size_t locked_exchange(size_t *ptr, size_t val, pthread_mutex_t *lock)
+{
+    size_t old;
+
+    pthread_mutex_lock(lock);
+    old = *ptr;
+    *ptr = val;
+    pthread_mutex_unlock(lock);
+
+    return old;
+}
+#endif
@@ -552,3 +552,59 @@ bool chip8_instruction_uses_addr(struct chip8_instruction instr)
         return false;
     }
 }
+
+const char *chip8_operation_name(enum chip8_operation op)
+{
+    static const char *const names[CHIP8_OP_COUNT] = {
+        [OP_INVALID - OP_INVALID] = "invalid",
+        [OP_SCD - OP_INVALID] = "SCD nibble",
+        [OP_CLS - OP_INVALID] = "CLS",
+        [OP_RET - OP_INVALID] = "RET",
+        [OP_SCR - OP_INVALID] = "SCR",
+        [OP_SCL - OP_INVALID] = "SCL",
+        [OP_EXIT - OP_INVALID] = "EXIT",
+        [OP_LOW - OP_INVALID] = "LOW",
+        [OP_HIGH - OP_INVALID] = "HIGH",
+        [OP_JP - OP_INVALID] = "JP addr",
+        [OP_CALL - OP_INVALID] = "CALL addr",
+        [OP_SE_BYTE - OP_INVALID] = "SE Vx, byte",
+        [OP_SNE_BYTE - OP_INVALID] = "SNE Vx, byte",
+        [OP_SE_REG - OP_INVALID] = "SE Vx, Vy",
+        [OP_LD_BYTE - OP_INVALID] = "LD Vx, byte",
+        [OP_ADD_BYTE - OP_INVALID] = "ADD Vx, byte",
+        [OP_LD_REG - OP_INVALID] = "LD Vx, Vy",
+        [OP_OR - OP_INVALID] = "OR Vx, Vy",
+        [OP_AND - OP_INVALID] = "AND Vx, Vy",
+        [OP_XOR - OP_INVALID] = "XOR Vx, Vy",
+        [OP_ADD_REG - OP_INVALID] = "ADD Vx, Vy",
+        [OP_SUB - OP_INVALID] = "SUB Vx, Vy",
+        [OP_SHR - OP_INVALID] = "SHR Vx",
+        [OP_SHR_QUIRK - OP_INVALID] = "SHR Vx, Vy",
+        [OP_SUBN - OP_INVALID] = "SUBN Vx, Vy",
+        [OP_SHL - OP_INVALID] = "SHL Vx",
+        [OP_SHL_QUIRK - OP_INVALID] = "SHL Vx, Vy",
+        [OP_SNE_REG - OP_INVALID] = "SNE Vx, Vy",
+        [OP_LD_I - OP_INVALID] = "LD I, addr",
+        [OP_JP_V0 - OP_INVALID] = "JP V0, addr",
+        [OP_RND - OP_INVALID] = "RND Vx, byte",
+        [OP_DRW - OP_INVALID] = "DRW Vx, Vy, nibble",
+        [OP_SKP - OP_INVALID] = "SKP Vx",
+        [OP_SKNP - OP_INVALID] = "SKNP Vx",
+        [OP_LD_REG_DT - OP_INVALID] = "LD Vx, DT",
+        [OP_LD_KEY - OP_INVALID] = "LD Vx, K",
+        [OP_LD_DT_REG - OP_INVALID] = "LD DT, Vx",
+        [OP_LD_ST - OP_INVALID] = "LD ST, Vx",
+        [OP_ADD_I - OP_INVALID] = "ADD I, Vx",
+        [OP_LD_F - OP_INVALID] = "LD F, Vx",
+        [OP_LD_HF - OP_INVALID] = "LD HF, Vx",
+        [OP_LD_B - OP_INVALID] = "LD B, Vx",
+        [OP_LD_DEREF_I_REG - OP_INVALID] = "LD [I], Vx",
+        [OP_LD_REG_DEREF_I - OP_INVALID] = "LD Vx, [I]",
+        [OP_LD_R_REG - OP_INVALID] = "LD R, Vx",
+        [OP_LD_REG_R - OP_INVALID] = "LD Vx, R",
+    };
+
+    if (op < OP_INVALID || op > OP_LD_REG_R)
+        return "unknown";
+    return names[op - OP_INVALID];
+}
@@ -8,6 +8,9 @@
 #include "interpreter.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +19,7 @@
 
 #include "log.h"
 #include "memory.h"
+#include "rom.h"
 
 /**
  * The address of the low-resolution hex digit sprites in memory.
@@ -45,6 +49,45 @@
  * The number of nanoseconds in a second.
  */
 #define NANOS_IN_SECOND 1000000000UL
+/**
+ * The size of a cache line (or at least a common one), in bytes.
+ */
+#define CHIP8_CACHE_LINE 64
+/**
+ * The longest loop (in instructions, including the jump back) which is
+ * checked to see whether it is an idle loop.
+ */
+#define CHIP8_IDLE_LOOP_MAX 8
+
+/*
+ * Threaded dispatch relies on the GNU "labels as values" extension, so we can
+ * only use it when that's available.  It can also be turned off explicitly by
+ * defining CHIP8_NO_THREADED_DISPATCH.
+ */
+#if defined(__GNUC__) && !defined(CHIP8_NO_THREADED_DISPATCH)
+#define CHIP8_THREADED_DISPATCH
+#endif
+
+struct chip8_pool {
+    /**
+     * The instances, each taking up `stride` bytes.
+     */
+    void *block;
+    size_t capacity;
+    /**
+     * The size of each instance, rounded up to a whole number of cache lines.
+     */
+    size_t stride;
+    /**
+     * The lock protecting everything below.
+     */
+    pthread_mutex_t lock;
+    /**
+     * The indices of the free instances, as a stack.
+     */
+    size_t *free;
+    size_t n_free;
+};
 
 /**
  * The low-resolution hex digit sprites.
@@ -85,14 +128,6 @@ static uint8_t chip8_hex_high[16][CHIP8_HEX_HIGH_HEIGHT] = {
     {0xFF, 0x80, 0x80, 0x80, 0xFC, 0x80, 0x80, 0x80, 0x80, 0x80},
 };
 
-/**
- * An element in the call stack.
- */
-struct chip8_call_node {
-    uint16_t call_addr;
-    struct chip8_call_node *next;
-};
-
 /**
  * Draws a (low-resolution) sprite at the given position.
  *
@@ -107,37 +142,129 @@ static bool chip8_draw_sprite(struct chip8 *chip, int x, int y,
  */
 static bool chip8_draw_sprite_high(
     struct chip8 *chip, int x, int y, uint16_t sprite_start);
+/**
+ * XORs a single row of a sprite onto the display.
+ *
+ * @param bits The row of the sprite, with the leftmost pixel in the most
+ * significant bit.
+ * @param width The width of the sprite, in pixels (at most 64).
+ *
+ * @return Whether there was a collision.
+ */
+static bool chip8_draw_row(
+    struct chip8 *chip, int x, int y, uint64_t bits, int width);
 /**
  * Logs the state of the registers (using level LOG_DEBUG).
  */
 static void chip8_log_regs(const struct chip8 *chip);
 /**
- * Executes the given instruction in the interpreter.
+ * Decodes the instruction in the given slot into the decode cache.
+ */
+static void chip8_decode_slot(struct chip8 *chip, size_t slot);
+/**
+ * Returns the decoded instruction in the given slot, decoding it first if it
+ * isn't in the cache.
+ */
+static const struct chip8_decoded *chip8_decoded_slot(
+    struct chip8 *chip, size_t slot);
+/**
+ * Executes instructions until one of the given stop conditions occurs or the
+ * given number of instructions have been executed.
+ *
+ * This is the core of the interpreter, which is used by `chip8_step` and
+ * `chip8_run_until`.
  *
  * @param chip The interpreter to use for execution.
- * @param inst The instruction to execute.
- * @param[out] pc The new program counter value to use.
+ * @param cycles The maximum number of instructions to execute.
+ * @param stop_mask The conditions which should stop execution.
+ *
+ * @return The reasons execution stopped.
+ */
+static unsigned chip8_run_loop(
+    struct chip8 *chip, unsigned long cycles, unsigned stop_mask);
+/**
+ * Executes instructions one at a time using `chip8_run_loop`, recording each
+ * one in the profile and/or trace.
+ *
+ * This behaves exactly like `chip8_run_loop` (with the same arguments), just
+ * more slowly.
+ */
+static unsigned chip8_run_instrumented(
+    struct chip8 *chip, unsigned long cycles, unsigned stop_mask);
+/**
+ * Executes instructions using `chip8_run_instrumented` if profiling or
+ * tracing is enabled, or `chip8_run_loop` otherwise.
+ */
+static unsigned chip8_execute(
+    struct chip8 *chip, unsigned long cycles, unsigned stop_mask);
+/**
+ * Checks whether the loop from `start` to the jump back to it at `end` is an
+ * idle loop, which can be skipped until something outside it changes.
+ *
+ * A loop is idle if it only reads the delay timer and keys, compares and
+ * loads registers, and comes back around to the jump with the registers as
+ * they were when the jump was made.  Nothing it reads can change until the
+ * timer ticks or a key is pressed, so every iteration after that is exactly
+ * the same as the one checked here.
+ *
+ * The instructions are taken from the decode cache, since this is checked on
+ * every short backward jump, idle or not.
  *
- * @return An error code.
+ * @return The number of instructions in an iteration of the loop (including
+ * the jump), or 0 if it is not idle.
  */
-static int chip8_execute(
-    struct chip8 *chip, struct chip8_instruction inst, uint16_t *pc);
+static unsigned long chip8_idle_loop(
+    struct chip8 *chip, uint16_t start, uint16_t end);
 /**
  * Updates the internal timer value and other internal timers.
+ *
+ * @return Whether the timer ticked.
  */
-static void chip8_timer_update(struct chip8 *chip);
+static bool chip8_timer_update(struct chip8 *chip);
 /**
  * Updates just the internal timer.
  */
 static void chip8_timer_update_ticks(struct chip8 *chip);
+/**
+ * Advances the virtual clock to the next tick, updating the internal timers.
+ */
+static void chip8_timer_tick(struct chip8 *chip);
 /**
  * Delays (by sleeping) until the next tick has arrived.
  */
 static void chip8_wait_cycle(struct chip8 *chip);
+/**
+ * Sleeps until the wall clock reaches the next tick of the timer.
+ */
+static void chip8_wait_tick(const struct chip8 *chip);
+/**
+ * Seeds the interpreter's random number generator.
+ */
+static void rand_seed(struct chip8 *chip, uint64_t seed);
+/**
+ * Sets up an instance with the given options and memory image (or empty
+ * memory if it is NULL), as for `chip8_new`.
+ *
+ * The instance must either be zeroed or have been set up before, in which
+ * case its recompiler and profile are kept if they are still wanted.
+ */
+static void chip8_init(struct chip8 *chip, struct chip8_options opts,
+    const struct chip8_image *image);
+/**
+ * Frees everything owned by an instance, but not the instance itself.
+ */
+static void chip8_fini(struct chip8 *chip);
+/**
+ * Returns the next 32 bits of output from the random number generator.
+ *
+ * This is the PCG32 (XSH RR) generator, which is small, fast and has good
+ * statistical properties; see http://www.pcg-random.org/.
+ */
+static uint32_t rand_next(struct chip8 *chip);
 /**
  * Returns a random byte.
  */
-static uint8_t rand_byte(void);
+static uint8_t rand_byte(struct chip8 *chip);
 
 struct chip8_options chip8_options_default(void)
 {
@@ -146,6 +273,11 @@ struct chip8_options chip8_options_default(void)
         .enable_timer = true,
         .shift_quirks = false,
         .timer_freq = 60,
+        .virtual_clock = false,
+        .cycles_per_frame = 100,
+        .skip_idle = true,
+        .stack_depth = 16,
+        .seed = 0,
     };
 }
 
@@ -153,36 +285,136 @@ struct chip8 *chip8_new(struct chip8_options opts)
 {
     struct chip8 *chip = xcalloc(1, sizeof *chip);
 
-    chip->opts = opts;
+    chip8_init(chip, opts, NULL);
+    return chip;
+}
+
+void chip8_destroy(struct chip8 *chip)
+{
+    chip8_fini(chip);
+    free(chip);
+}
+
+void chip8_reset(struct chip8 *chip, const struct chip8_image *image)
+{
+    if (image) {
+        memcpy(chip->mem, image->mem, sizeof chip->mem);
+    } else {
+        memset(chip->mem, 0, sizeof chip->mem);
+        /* Load low-resolution hex sprites into memory */
+        memcpy(chip->mem + CHIP8_HEX_LOW_ADDR, chip8_hex_low,
+            sizeof chip8_hex_low);
+        /* Load high-resolution hex sprites into memory */
+        memcpy(chip->mem + CHIP8_HEX_HIGH_ADDR, chip8_hex_high,
+            sizeof chip8_hex_high);
+    }
+    memset(chip->display, 0, sizeof chip->display);
+    memset(chip->regs, 0, sizeof chip->regs);
+    memset(chip->rpl, 0, sizeof chip->rpl);
+    chip->reg_i = 0;
+    chip->reg_dt = 0;
+    chip->reg_st = 0;
     /* Start program at beginning of usable memory */
-    chip->pc = 0x200;
+    chip->pc = CHIP8_PROG_START;
     chip->halted = false;
     chip->highres = false;
-    chip->needs_full_redraw = true;
-    chip8_timer_update_ticks(chip);
-    chip->call_stack = NULL;
+    chip->dirty_rows = UINT64_MAX;
+    chip->timer_ticks = 0;
+    chip->tick_cycles = 0;
+    if (!chip->opts.virtual_clock)
+        chip8_timer_update_ticks(chip);
+    chip->cycles = 0;
+    chip->draws = 0;
+    chip->stack_size = 0;
     chip->key_states = 0;
+    rand_seed(chip, chip->opts.seed);
+    /* Anything we decoded or compiled before is now out of date */
+    chip8_invalidate_code(chip, 0, CHIP8_MEM_SIZE);
+}
 
-    /* Load low-resolution hex sprites into memory */
-    memcpy(chip->mem + CHIP8_HEX_LOW_ADDR, chip8_hex_low, sizeof chip8_hex_low);
-    /* Load high-resolution hex sprites into memory */
+int chip8_image_init(
+    struct chip8_image *image, const uint8_t *bytes, size_t len)
+{
+    if (len > CHIP8_PROG_SIZE) {
+        log_error("Input program is too big");
+        return -1;
+    }
+    memset(image->mem, 0, sizeof image->mem);
+    memcpy(image->mem + CHIP8_HEX_LOW_ADDR, chip8_hex_low, sizeof chip8_hex_low);
     memcpy(
-        chip->mem + CHIP8_HEX_HIGH_ADDR, chip8_hex_high, sizeof chip8_hex_high);
+        image->mem + CHIP8_HEX_HIGH_ADDR, chip8_hex_high, sizeof chip8_hex_high);
+    memcpy(image->mem + CHIP8_PROG_START, bytes, len);
+    image->len = len;
+
+    return 0;
+}
 
-    srand(time(NULL));
+struct chip8_pool *chip8_pool_new(size_t capacity)
+{
+    struct chip8_pool *pool = xcalloc(1, sizeof *pool);
+    int err;
 
-    return chip;
+    pool->capacity = capacity;
+    pool->stride = (sizeof(struct chip8) + CHIP8_CACHE_LINE - 1) /
+        CHIP8_CACHE_LINE * CHIP8_CACHE_LINE;
+    if ((err = posix_memalign(
+             &pool->block, CHIP8_CACHE_LINE, capacity * pool->stride)))
+        die(2, "chip8_pool_new: could not allocate %zu instances: %s",
+            capacity, strerror(err));
+    /*
+     * This is the only time the instances are cleared in full; after that,
+     * chip8_init only resets what it needs to.
+     */
+    memset(pool->block, 0, capacity * pool->stride);
+    pool->free = xcalloc(capacity, sizeof *pool->free);
+    /* Hand out the instances in order, to start with */
+    for (size_t i = 0; i < capacity; i++)
+        pool->free[i] = capacity - 1 - i;
+    pool->n_free = capacity;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
 }
 
-void chip8_destroy(struct chip8 *chip)
+void chip8_pool_destroy(struct chip8_pool *pool)
+{
+    if (!pool)
+        return;
+    /* Free instances still own their recompiler and profile */
+    for (size_t i = 0; i < pool->capacity; i++)
+        chip8_fini((struct chip8 *)((char *)pool->block + i * pool->stride));
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free);
+    free(pool->block);
+    free(pool);
+}
+
+struct chip8 *chip8_pool_alloc(struct chip8_pool *pool,
+    struct chip8_options opts, const struct chip8_image *image)
 {
-    struct chip8_call_node *node = chip->call_stack, *oldnode;
-    while (node != NULL) {
-        oldnode = node;
-        node = node->next;
-        free(oldnode);
+    struct chip8 *chip;
+    size_t idx;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_free == 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
     }
-    free(chip);
+    idx = pool->free[--pool->n_free];
+    pthread_mutex_unlock(&pool->lock);
+
+    chip = (struct chip8 *)((char *)pool->block + idx * pool->stride);
+    chip8_init(chip, opts, image);
+    return chip;
+}
+
+void chip8_pool_free(struct chip8_pool *pool, struct chip8 *chip)
+{
+    size_t idx = ((char *)chip - (char *)pool->block) / pool->stride;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->n_free++] = idx;
+    pthread_mutex_unlock(&pool->lock);
 }
 
 struct chip8_instruction chip8_current_instr(struct chip8 *chip)
@@ -190,73 +422,129 @@ struct chip8_instruction chip8_current_instr(struct chip8 *chip)
     /* The Chip-8 is big-endian */
     uint16_t opcode = ((uint16_t)chip->mem[chip->pc] << 8) |
         (uint16_t)chip->mem[chip->pc + 1];
+
+    /*
+     * The cache only holds the compact form, so the full instruction is
+     * decoded again here; the slot is still filled in, as it would be by
+     * executing the instruction.  A misaligned program counter doesn't
+     * correspond to any slot.
+     */
+    if (chip->pc % 2 == 0)
+        chip8_decoded_slot(chip, chip->pc / 2);
     return chip8_instruction_from_opcode(opcode, chip->opts.shift_quirks);
 }
 
+bool chip8_get_pixel(const struct chip8 *chip, int x, int y)
+{
+    return (chip->display[y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+uint64_t chip8_take_dirty_rows(struct chip8 *chip)
+{
+    uint64_t rows = chip->dirty_rows;
+
+    chip->dirty_rows = 0;
+    return rows;
+}
+
+void chip8_invalidate_code(struct chip8 *chip, uint16_t addr, size_t len)
+{
+    size_t end;
+
+    if (len == 0 || addr >= CHIP8_MEM_SIZE)
+        return;
+    end = addr + len > CHIP8_MEM_SIZE ? CHIP8_MEM_SIZE : addr + len;
+    /*
+     * A write to either byte of an instruction affects it, so we need to
+     * round the start down and the end up to slot boundaries.
+     */
+    memset(chip->decoded + addr / 2, 0, (end + 1) / 2 - addr / 2);
+    if (chip->jit)
+        chip8_jit_invalidate(chip->jit, addr, len);
+}
+
+void chip8_timer_sync(struct chip8 *chip)
+{
+    if (!chip->opts.virtual_clock)
+        chip8_timer_update_ticks(chip);
+}
+
+int chip8_set_breakpoint(struct chip8 *chip, uint16_t addr, bool enabled)
+{
+    if (addr >= CHIP8_MEM_SIZE || addr % 2 != 0) {
+        log_error("Cannot set breakpoint at invalid address 0x%X", addr);
+        return 1;
+    }
+    chip->breakpoints[addr / 2] = enabled;
+    /* Make sure the interpreter goes back through the slow path */
+    chip8_invalidate_code(chip, addr, 2);
+
+    return 0;
+}
+
 int chip8_execute_opcode(struct chip8 *chip, uint16_t opcode)
 {
     chip->mem[chip->pc] = (opcode & 0xFF00) >> 8;
     chip->mem[chip->pc + 1] = opcode & 0xFF;
+    chip8_invalidate_code(chip, chip->pc, 2);
     return chip8_step(chip);
 }
 
-int chip8_load_from_bytes(struct chip8 *chip, uint8_t *bytes, size_t len)
+int chip8_load_from_bytes(
+    struct chip8 *chip, const uint8_t *bytes, size_t len)
 {
-    int mempos = CHIP8_PROG_START;
-
-    while (len--) {
-        if (mempos >= CHIP8_MEM_SIZE) {
-            log_error("Input program is too big");
-            return -1;
-        }
-        chip->mem[mempos++] = *bytes++;
+    if (len > CHIP8_PROG_SIZE) {
+        log_error("Input program is too big");
+        return -1;
     }
+    memcpy(chip->mem + CHIP8_PROG_START, bytes, len);
+    chip8_invalidate_code(chip, CHIP8_PROG_START, len);
 
     return 0;
 }
 
 int chip8_load_from_file(struct chip8 *chip, FILE *file)
 {
-    int c;
-    int mempos = CHIP8_PROG_START;
+    /* One byte more than will fit, to detect programs which are too big */
+    uint8_t buf[CHIP8_PROG_SIZE + 1];
+    size_t len = fread(buf, 1, sizeof buf, file);
 
-    while ((c = getc(file)) != EOF) {
-        if (mempos >= CHIP8_MEM_SIZE) {
-            log_error("Input program is too big");
-            return -1;
-        }
-        chip->mem[mempos++] = c;
-    }
     if (ferror(file)) {
-        log_error("Error reading from game file: ", strerror(errno));
+        log_error("Error reading from game file: %s", strerror(errno));
         return 1;
     }
 
-    return 0;
+    return chip8_load_from_bytes(chip, buf, len);
 }
 
-int chip8_step(struct chip8 *chip)
+int chip8_load_from_path(struct chip8 *chip, const char *fname)
 {
-    struct chip8_instruction instr;
-    char instr_fmt[100];
+    struct chip8_rom rom;
+    int retval;
+
+    if (chip8_rom_open(&rom, fname))
+        return 1;
+    retval = chip8_load_from_bytes(chip, rom.data, rom.len);
+    chip8_rom_close(&rom);
+
+    return retval;
+}
 
+int chip8_step(struct chip8 *chip)
+{
     if (!chip->halted) {
         if (chip->pc >= CHIP8_MEM_SIZE) {
             log_error("Program counter went out of bounds");
             chip->halted = true;
+            return 1;
         }
 
-        instr = chip8_current_instr(chip);
-        if (log_get_level() >= LOG_TRACE) {
-            chip8_instruction_format(instr, NULL, instr_fmt, sizeof(instr_fmt));
-            log_trace("Executing instruction (PC %03X) %s", chip->pc, instr_fmt);
-        }
-        if (chip8_execute(chip, instr, &chip->pc) != 0) {
+        if (chip8_execute(chip, 1, 0) & CHIP8_STOP_ERROR) {
             log_error("Aborting execution");
             return 1;
         }
 
-        if (chip->opts.enable_timer) {
+        if (chip->opts.enable_timer && !chip->opts.virtual_clock) {
             unsigned long nanos = NANOS_IN_SECOND / chip->opts.timer_freq / DELAY_TICK_FRACTION;
             nanosleep(&(struct timespec){
                 .tv_sec = nanos / NANOS_IN_SECOND,
@@ -270,25 +558,271 @@ int chip8_step(struct chip8 *chip)
     return 0;
 }
 
-static bool chip8_draw_sprite(struct chip8 *chip, int x, int y, uint16_t sprite_start, uint16_t sprite_len)
+int chip8_run(struct chip8 *chip, unsigned long max_cycles)
 {
-    bool collision = false;
+    if (chip8_execute(chip, max_cycles, CHIP8_STOP_KEY_WAIT) & CHIP8_STOP_ERROR) {
+        log_error("Aborting execution");
+        return 1;
+    }
 
+    return 0;
+}
+
+unsigned chip8_run_until(
+    struct chip8 *chip, unsigned long max_cycles, unsigned stop_mask)
+{
+    return chip8_execute(chip, max_cycles, stop_mask);
+}
+
+unsigned chip8_run_frame(struct chip8 *chip)
+{
     /*
-     * Low-resolution sprites are always 8 pixels wide. Here, j will be the
-     * column of the sprite to draw, so it is an index from the most significant
-     * byte of the sprite at row i.
+     * With a wall clock, we don't know in advance how many instructions will
+     * fit in the frame, so we just run until the timer ticks.
      */
-    for (int i = 0; i < sprite_len && y + i < CHIP8_DISPLAY_HEIGHT; i++)
-        for (int j = 0; j < 8 && x + j < CHIP8_DISPLAY_WIDTH; j++)
-            if (chip->mem[sprite_start + i] & (1 << (7 - j))) {
-                int dispx = x + j, dispy = y + i;
-                /* If the pixel on screen is set, we have a collision */
-                collision = collision || chip->display[dispx][dispy];
-                chip->display[dispx][dispy] = !chip->display[dispx][dispy];
-                if (chip->draw_callback)
-                    chip->draw_callback(dispx, dispy, chip->display[dispx][dispy], chip->highres);
+    if (chip->opts.enable_timer && !chip->opts.virtual_clock)
+        return chip8_execute(chip, ULONG_MAX, CHIP8_STOP_FRAME);
+    return chip8_execute(chip, chip->opts.cycles_per_frame, CHIP8_STOP_FRAME);
+}
+
+void chip8_set_trace(struct chip8 *chip, struct chip8_trace *trace)
+{
+    chip->trace = trace;
+}
+
+const struct chip8_profile *chip8_get_profile(const struct chip8 *chip)
+{
+    return chip->profile;
+}
+
+void chip8_profile_print(const struct chip8_profile *profile, FILE *output)
+{
+    int order[CHIP8_OP_COUNT];
+    uint64_t total = 0;
+
+    for (int op = 0; op < CHIP8_OP_COUNT; op++) {
+        order[op] = op;
+        total += profile->counts[op];
+    }
+    /* There are few enough operations that insertion sort is fine */
+    for (int j = 1; j < CHIP8_OP_COUNT; j++)
+        for (int k = j; k > 0 &&
+             profile->counts[order[k]] > profile->counts[order[k - 1]]; k--) {
+            int tmp = order[k];
+            order[k] = order[k - 1];
+            order[k - 1] = tmp;
+        }
+
+    fprintf(output, "%-20s %14s %7s %10s\n", "OPERATION", "COUNT", "%",
+        "NS/INSTR");
+    for (int j = 0; j < CHIP8_OP_COUNT && profile->counts[order[j]] > 0; j++) {
+        int op = order[j];
+
+        fprintf(output, "%-20s %14" PRIu64 " %7.2f ",
+            chip8_operation_name(op + OP_INVALID), profile->counts[op],
+            100.0 * profile->counts[op] / total);
+        if (profile->samples[op] > 0)
+            fprintf(output, "%10.1f\n",
+                (double)profile->nanos[op] / profile->samples[op]);
+        else
+            fprintf(output, "%10s\n", "-");
+    }
+    fprintf(output, "%-20s %14" PRIu64 "\n", "TOTAL", total);
+}
+
+int chip8_profile_save_heatmap(
+    const struct chip8_profile *profile, const char *fname)
+{
+    FILE *output;
+
+    if (!(output = fopen(fname, "w"))) {
+        log_error("Could not open heat map file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    for (size_t slot = 0; slot < CHIP8_INSTR_SLOTS; slot++)
+        if (profile->addr_counts[slot] > 0)
+            fprintf(output, "%03zX %" PRIu64 "\n", 2 * slot,
+                profile->addr_counts[slot]);
+    if (ferror(output)) {
+        log_error("Could not write heat map file '%s'", fname);
+        fclose(output);
+        return 1;
+    }
+    if (fclose(output) != 0) {
+        log_error("Could not write heat map file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+static unsigned chip8_run_instrumented(
+    struct chip8 *chip, unsigned long cycles, unsigned stop_mask)
+{
+    struct chip8_profile *profile = chip->profile;
+    unsigned stopped = CHIP8_STOP_CYCLES;
+
+    for (unsigned long n = 0; n < cycles; n++) {
+        uint16_t pc = chip->pc;
+        uint64_t before = chip->cycles;
+        bool timed = profile && before % CHIP8_PROFILE_SAMPLE_INTERVAL == 0;
+        struct timespec start, end;
+        int op = OP_INVALID;
+        struct chip8_trace_record record = {.pc = pc};
+        uint8_t regs[16];
+
+        /*
+         * The run loop never stops at a breakpoint on the first instruction
+         * it executes, which here is every instruction, so we have to check
+         * for them ourselves.
+         */
+        if (pc < CHIP8_MEM_SIZE && pc % 2 == 0) {
+            if (n > 0 && (stop_mask & CHIP8_STOP_BREAKPOINT) &&
+                chip->breakpoints[pc / 2]) {
+                log_debug("Stopped at breakpoint (PC %03X)", pc);
+                return CHIP8_STOP_BREAKPOINT;
+            }
+            op = chip8_decoded_slot(chip, pc / 2)->op;
+            record.opcode = (uint16_t)chip->mem[pc] << 8 | chip->mem[pc + 1];
+        }
+        if (chip->trace) {
+            record.frame = (uint32_t)chip->timer_ticks;
+            memcpy(regs, chip->regs, sizeof regs);
+        }
+
+        if (timed)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        stopped = chip8_run_loop(chip, 1, stop_mask);
+        if (chip->cycles != before && profile) {
+            profile->counts[op - OP_INVALID]++;
+            if (pc < CHIP8_MEM_SIZE)
+                profile->addr_counts[pc / 2]++;
+            if (timed) {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                profile->samples[op - OP_INVALID]++;
+                profile->nanos[op - OP_INVALID] +=
+                    (end.tv_sec - start.tv_sec) * NANOS_IN_SECOND +
+                    (end.tv_nsec - start.tv_nsec);
             }
+        }
+        if (chip->cycles != before && chip->trace) {
+            record.reg_i = chip->reg_i;
+            for (int r = 0; r < 16; r++)
+                if (chip->regs[r] != regs[r])
+                    record.reg_mask |= 1 << r;
+            chip8_trace_record(chip->trace, &record);
+        }
+        if (stopped != CHIP8_STOP_CYCLES)
+            return stopped;
+    }
+
+    return stopped;
+}
+
+static unsigned chip8_execute(
+    struct chip8 *chip, unsigned long cycles, unsigned stop_mask)
+{
+    if (chip->profile || chip->trace)
+        return chip8_run_instrumented(chip, cycles, stop_mask);
+    return chip8_run_loop(chip, cycles, stop_mask);
+}
+
+static unsigned long chip8_idle_loop(
+    struct chip8 *chip, uint16_t start, uint16_t end)
+{
+    uint8_t v[16];
+    uint16_t pc = start;
+    unsigned long len = 0;
+
+    memcpy(v, chip->regs, sizeof v);
+    for (; len < CHIP8_IDLE_LOOP_MAX; len++) {
+        const struct chip8_decoded *inst;
+
+        /* We must not skip over a breakpoint */
+        if (pc < start || pc > end || chip->breakpoints[pc / 2])
+            return 0;
+        if (pc == end)
+            return memcmp(v, chip->regs, sizeof v) == 0 ? len + 1 : 0;
+
+        inst = chip8_decoded_slot(chip, pc / 2);
+        switch (inst->op) {
+        case OP_SE_BYTE:
+            pc += v[inst->vx] == inst->arg ? 4 : 2;
+            break;
+        case OP_SNE_BYTE:
+            pc += v[inst->vx] != inst->arg ? 4 : 2;
+            break;
+        case OP_SE_REG:
+            pc += v[inst->vx] == v[inst->vy] ? 4 : 2;
+            break;
+        case OP_SNE_REG:
+            pc += v[inst->vx] != v[inst->vy] ? 4 : 2;
+            break;
+        case OP_SKP:
+            pc += chip->key_states & (1 << (v[inst->vx] & 0xF)) ? 4 : 2;
+            break;
+        case OP_SKNP:
+            pc += !(chip->key_states & (1 << (v[inst->vx] & 0xF))) ? 4 : 2;
+            break;
+        case OP_LD_BYTE:
+            v[inst->vx] = inst->arg;
+            pc += 2;
+            break;
+        case OP_LD_REG:
+            v[inst->vx] = v[inst->vy];
+            pc += 2;
+            break;
+        case OP_LD_REG_DT:
+            v[inst->vx] = chip->reg_dt;
+            pc += 2;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+static void chip8_decode_slot(struct chip8 *chip, size_t slot)
+{
+    /* The Chip-8 is big-endian */
+    uint16_t opcode = ((uint16_t)chip->mem[2 * slot] << 8) |
+        (uint16_t)chip->mem[2 * slot + 1];
+
+    struct chip8_instruction inst =
+        chip8_instruction_from_opcode(opcode, chip->opts.shift_quirks);
+    struct chip8_decoded *dec = &chip->decode_cache[slot];
+
+    dec->op = inst.op;
+    dec->vx = (opcode >> 8) & 0xF;
+    dec->vy = (opcode >> 4) & 0xF;
+    if (inst.op == OP_INVALID)
+        dec->arg = opcode;
+    else if (chip8_instruction_uses_addr(inst))
+        dec->arg = opcode & 0xFFF;
+    else if (inst.op == OP_DRW || inst.op == OP_SCD)
+        dec->arg = opcode & 0xF;
+    else
+        dec->arg = opcode & 0xFF;
+    chip->decoded[slot] = !chip->breakpoints[slot];
+}
+
+static const struct chip8_decoded *chip8_decoded_slot(
+    struct chip8 *chip, size_t slot)
+{
+    if (!chip->decoded[slot])
+        chip8_decode_slot(chip, slot);
+    return &chip->decode_cache[slot];
+}
+
+static bool chip8_draw_sprite(struct chip8 *chip, int x, int y, uint16_t sprite_start, uint16_t sprite_len)
+{
+    bool collision = false;
+
+    /* Low-resolution sprites are always 8 pixels wide, one byte per row */
+    for (int i = 0; i < sprite_len && y + i < CHIP8_DISPLAY_HEIGHT; i++)
+        collision |= chip8_draw_row(chip, x, y + i, chip->mem[sprite_start + i], 8);
 
     return collision;
 }
@@ -297,29 +831,48 @@ static bool chip8_draw_sprite_high(struct chip8 *chip, int x, int y, uint16_t sp
 {
     bool collision = false;
 
+    /* High-resolution sprites are always 16x16, two bytes per row */
+    for (int i = 0; i < 16 && y + i < CHIP8_DISPLAY_HEIGHT; i++) {
+        uint16_t bits = ((uint16_t)chip->mem[sprite_start + 2 * i] << 8) |
+            chip->mem[sprite_start + 2 * i + 1];
+        collision |= chip8_draw_row(chip, x, y + i, bits, 16);
+    }
+
+    return collision;
+}
+
+static bool chip8_draw_row(
+    struct chip8 *chip, int x, int y, uint64_t bits, int width)
+{
+    uint64_t *row = chip->display[y];
+    uint64_t sprite[CHIP8_DISPLAY_WORDS] = {0};
+    bool collision = false;
+
+    if (x >= CHIP8_DISPLAY_WIDTH)
+        return false;
     /*
-     * High-resolution sprites are always 16x16. Here, i is the row of the
-     * sprite to draw and j is the column.
+     * Line the sprite up with the left edge of the display, then shift it
+     * into place.  Anything shifted past the right edge is clipped.
      */
-    for (int i = 0; i < 16 && y + i < CHIP8_DISPLAY_HEIGHT; i++)
-        for (int j = 0; j < 16 && x + j < CHIP8_DISPLAY_WIDTH; j++) {
-            int bytepos = sprite_start + 2 * i + j / 8;
-            int bitpos = 7 - j % 8;
-            if (chip->mem[bytepos] & (1 << bitpos)) {
-                int dispx = x + j, dispy = y + i;
-                /* If the pixel on screen is set, we have a collision */
-                collision = collision || chip->display[dispx][dispy];
-                chip->display[dispx][dispy] = !chip->display[dispx][dispy];
-                if (chip->draw_callback)
-                    chip->draw_callback(dispx, dispy, chip->display[dispx][dispy], chip->highres);
-            }
-        }
+    bits <<= 64 - width;
+    sprite[x / 64] = bits >> x % 64;
+    if (x % 64 != 0 && x / 64 + 1 < CHIP8_DISPLAY_WORDS)
+        sprite[x / 64 + 1] = bits << (64 - x % 64);
+
+    for (int w = 0; w < CHIP8_DISPLAY_WORDS; w++) {
+        collision = collision || (row[w] & sprite[w]) != 0;
+        row[w] ^= sprite[w];
+        if (sprite[w] != 0)
+            chip->dirty_rows |= UINT64_C(1) << y;
+    }
 
     return collision;
 }
 
 static void chip8_log_regs(const struct chip8 *chip)
 {
+    if (!LOG_COMPILED(LOG_DEBUG) || log_get_level() < LOG_DEBUG)
+        return;
     log_message_begin(LOG_DEBUG);
     log_message_part("Register values: ");
     for (int i = 0; i < 16; i++)
@@ -329,306 +882,618 @@ static void chip8_log_regs(const struct chip8 *chip)
     log_message_end();
 }
 
-static int chip8_execute(struct chip8 *chip, struct chip8_instruction inst, uint16_t *pc)
-{
-    uint16_t new_pc;
-
-    if (chip->opts.enable_timer)
-        chip8_timer_update(chip);
-
-    new_pc = chip->pc + 2;
-    switch (inst.op) {
-    case OP_INVALID:
-        log_warning("Invalid instruction encountered and ignored (opcode 0x%hX)", inst.opcode);
-        break;
-    case OP_SCD:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        for (int y = CHIP8_DISPLAY_HEIGHT - 1; y >= inst.nibble; y--)
-            for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++)
-                chip->display[x][y] = chip->display[x][y - inst.nibble];
-        for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++)
-            memset(chip->display[x], 0, inst.nibble);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_CLS:
+/*
+ * The execution engine is written so that it can be compiled using either
+ * threaded dispatch (where each instruction handler jumps directly to the
+ * handler for the next instruction) or a plain switch statement.  Threaded
+ * dispatch gives the branch predictor a separate indirect jump for every
+ * handler, which makes it a good deal faster, but it relies on the GNU "labels
+ * as values" extension.
+ */
+#ifdef CHIP8_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+/**
+ * Begins the instruction handler for the given operation.
+ */
+#define CASE(op) L_##op
+/**
+ * Transfers control to the handler for the current instruction.
+ */
+#define DISPATCH() goto *dispatch_table[inst->op - OP_INVALID]
+/**
+ * Continues execution at the given address.
+ */
+#define CONTINUE_AT(addr)                                                      \
+    do {                                                                       \
+        pc = (addr);                                                           \
+        FETCH();                                                               \
+        DISPATCH();                                                            \
+    } while (0)
+#else
+#define CASE(op) case op
+#define DISPATCH() goto dispatch
+#define CONTINUE_AT(addr)                                                      \
+    do {                                                                       \
+        pc = (addr);                                                           \
+        goto next;                                                             \
+    } while (0)
+#endif
+/**
+ * Fetches the instruction at `pc` into `inst`, leaving the loop if we are out
+ * of cycles or the program counter is invalid.
+ *
+ * If the recompiler is enabled, this goes through `jit_fetch` instead, which
+ * may run a compiled block before fetching.
+ */
+#define FETCH()                                                                \
+    do {                                                                       \
+        if (cycles == 0)                                                       \
+            goto out_of_cycles;                                                \
+        if (pc >= CHIP8_MEM_SIZE || pc % 2 != 0)                               \
+            goto bad_pc;                                                       \
+        if (jit)                                                               \
+            goto jit_fetch;                                                    \
+        DECODE();                                                              \
+    } while (0)
+/**
+ * Decodes the instruction at `pc` into `inst`, counting it as executed.
+ *
+ * Breakpoints are only checked on a decode cache miss, which is fine since
+ * slots with a breakpoint are never marked as decoded.  The instruction we
+ * started at is exempt (once), so that we can resume from a breakpoint.
+ */
+#define DECODE()                                                               \
+    do {                                                                       \
+        if (!chip->decoded[pc / 2]) {                                          \
+            if (stop_breakpoint && chip->breakpoints[pc / 2]) {                \
+                if (pc != resume_pc)                                           \
+                    goto breakpoint;                                           \
+                resume_pc = -1;                                                \
+            }                                                                  \
+            chip8_decode_slot(chip, pc / 2);                                   \
+        }                                                                      \
+        if (wall_clock && chip8_timer_update(chip) && stop_frame)              \
+            goto wall_frame;                                                   \
+        cycles--;                                                              \
+        inst = &chip->decode_cache[pc / 2];                                    \
+    } while (0)
+/**
+ * Starts a new slice of execution.
+ *
+ * The cycles we've been asked to run are divided into slices, none of which
+ * cross a tick of the virtual clock, so that the only thing we need to keep
+ * track of while running is the number of cycles left in the slice.
+ */
+#define START_SLICE()                                                          \
+    do {                                                                       \
+        slice = budget;                                                        \
+        if (virtual_clock && slice > cycles_per_frame - chip->tick_cycles)     \
+            slice = cycles_per_frame - chip->tick_cycles;                      \
+        budget -= slice;                                                       \
+        cycles = slice;                                                        \
+    } while (0)
+/**
+ * Ends the current slice, accounting for the cycles executed in it.
+ */
+#define END_SLICE()                                                            \
+    do {                                                                       \
+        chip->cycles += slice - cycles;                                        \
+        if (virtual_clock)                                                     \
+            chip->tick_cycles += slice - cycles;                               \
+        budget += cycles;                                                      \
+        slice = cycles = 0;                                                    \
+    } while (0)
+/**
+ * Waits until the next tick (for instructions which are delayed when
+ * `delay_draws` is set).
+ *
+ * With a virtual clock, this just ends the current tick early.
+ */
+#define WAIT_CYCLE()                                                           \
+    do {                                                                       \
+        if (!chip->opts.delay_draws)                                           \
+            break;                                                             \
+        if (virtual_clock) {                                                   \
+            END_SLICE();                                                       \
+            chip8_timer_tick(chip);                                            \
+            if (stop_frame)                                                    \
+                stopped |= CHIP8_STOP_FRAME;                                   \
+            else                                                               \
+                START_SLICE();                                                 \
+        } else {                                                               \
+            chip8_wait_cycle(chip);                                            \
+        }                                                                      \
+    } while (0)
+/**
+ * Skips ahead through an idle loop with the given number of instructions per
+ * iteration (or does nothing if it is 0), since nothing it depends on can
+ * change before the next tick.
+ *
+ * With a wall clock, this sleeps until the tick instead of spinning.
+ * Otherwise, as many whole iterations as fit in the current slice are counted
+ * as executed without running them, which (since slices end at ticks) leaves
+ * the interpreter in exactly the state it would have reached anyway.  The
+ * loop isn't even checked if skipping is disabled.
+ */
+#define IDLE(len)                                                              \
+    do {                                                                       \
+        unsigned long idle_len;                                                \
+        if (!skip_idle || (idle_len = (len)) == 0)                             \
+            break;                                                             \
+        if (wall_clock)                                                        \
+            chip8_wait_tick(chip);                                             \
+        else                                                                   \
+            cycles -= cycles / idle_len * idle_len;                            \
+    } while (0)
+/**
+ * Notes that the display was modified, so that we stop after the current
+ * instruction if requested.
+ */
+#define DREW()                                                                 \
+    do {                                                                       \
+        if (stop_draw) {                                                       \
+            stopped |= CHIP8_STOP_DRAW;                                        \
+            END_SLICE();                                                       \
+        }                                                                      \
+    } while (0)
+/**
+ * Continues execution at the next instruction.
+ */
+#define NEXT() CONTINUE_AT(pc + 2)
+/**
+ * Skips the next instruction if the given condition is true.
+ */
+#define SKIP_IF(cond) CONTINUE_AT((cond) ? pc + 4 : pc + 2)
+/**
+ * Stops execution with an error, after logging the given message.
+ */
+#define FAIL(...)                                                              \
+    do {                                                                       \
+        log_error(__VA_ARGS__);                                                \
+        goto error;                                                            \
+    } while (0)
+
+static unsigned chip8_run_loop(
+    struct chip8 *chip, unsigned long max_cycles, unsigned stop_mask)
+{
+#ifdef CHIP8_THREADED_DISPATCH
+#define DISPATCH_ENTRY(op) [(op) - OP_INVALID] = &&L_##op
+    static const void *const dispatch_table[] = {
+        DISPATCH_ENTRY(OP_INVALID),
+        DISPATCH_ENTRY(OP_SCD),
+        DISPATCH_ENTRY(OP_CLS),
+        DISPATCH_ENTRY(OP_RET),
+        DISPATCH_ENTRY(OP_SCR),
+        DISPATCH_ENTRY(OP_SCL),
+        DISPATCH_ENTRY(OP_EXIT),
+        DISPATCH_ENTRY(OP_LOW),
+        DISPATCH_ENTRY(OP_HIGH),
+        DISPATCH_ENTRY(OP_JP),
+        DISPATCH_ENTRY(OP_CALL),
+        DISPATCH_ENTRY(OP_SE_BYTE),
+        DISPATCH_ENTRY(OP_SNE_BYTE),
+        DISPATCH_ENTRY(OP_SE_REG),
+        DISPATCH_ENTRY(OP_LD_BYTE),
+        DISPATCH_ENTRY(OP_ADD_BYTE),
+        DISPATCH_ENTRY(OP_LD_REG),
+        DISPATCH_ENTRY(OP_OR),
+        DISPATCH_ENTRY(OP_AND),
+        DISPATCH_ENTRY(OP_XOR),
+        DISPATCH_ENTRY(OP_ADD_REG),
+        DISPATCH_ENTRY(OP_SUB),
+        DISPATCH_ENTRY(OP_SHR),
+        DISPATCH_ENTRY(OP_SHR_QUIRK),
+        DISPATCH_ENTRY(OP_SUBN),
+        DISPATCH_ENTRY(OP_SHL),
+        DISPATCH_ENTRY(OP_SHL_QUIRK),
+        DISPATCH_ENTRY(OP_SNE_REG),
+        DISPATCH_ENTRY(OP_LD_I),
+        DISPATCH_ENTRY(OP_JP_V0),
+        DISPATCH_ENTRY(OP_RND),
+        DISPATCH_ENTRY(OP_DRW),
+        DISPATCH_ENTRY(OP_SKP),
+        DISPATCH_ENTRY(OP_SKNP),
+        DISPATCH_ENTRY(OP_LD_REG_DT),
+        DISPATCH_ENTRY(OP_LD_KEY),
+        DISPATCH_ENTRY(OP_LD_DT_REG),
+        DISPATCH_ENTRY(OP_LD_ST),
+        DISPATCH_ENTRY(OP_ADD_I),
+        DISPATCH_ENTRY(OP_LD_F),
+        DISPATCH_ENTRY(OP_LD_HF),
+        DISPATCH_ENTRY(OP_LD_B),
+        DISPATCH_ENTRY(OP_LD_DEREF_I_REG),
+        DISPATCH_ENTRY(OP_LD_REG_DEREF_I),
+        DISPATCH_ENTRY(OP_LD_R_REG),
+        DISPATCH_ENTRY(OP_LD_REG_R),
+    };
+#undef DISPATCH_ENTRY
+#endif
+    /*
+     * The program counter and I register are kept in locals while we're
+     * running, and are only written back to the interpreter state when we
+     * stop or call out to something that needs them.
+     */
+    uint16_t pc = chip->pc;
+    uint16_t i = chip->reg_i;
+    uint8_t *const v = chip->regs;
+    const bool wall_clock = chip->opts.enable_timer && !chip->opts.virtual_clock;
+    const bool virtual_clock = chip->opts.enable_timer && chip->opts.virtual_clock;
+    const bool skip_idle = chip->opts.skip_idle;
+    const unsigned long cycles_per_frame = chip->opts.cycles_per_frame;
+    /*
+     * The number of cycles left in the current slice, the total number of
+     * cycles in the current slice, and the number of cycles left to run after
+     * it (see START_SLICE).
+     */
+    unsigned long cycles = 0, slice = 0, budget = max_cycles;
+    struct chip8_jit *const jit = chip->jit;
+    const struct chip8_jit_block *block;
+    const struct chip8_decoded *inst;
+    const bool stop_frame = stop_mask & CHIP8_STOP_FRAME;
+    const bool stop_key_wait = stop_mask & CHIP8_STOP_KEY_WAIT;
+    const bool stop_draw = stop_mask & CHIP8_STOP_DRAW;
+    const bool stop_breakpoint = stop_mask & CHIP8_STOP_BREAKPOINT;
+    /*
+     * The reasons we've found to stop.  Conditions which are noticed in the
+     * middle of an instruction are recorded here and the current slice is
+     * ended, so that we stop (in out_of_cycles) once the instruction is done.
+     */
+    unsigned stopped = 0;
+    /* The address whose breakpoint is ignored (see DECODE) */
+    long resume_pc = pc;
+
+    if (chip->halted)
+        return CHIP8_STOP_HALT;
+    if (virtual_clock && chip->tick_cycles >= cycles_per_frame)
+        chip8_timer_tick(chip);
+    START_SLICE();
+
+#ifdef CHIP8_THREADED_DISPATCH
+    CONTINUE_AT(pc);
+#else
+next:
+    FETCH();
+dispatch:
+    switch (inst->op) {
+#endif
+    CASE(OP_INVALID):
+        log_warning("Invalid instruction encountered and ignored (opcode 0x%X)", (unsigned)inst->arg);
+        NEXT();
+    CASE(OP_SCD):
+        WAIT_CYCLE();
+        memmove(chip->display[inst->arg], chip->display[0],
+            (CHIP8_DISPLAY_HEIGHT - inst->arg) * sizeof chip->display[0]);
+        memset(chip->display, 0, inst->arg * sizeof chip->display[0]);
+        chip->dirty_rows = UINT64_MAX;
+        DREW();
+        NEXT();
+    CASE(OP_CLS):
         memset(chip->display, 0, sizeof chip->display);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_RET:
-        if (chip->call_stack) {
-            struct chip8_call_node *node = chip->call_stack;
+        chip->dirty_rows = UINT64_MAX;
+        DREW();
+        NEXT();
+    CASE(OP_RET):
+        if (chip->stack_size > 0) {
             /* Be sure to increment PAST the caller address! */
-            uint16_t retval = node->call_addr + 2;
-            chip->call_stack = node->next;
-            free(node);
-            new_pc = retval;
+            CONTINUE_AT(chip->call_stack[--chip->stack_size] + 2);
         } else {
-            log_error("Tried to return from subroutine, but there is nothing to return to");
-            chip8_log_regs(chip);
-            return 1;
+            FAIL("Tried to return from subroutine, but there is nothing to return to");
         }
-        break;
-    case OP_SCR:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        for (int x = CHIP8_DISPLAY_WIDTH - 1; x >= 4; x--)
-            memcpy(&chip->display[x], &chip->display[x - 4], sizeof(chip->display[x]));
-        for (int x = 0; x < 4; x++)
-            memset(chip->display[x], 0, sizeof chip->display[x]);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_SCL:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        for (int x = 0; x < CHIP8_DISPLAY_WIDTH - 4; x++)
-            memcpy(&chip->display[x], &chip->display[x + 4], sizeof(chip->display[x]));
-        for (int x = CHIP8_DISPLAY_WIDTH - 4; x < CHIP8_DISPLAY_WIDTH; x++)
-            memset(chip->display[x], 0, sizeof chip->display[x]);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_EXIT:
+    CASE(OP_SCR):
+        WAIT_CYCLE();
+        /* Remember that the leftmost pixel is the most significant bit */
+        for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+            uint64_t *row = chip->display[y];
+            for (int w = CHIP8_DISPLAY_WORDS - 1; w > 0; w--)
+                row[w] = (row[w] >> 4) | (row[w - 1] << 60);
+            row[0] >>= 4;
+        }
+        chip->dirty_rows = UINT64_MAX;
+        DREW();
+        NEXT();
+    CASE(OP_SCL):
+        WAIT_CYCLE();
+        for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+            uint64_t *row = chip->display[y];
+            for (int w = 0; w < CHIP8_DISPLAY_WORDS - 1; w++)
+                row[w] = (row[w] << 4) | (row[w + 1] >> 60);
+            row[CHIP8_DISPLAY_WORDS - 1] <<= 4;
+        }
+        chip->dirty_rows = UINT64_MAX;
+        DREW();
+        NEXT();
+    CASE(OP_EXIT):
         chip->halted = true;
-        break;
-    case OP_LOW:
+        pc += 2;
+        stopped |= CHIP8_STOP_HALT;
+        goto done;
+    CASE(OP_LOW):
         chip->highres = false;
-        chip->needs_full_redraw = true;
-        break;
-    case OP_HIGH:
+        chip->dirty_rows = UINT64_MAX;
+        DREW();
+        NEXT();
+    CASE(OP_HIGH):
         chip->highres = true;
-        chip->needs_full_redraw = true;
-        break;
-    case OP_JP:
-        if (inst.addr % 2 == 0) {
-            new_pc = inst.addr;
-        } else {
-            log_error("Attempted to jump to misaligned memory address 0x%03X", inst.addr);
-            chip8_log_regs(chip);
-            return 1;
-        }
-        break;
-    case OP_CALL:
-        if (inst.addr % 2 == 0) {
-            struct chip8_call_node *node = xmalloc(sizeof(*node));
-            node->call_addr = chip->pc;
-            node->next = chip->call_stack;
-            chip->call_stack = node;
-            new_pc = inst.addr;
-        } else {
-            log_error("Attempted to call subroutine at misaligned memory address 0x%hX", inst.addr);
-            chip8_log_regs(chip);
-            return 1;
-        }
-        break;
-    case OP_SE_BYTE:
-        if (chip->regs[inst.vx] == inst.byte)
-            new_pc = chip->pc + 4;
-        break;
-    case OP_SNE_BYTE:
-        if (chip->regs[inst.vx] != inst.byte)
-            new_pc = chip->pc + 4;
-        break;
-    case OP_SE_REG:
-        if (chip->regs[inst.vx] == chip->regs[inst.vy])
-            new_pc = chip->pc + 4;
-        break;
-    case OP_LD_BYTE:
-        chip->regs[inst.vx] = inst.byte;
-        break;
-    case OP_ADD_BYTE: {
+        chip->dirty_rows = UINT64_MAX;
+        DREW();
+        NEXT();
+    CASE(OP_JP):
+        if (inst->arg % 2 != 0)
+            FAIL("Attempted to jump to misaligned memory address 0x%03X", (unsigned)inst->arg);
+        /* Games often wait for the delay timer or a key in a short loop */
+        if (inst->arg <= pc && pc - inst->arg < 2 * CHIP8_IDLE_LOOP_MAX)
+            IDLE(chip8_idle_loop(chip, inst->arg, pc));
+        CONTINUE_AT(inst->arg);
+    CASE(OP_CALL):
+        if (inst->arg % 2 != 0)
+            FAIL("Attempted to call subroutine at misaligned memory address 0x%X", (unsigned)inst->arg);
+        if (chip->stack_size >= chip->opts.stack_depth)
+            FAIL("Call stack overflow (more than %u nested calls)", chip->opts.stack_depth);
+        chip->call_stack[chip->stack_size++] = pc;
+        CONTINUE_AT(inst->arg);
+    CASE(OP_SE_BYTE):
+        SKIP_IF(v[inst->vx] == inst->arg);
+    CASE(OP_SNE_BYTE):
+        SKIP_IF(v[inst->vx] != inst->arg);
+    CASE(OP_SE_REG):
+        SKIP_IF(v[inst->vx] == v[inst->vy]);
+    CASE(OP_LD_BYTE):
+        v[inst->vx] = inst->arg;
+        NEXT();
+    CASE(OP_ADD_BYTE): {
         /* Check for carry */
-        uint8_t carry = inst.byte > 255 - chip->regs[inst.vx];
-        chip->regs[inst.vx] += inst.byte;
-        chip->regs[REG_VF] = carry;
-    } break;
-    case OP_LD_REG:
-        chip->regs[inst.vx] = chip->regs[inst.vy];
-        break;
-    case OP_OR:
-        chip->regs[inst.vx] |= chip->regs[inst.vy];
-        break;
-    case OP_AND:
-        chip->regs[inst.vx] &= chip->regs[inst.vy];
-        break;
-    case OP_XOR:
-        chip->regs[inst.vx] ^= chip->regs[inst.vy];
-        break;
-    case OP_ADD_REG: {
+        uint8_t carry = inst->arg > 255 - v[inst->vx];
+        v[inst->vx] += inst->arg;
+        v[REG_VF] = carry;
+        NEXT();
+    }
+    CASE(OP_LD_REG):
+        v[inst->vx] = v[inst->vy];
+        NEXT();
+    CASE(OP_OR):
+        v[inst->vx] |= v[inst->vy];
+        NEXT();
+    CASE(OP_AND):
+        v[inst->vx] &= v[inst->vy];
+        NEXT();
+    CASE(OP_XOR):
+        v[inst->vx] ^= v[inst->vy];
+        NEXT();
+    CASE(OP_ADD_REG): {
         /* Check for carry */
-        uint8_t carry = chip->regs[inst.vy] > 255 - chip->regs[inst.vx];
-        chip->regs[inst.vx] += chip->regs[inst.vy];
-        chip->regs[REG_VF] = carry;
-    } break;
-    case OP_SUB: {
+        uint8_t carry = v[inst->vy] > 255 - v[inst->vx];
+        v[inst->vx] += v[inst->vy];
+        v[REG_VF] = carry;
+        NEXT();
+    }
+    CASE(OP_SUB): {
         /* Check for borrow */
-        uint8_t borrow = chip->regs[inst.vy] <= chip->regs[inst.vx];
-        chip->regs[inst.vx] -= chip->regs[inst.vy];
-        chip->regs[REG_VF] = borrow;
-    } break;
-    case OP_SHR: {
-        uint8_t low = chip->regs[inst.vx] & 0x1;
-        chip->regs[inst.vx] >>= 1;
-        chip->regs[REG_VF] = low;
-    } break;
-    case OP_SHR_QUIRK: {
-        uint8_t low = chip->regs[inst.vy] & 0x1;
-        chip->regs[inst.vx] = chip->regs[inst.vy] >> 1;
-        chip->regs[REG_VF] = low;
-    } break;
-    case OP_SUBN: {
+        uint8_t borrow = v[inst->vy] <= v[inst->vx];
+        v[inst->vx] -= v[inst->vy];
+        v[REG_VF] = borrow;
+        NEXT();
+    }
+    CASE(OP_SHR): {
+        uint8_t low = v[inst->vx] & 0x1;
+        v[inst->vx] >>= 1;
+        v[REG_VF] = low;
+        NEXT();
+    }
+    CASE(OP_SHR_QUIRK): {
+        uint8_t low = v[inst->vy] & 0x1;
+        v[inst->vx] = v[inst->vy] >> 1;
+        v[REG_VF] = low;
+        NEXT();
+    }
+    CASE(OP_SUBN): {
         /* Check for borrow */
-        uint8_t borrow = chip->regs[inst.vx] <= chip->regs[inst.vy];
-        chip->regs[inst.vx] = chip->regs[inst.vy] - chip->regs[inst.vx];
-        chip->regs[REG_VF] = borrow;
-    } break;
-    case OP_SHL: {
-        uint8_t high = (chip->regs[inst.vx] & 0x80) >> 7;
-        chip->regs[inst.vx] <<= 1;
-        chip->regs[REG_VF] = high;
-    } break;
-    case OP_SHL_QUIRK: {
-        uint8_t high = (chip->regs[inst.vy] & 0x80) >> 7;
-        chip->regs[inst.vx] = chip->regs[inst.vy] << 1;
-        chip->regs[REG_VF] = high;
-    } break;
-    case OP_SNE_REG:
-        if (chip->regs[inst.vx] != chip->regs[inst.vy])
-            new_pc = chip->pc + 4;
-        break;
-    case OP_LD_I:
-        chip->reg_i = inst.addr;
-        break;
-    case OP_JP_V0: {
-        uint32_t jpto = (uint32_t)inst.addr + chip->regs[REG_V0];
-        if (jpto % 2 == 0) {
-            if (jpto < CHIP8_MEM_SIZE) {
-                new_pc = jpto;
-            } else {
-                log_error("Attempted to jump to out of bounds memory "
-                          "address 0x%X",
-                    jpto);
-                chip8_log_regs(chip);
-                return 1;
-            }
-        } else {
-            log_error("Attempted to jump to misaligned memory address "
-                      "0x%X",
-                jpto);
-            chip8_log_regs(chip);
-            return 1;
-        }
-    } break;
-    case OP_RND:
-        chip->regs[inst.vx] = rand_byte() & inst.byte;
-        break;
-    case OP_DRW:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        if (inst.nibble == 0)
-            chip->regs[REG_VF] = chip8_draw_sprite_high(chip, chip->regs[inst.vx], chip->regs[inst.vy], chip->reg_i);
+        uint8_t borrow = v[inst->vx] <= v[inst->vy];
+        v[inst->vx] = v[inst->vy] - v[inst->vx];
+        v[REG_VF] = borrow;
+        NEXT();
+    }
+    CASE(OP_SHL): {
+        uint8_t high = (v[inst->vx] & 0x80) >> 7;
+        v[inst->vx] <<= 1;
+        v[REG_VF] = high;
+        NEXT();
+    }
+    CASE(OP_SHL_QUIRK): {
+        uint8_t high = (v[inst->vy] & 0x80) >> 7;
+        v[inst->vx] = v[inst->vy] << 1;
+        v[REG_VF] = high;
+        NEXT();
+    }
+    CASE(OP_SNE_REG):
+        SKIP_IF(v[inst->vx] != v[inst->vy]);
+    CASE(OP_LD_I):
+        i = inst->arg;
+        NEXT();
+    CASE(OP_JP_V0): {
+        uint32_t jpto = (uint32_t)inst->arg + v[REG_V0];
+        if (jpto % 2 != 0)
+            FAIL("Attempted to jump to misaligned memory address 0x%X", jpto);
+        if (jpto >= CHIP8_MEM_SIZE)
+            FAIL("Attempted to jump to out of bounds memory address 0x%X", jpto);
+        CONTINUE_AT(jpto);
+    }
+    CASE(OP_RND):
+        v[inst->vx] = rand_byte(chip) & inst->arg;
+        NEXT();
+    CASE(OP_DRW):
+        WAIT_CYCLE();
+        if (inst->arg == 0)
+            v[REG_VF] = chip8_draw_sprite_high(chip, v[inst->vx], v[inst->vy], i);
         else
-            chip->regs[REG_VF] = chip8_draw_sprite(chip, chip->regs[inst.vx], chip->regs[inst.vy], chip->reg_i, inst.nibble);
-        break;
-    case OP_SKP:
-        if (chip->key_states & (1 << (chip->regs[inst.vx] & 0xF)))
-            new_pc = chip->pc + 4;
-        break;
-    case OP_SKNP:
-        if (!(chip->key_states & (1 << (chip->regs[inst.vx] & 0xF))))
-            new_pc = chip->pc + 4;
-        break;
-    case OP_LD_REG_DT:
-        chip->regs[inst.vx] = chip->reg_dt;
-        break;
-    case OP_LD_KEY: {
+            v[REG_VF] = chip8_draw_sprite(chip, v[inst->vx], v[inst->vy], i, inst->arg);
+        chip->draws++;
+        DREW();
+        NEXT();
+    CASE(OP_SKP):
+        SKIP_IF(chip->key_states & (1 << (v[inst->vx] & 0xF)));
+    CASE(OP_SKNP):
+        SKIP_IF(!(chip->key_states & (1 << (v[inst->vx] & 0xF))));
+    CASE(OP_LD_REG_DT):
+        v[inst->vx] = chip->reg_dt;
+        NEXT();
+    CASE(OP_LD_KEY): {
         int key;
         /*
-         * Wait for key press; if none is pressed right now, we just wait until
-         * the next step to check for one
+         * Wait for key press; if none is pressed right now, we either stop
+         * here and check again the next time we're asked to run, or keep
+         * waiting on this instruction (which is an idle loop of its own).
          */
         if (chip->key_states == 0) {
-            new_pc = chip->pc;
-            break;
+            if (stop_key_wait) {
+                stopped |= CHIP8_STOP_KEY_WAIT;
+                goto done;
+            }
+            IDLE(chip->breakpoints[pc / 2] ? 0 : 1);
+            CONTINUE_AT(pc);
         }
         key = ffs(chip->key_states) - 1;
-        chip->regs[inst.vx] = key;
+        v[inst->vx] = key;
         /* Now we need to clear it so that we don't read it twice */
         chip->key_states &= ~(1 << key);
-    } break;
-    case OP_LD_DT_REG:
-        chip->reg_dt = chip->regs[inst.vx];
-        break;
-    case OP_LD_ST:
-        chip->reg_st = chip->regs[inst.vx];
-        break;
-    case OP_ADD_I:
-        chip->reg_i += chip->regs[inst.vx];
-        break;
-    case OP_LD_F:
-        chip->reg_i = CHIP8_HEX_LOW_ADDR +
-            CHIP8_HEX_LOW_HEIGHT * (chip->regs[inst.vx] & 0xF);
-        break;
-    case OP_LD_HF:
-        chip->reg_i = CHIP8_HEX_HIGH_ADDR +
-            CHIP8_HEX_HIGH_HEIGHT * (chip->regs[inst.vx] & 0xF);
-        break;
-    case OP_LD_B:
+        NEXT();
+    }
+    CASE(OP_LD_DT_REG):
+        chip->reg_dt = v[inst->vx];
+        NEXT();
+    CASE(OP_LD_ST):
+        chip->reg_st = v[inst->vx];
+        NEXT();
+    CASE(OP_ADD_I):
+        i += v[inst->vx];
+        NEXT();
+    CASE(OP_LD_F):
+        i = CHIP8_HEX_LOW_ADDR + CHIP8_HEX_LOW_HEIGHT * (v[inst->vx] & 0xF);
+        NEXT();
+    CASE(OP_LD_HF):
+        i = CHIP8_HEX_HIGH_ADDR + CHIP8_HEX_HIGH_HEIGHT * (v[inst->vx] & 0xF);
+        NEXT();
+    CASE(OP_LD_B):
         /* Note that register Vx is only a byte, so it's 3 digits or fewer */
-        chip->mem[chip->reg_i] = chip->regs[inst.vx] / 100;
-        chip->mem[chip->reg_i + 1] = (chip->regs[inst.vx] / 10) % 10;
-        chip->mem[chip->reg_i + 2] = chip->regs[inst.vx] % 10;
-        break;
-    case OP_LD_DEREF_I_REG: {
-        size_t cpy_len = sizeof(chip->regs[0]) * (inst.vx + 1);
-
-        if (chip->reg_i + cpy_len - 1 >= CHIP8_MEM_SIZE) {
-            log_error("Tried to write to out of bounds memory");
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->mem + chip->reg_i, chip->regs, cpy_len);
+        chip->mem[i] = v[inst->vx] / 100;
+        chip->mem[i + 1] = (v[inst->vx] / 10) % 10;
+        chip->mem[i + 2] = v[inst->vx] % 10;
+        chip8_invalidate_code(chip, i, 3);
+        NEXT();
+    CASE(OP_LD_DEREF_I_REG): {
+        size_t cpy_len = sizeof(v[0]) * (inst->vx + 1);
+
+        if (i + cpy_len - 1 >= CHIP8_MEM_SIZE)
+            FAIL("Tried to write to out of bounds memory");
+        memcpy(chip->mem + i, v, cpy_len);
+        chip8_invalidate_code(chip, i, cpy_len);
         if (chip->opts.load_quirks)
-            chip->reg_i += cpy_len;
-    } break;
-    case OP_LD_REG_DEREF_I: {
-        size_t cpy_len = sizeof(chip->regs[0]) * (inst.vx + 1);
-
-        if (chip->reg_i + cpy_len - 1 >= CHIP8_MEM_SIZE) {
-            log_error("Tried to read from out of bounds memory");
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->regs, chip->mem + chip->reg_i, cpy_len);
+            i += cpy_len;
+        NEXT();
+    }
+    CASE(OP_LD_REG_DEREF_I): {
+        size_t cpy_len = sizeof(v[0]) * (inst->vx + 1);
+
+        if (i + cpy_len - 1 >= CHIP8_MEM_SIZE)
+            FAIL("Tried to read from out of bounds memory");
+        memcpy(v, chip->mem + i, cpy_len);
         if (chip->opts.load_quirks)
-            chip->reg_i += cpy_len;
-    } break;
-    case OP_LD_R_REG:
-        if (inst.vx > 7) {
-            log_error(
-                "Instruction LD R, V%X would store too much data (%X > 7)",
-                inst.vx, inst.vx);
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->rpl, chip->regs, inst.vx + 1);
-        break;
-    case OP_LD_REG_R:
-        if (inst.vx > 7) {
-            log_error(
-                "Instruction LD V%X, R would load too much data (%X > 7)");
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->regs, chip->rpl, inst.vx + 1);
-        break;
+            i += cpy_len;
+        NEXT();
+    }
+    CASE(OP_LD_R_REG):
+        if (inst->vx > 7)
+            FAIL("Instruction LD R, V%X would store too much data (%X > 7)", inst->vx, inst->vx);
+        memcpy(chip->rpl, v, inst->vx + 1);
+        NEXT();
+    CASE(OP_LD_REG_R):
+        if (inst->vx > 7)
+            FAIL("Instruction LD V%X, R would load too much data (%X > 7)", inst->vx, inst->vx);
+        memcpy(v, chip->rpl, inst->vx + 1);
+        NEXT();
+#ifndef CHIP8_THREADED_DISPATCH
     }
+#endif
 
-    if (pc)
-        *pc = new_pc;
-    return 0;
+jit_fetch:
+    /*
+     * If there's a compiled block starting here which fits in the cycles we
+     * have left, we can run it and then continue by interpreting the
+     * instruction which ended it.
+     */
+    if ((block = chip8_jit_block(jit, chip, pc)) != NULL && block->len <= cycles) {
+        if (wall_clock && chip8_timer_update(chip) && stop_frame)
+            goto wall_frame;
+        chip->reg_i = i;
+        block->code(chip);
+        i = chip->reg_i;
+        cycles -= block->len;
+        pc += 2 * block->len;
+        if (cycles == 0)
+            goto out_of_cycles;
+        if (pc >= CHIP8_MEM_SIZE)
+            goto bad_pc;
+    }
+    DECODE();
+    DISPATCH();
+
+out_of_cycles:
+    END_SLICE();
+    if (virtual_clock && chip->tick_cycles >= cycles_per_frame) {
+        chip8_timer_tick(chip);
+        if (stop_frame)
+            stopped |= CHIP8_STOP_FRAME;
+    }
+    if (budget == 0 && !stopped)
+        stopped = CHIP8_STOP_CYCLES;
+    if (stopped)
+        goto done;
+    START_SLICE();
+    CONTINUE_AT(pc);
+
+wall_frame:
+    /* The timer ticked just before we could execute the instruction at pc */
+    stopped |= CHIP8_STOP_FRAME;
+    goto done;
+breakpoint:
+    log_debug("Stopped at breakpoint (PC %03X)", pc);
+    stopped |= CHIP8_STOP_BREAKPOINT;
+    goto done;
+
+bad_pc:
+    log_error("Program counter went out of bounds (0x%X)", pc);
+    chip->halted = true;
+error:
+    END_SLICE();
+    chip->pc = pc;
+    chip->reg_i = i;
+    chip8_log_regs(chip);
+    return stopped | CHIP8_STOP_ERROR;
+done:
+    END_SLICE();
+    chip->pc = pc;
+    chip->reg_i = i;
+    return stopped;
 }
 
-static void chip8_timer_update(struct chip8 *chip)
+#undef CASE
+#undef DISPATCH
+#undef CONTINUE_AT
+#undef FETCH
+#undef DECODE
+#undef START_SLICE
+#undef END_SLICE
+#undef WAIT_CYCLE
+#undef IDLE
+#undef DREW
+#undef NEXT
+#undef SKIP_IF
+#undef FAIL
+#ifdef CHIP8_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+static bool chip8_timer_update(struct chip8 *chip)
 {
     unsigned long old_ticks = chip->timer_ticks;
     unsigned long elapsed;
@@ -646,6 +1511,8 @@ static void chip8_timer_update(struct chip8 *chip)
         chip->reg_st -= elapsed;
     else
         chip->reg_st = 0;
+
+    return elapsed != 0;
 }
 
 static void chip8_timer_update_ticks(struct chip8 *chip)
@@ -653,7 +1520,18 @@ static void chip8_timer_update_ticks(struct chip8 *chip)
     struct timespec ts;
 
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    chip->timer_ticks = (ts.tv_sec + (double)ts.tv_nsec / NANOS_IN_SECOND) * chip->opts.timer_freq;
+    chip->timer_ticks = (unsigned long)ts.tv_sec * chip->opts.timer_freq +
+        (unsigned long)ts.tv_nsec * chip->opts.timer_freq / NANOS_IN_SECOND;
+}
+
+static void chip8_timer_tick(struct chip8 *chip)
+{
+    chip->timer_ticks++;
+    chip->tick_cycles = 0;
+    if (chip->reg_dt > 0)
+        chip->reg_dt--;
+    if (chip->reg_st > 0)
+        chip->reg_st--;
 }
 
 static void chip8_wait_cycle(struct chip8 *chip)
@@ -674,7 +1552,81 @@ static void chip8_wait_cycle(struct chip8 *chip)
     }
 }
 
-static uint8_t rand_byte(void)
+static void chip8_wait_tick(const struct chip8 *chip)
+{
+    uint64_t freq = chip->opts.timer_freq;
+    uint64_t next;
+    struct timespec ts;
+
+    /* Ticks are counted exactly as in chip8_timer_update_ticks */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    next = (uint64_t)ts.tv_sec * freq +
+        (uint64_t)ts.tv_nsec * freq / NANOS_IN_SECOND + 1;
+    ts.tv_sec = next / freq;
+    /* Rounding up, so that we don't wake up just before the tick */
+    ts.tv_nsec = ((next % freq) * NANOS_IN_SECOND + freq - 1) / freq;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void chip8_init(struct chip8 *chip, struct chip8_options opts,
+    const struct chip8_image *image)
+{
+    chip->opts = opts;
+    if (chip->opts.cycles_per_frame == 0)
+        chip->opts.cycles_per_frame = 1;
+    if (chip->opts.stack_depth > CHIP8_STACK_MAX) {
+        log_warning("Call stack depth %u is too large; using %u",
+            chip->opts.stack_depth, CHIP8_STACK_MAX);
+        chip->opts.stack_depth = CHIP8_STACK_MAX;
+    }
+    /* A recompiler being reused is invalidated by chip8_reset below */
+    if (!opts.jit) {
+        chip8_jit_destroy(chip->jit);
+        chip->jit = NULL;
+    } else if (!chip->jit && !(chip->jit = chip8_jit_new())) {
+        log_warning("JIT compilation is not available; using the interpreter only");
+    }
+    if (!opts.profile) {
+        free(chip->profile);
+        chip->profile = NULL;
+    } else if (chip->profile) {
+        memset(chip->profile, 0, sizeof *chip->profile);
+    } else {
+        chip->profile = xcalloc(1, sizeof *chip->profile);
+    }
+    chip->trace = NULL;
+    memset(chip->breakpoints, 0, sizeof chip->breakpoints);
+
+    chip8_reset(chip, image);
+}
+
+static void chip8_fini(struct chip8 *chip)
+{
+    chip8_jit_destroy(chip->jit);
+    free(chip->profile);
+}
+
+static void rand_seed(struct chip8 *chip, uint64_t seed)
+{
+    chip->rand_state = 0;
+    rand_next(chip);
+    chip->rand_state += seed;
+    rand_next(chip);
+}
+
+static uint32_t rand_next(struct chip8 *chip)
+{
+    uint64_t old = chip->rand_state;
+    uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    unsigned rot = old >> 59;
+
+    chip->rand_state = old * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+static uint8_t rand_byte(struct chip8 *chip)
 {
-    return (uint8_t)(255.0 * ((double)rand() / RAND_MAX));
+    /* The high bits are the best ones */
+    return rand_next(chip) >> 24;
 }
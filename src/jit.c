@@ -0,0 +1,472 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/* MAP_ANONYMOUS is not part of the X/Open definitions on all systems */
+#define _DEFAULT_SOURCE
+#include "jit.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "interpreter.h"
+#include "log.h"
+#include "memory.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT_X86_64
+#endif
+
+/**
+ * The size of the memory area used to store generated code.
+ *
+ * When this fills up, all compiled blocks are discarded and we start over.
+ */
+#define JIT_ARENA_SIZE (256 * 1024)
+/**
+ * The maximum number of instructions in a single block.
+ */
+#define JIT_MAX_BLOCK_LEN 64
+/**
+ * The maximum length of the native code for a single instruction.
+ */
+#define JIT_MAX_INSTR_CODE 32
+/**
+ * The minimum number of instructions which make a block worth compiling.
+ *
+ * Calling into a block has some overhead, so it's not worth it to compile a
+ * single instruction.
+ */
+#define JIT_MIN_BLOCK_LEN 2
+
+/**
+ * The compilation state of an instruction slot.
+ */
+enum jit_slot_state {
+    /**
+     * We haven't tried to compile a block starting here yet.
+     */
+    SLOT_UNKNOWN = 0,
+    /**
+     * There is a compiled block starting here.
+     */
+    SLOT_COMPILED,
+    /**
+     * No block can be compiled starting here.
+     */
+    SLOT_UNCOMPILABLE,
+};
+
+struct chip8_jit {
+    /**
+     * The memory containing the generated code.
+     *
+     * This is mapped read-only and executable, except while code is being
+     * copied into it.
+     */
+    uint8_t *arena;
+    /**
+     * The number of bytes of the arena which have been used.
+     */
+    size_t used;
+    /**
+     * The compiled blocks, indexed by instruction slot.
+     */
+    struct chip8_jit_block blocks[CHIP8_INSTR_SLOTS];
+    /**
+     * The compilation state of each slot (see `enum jit_slot_state`).
+     */
+    uint8_t state[CHIP8_INSTR_SLOTS];
+    /**
+     * Whether each slot is part of some compiled block (and thus whether
+     * writing to it requires blocks to be discarded).
+     */
+    bool covered[CHIP8_INSTR_SLOTS];
+};
+
+/**
+ * A buffer in which to assemble the code for a block.
+ */
+struct code_buf {
+    uint8_t data[JIT_MAX_BLOCK_LEN * JIT_MAX_INSTR_CODE + 1];
+    size_t len;
+};
+
+/**
+ * Compiles the block starting at the given slot.
+ *
+ * @return An error code.
+ */
+static int chip8_jit_compile(
+    struct chip8_jit *jit, const struct chip8 *chip, size_t slot);
+/**
+ * Discards all compiled blocks.
+ */
+static void chip8_jit_flush(struct chip8_jit *jit);
+/**
+ * Appends the native code for the given instruction to the buffer.
+ *
+ * @return Whether the instruction could be translated.
+ */
+static bool chip8_jit_translate(
+    struct code_buf *buf, struct chip8_instruction inst);
+
+bool chip8_jit_supported(void)
+{
+#ifdef CHIP8_JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct chip8_jit *chip8_jit_new(void)
+{
+    struct chip8_jit *jit;
+    void *arena;
+
+    if (!chip8_jit_supported())
+        return NULL;
+    arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        log_error("Could not map memory for generated code: %s", strerror(errno));
+        return NULL;
+    }
+
+    jit = xcalloc(1, sizeof *jit);
+    jit->arena = arena;
+    jit->used = 0;
+    return jit;
+}
+
+void chip8_jit_destroy(struct chip8_jit *jit)
+{
+    if (!jit)
+        return;
+    munmap(jit->arena, JIT_ARENA_SIZE);
+    free(jit);
+}
+
+const struct chip8_jit_block *chip8_jit_block(
+    struct chip8_jit *jit, const struct chip8 *chip, uint16_t addr)
+{
+    size_t slot = addr / 2;
+
+    switch (jit->state[slot]) {
+    case SLOT_COMPILED:
+        return &jit->blocks[slot];
+    case SLOT_UNCOMPILABLE:
+        return NULL;
+    default:
+        if (chip8_jit_compile(jit, chip, slot) != 0) {
+            jit->state[slot] = SLOT_UNCOMPILABLE;
+            return NULL;
+        }
+        return jit->state[slot] == SLOT_COMPILED ? &jit->blocks[slot] : NULL;
+    }
+}
+
+void chip8_jit_invalidate(struct chip8_jit *jit, uint16_t addr, size_t len)
+{
+    size_t end;
+
+    if (len == 0 || addr >= CHIP8_MEM_SIZE)
+        return;
+    end = addr + len > CHIP8_MEM_SIZE ? CHIP8_MEM_SIZE : addr + len;
+    /*
+     * Self-modifying code is rare enough that we don't bother figuring out
+     * which blocks cover the modified slots: if any of them are affected, we
+     * just throw everything away.
+     */
+    for (size_t slot = addr / 2; slot < (end + 1) / 2; slot++) {
+        if (jit->covered[slot]) {
+            log_debug("Code at 0x%03zX was modified; discarding compiled blocks", 2 * slot);
+            chip8_jit_flush(jit);
+            return;
+        }
+        jit->state[slot] = SLOT_UNKNOWN;
+    }
+}
+
+static int chip8_jit_compile(
+    struct chip8_jit *jit, const struct chip8 *chip, size_t slot)
+{
+    struct code_buf buf = {.len = 0};
+    unsigned len = 0;
+    void *code;
+
+    for (size_t addr = 2 * slot; addr + 1 < CHIP8_MEM_SIZE && len < JIT_MAX_BLOCK_LEN; addr += 2) {
+        uint16_t opcode = ((uint16_t)chip->mem[addr] << 8) | chip->mem[addr + 1];
+        struct chip8_instruction inst =
+            chip8_instruction_from_opcode(opcode, chip->opts.shift_quirks);
+
+        /* The interpreter has to see breakpoints, so they end a block */
+        if (chip->breakpoints[addr / 2] || !chip8_jit_translate(&buf, inst))
+            break;
+        len++;
+    }
+    if (len < JIT_MIN_BLOCK_LEN)
+        return 1;
+    /* ret */
+    buf.data[buf.len++] = 0xC3;
+
+    if (jit->used + buf.len > JIT_ARENA_SIZE)
+        chip8_jit_flush(jit);
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        log_error("Could not make code memory writable: %s", strerror(errno));
+        return 1;
+    }
+    code = jit->arena + jit->used;
+    memcpy(code, buf.data, buf.len);
+    jit->used += buf.len;
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        log_error("Could not make code memory executable: %s", strerror(errno));
+        return 1;
+    }
+
+    jit->blocks[slot].len = len;
+    /* ISO C doesn't allow casting an object pointer to a function pointer */
+    memcpy(&jit->blocks[slot].code, &code, sizeof code);
+    jit->state[slot] = SLOT_COMPILED;
+    for (size_t i = slot; i < slot + len; i++)
+        jit->covered[i] = true;
+    log_trace("Compiled block of %u instructions at 0x%03zX", len, 2 * slot);
+
+    return 0;
+}
+
+static void chip8_jit_flush(struct chip8_jit *jit)
+{
+    jit->used = 0;
+    memset(jit->state, SLOT_UNKNOWN, sizeof jit->state);
+    memset(jit->covered, 0, sizeof jit->covered);
+}
+
+#ifdef CHIP8_JIT_X86_64
+/*
+ * The generated code is called with a pointer to the interpreter in RDI, and
+ * only uses the caller-saved registers RAX, RCX and RDX.  All interpreter state
+ * is accessed through RDI using 32-bit displacements.
+ */
+/**
+ * The number of the RAX register (or AL, EAX, etc.) in instruction encodings.
+ */
+#define RAX 0
+/**
+ * The number of the RDX register (or DL, EDX, etc.) in instruction encodings.
+ */
+#define RDX 2
+/**
+ * The displacement of the given Chip-8 register from the interpreter pointer.
+ */
+#define VREG(r) ((int32_t)(offsetof(struct chip8, regs) + (r)))
+/**
+ * The displacement of the `I` register from the interpreter pointer.
+ */
+#define IREG ((int32_t)offsetof(struct chip8, reg_i))
+/**
+ * The displacement of the delay timer from the interpreter pointer.
+ */
+#define DTREG ((int32_t)offsetof(struct chip8, reg_dt))
+/**
+ * The displacement of the sound timer from the interpreter pointer.
+ */
+#define STREG ((int32_t)offsetof(struct chip8, reg_st))
+
+/**
+ * Appends a single byte to the buffer.
+ */
+static void emit_byte(struct code_buf *buf, uint8_t byte)
+{
+    buf->data[buf->len++] = byte;
+}
+
+/**
+ * Appends a ModRM byte addressing `[rdi + disp]`, followed by the
+ * displacement.
+ *
+ * @param reg The register (or opcode extension) for the reg field.
+ */
+static void emit_mem(struct code_buf *buf, int reg, int32_t disp)
+{
+    uint32_t udisp = (uint32_t)disp;
+
+    /* mod = 10 (32-bit displacement), rm = 111 (RDI) */
+    emit_byte(buf, 0x80 | reg << 3 | 0x7);
+    for (int i = 0; i < 4; i++)
+        emit_byte(buf, (udisp >> (8 * i)) & 0xFF);
+}
+
+/**
+ * Emits `movzx reg32, byte [rdi + disp]`.
+ */
+static void emit_load(struct code_buf *buf, int reg, int32_t disp)
+{
+    emit_byte(buf, 0x0F);
+    emit_byte(buf, 0xB6);
+    emit_mem(buf, reg, disp);
+}
+
+/**
+ * Emits `mov byte [rdi + disp], reg8`.
+ */
+static void emit_store(struct code_buf *buf, int reg, int32_t disp)
+{
+    emit_byte(buf, 0x88);
+    emit_mem(buf, reg, disp);
+}
+
+/**
+ * Emits an arithmetic instruction of the form `op al, byte [rdi + disp]`.
+ */
+static void emit_alu(struct code_buf *buf, uint8_t opcode, int32_t disp)
+{
+    emit_byte(buf, opcode);
+    emit_mem(buf, RAX, disp);
+}
+
+/**
+ * Emits `setcc dl`.
+ *
+ * @param cc The condition code (the low nibble of the opcode).
+ */
+static void emit_setcc_dl(struct code_buf *buf, uint8_t cc)
+{
+    emit_byte(buf, 0x0F);
+    emit_byte(buf, 0x90 | cc);
+    emit_byte(buf, 0xC0 | RDX);
+}
+
+/**
+ * Stores AL in `Vx` and DL in `VF`, in that order (so that the flag wins if
+ * `Vx` is `VF`).
+ */
+static void emit_store_result(struct code_buf *buf, int vx)
+{
+    emit_store(buf, RAX, VREG(vx));
+    emit_store(buf, RDX, VREG(REG_VF));
+}
+
+/**
+ * The condition code for "carry" (`setc`).
+ */
+#define CC_C 0x2
+/**
+ * The condition code for "no carry" (`setnc`).
+ */
+#define CC_NC 0x3
+
+static bool chip8_jit_translate(
+    struct code_buf *buf, struct chip8_instruction inst)
+{
+    switch (inst.op) {
+    case OP_LD_BYTE:
+        /* mov byte [Vx], imm8 */
+        emit_byte(buf, 0xC6);
+        emit_mem(buf, 0, VREG(inst.vx));
+        emit_byte(buf, inst.byte);
+        return true;
+    case OP_ADD_BYTE:
+        emit_load(buf, RAX, VREG(inst.vx));
+        /* add al, imm8 */
+        emit_byte(buf, 0x04);
+        emit_byte(buf, inst.byte);
+        emit_setcc_dl(buf, CC_C);
+        emit_store_result(buf, inst.vx);
+        return true;
+    case OP_LD_REG:
+        emit_load(buf, RAX, VREG(inst.vy));
+        emit_store(buf, RAX, VREG(inst.vx));
+        return true;
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+        emit_load(buf, RAX, VREG(inst.vx));
+        /* or/and/xor al, [Vy] */
+        emit_alu(buf, inst.op == OP_OR ? 0x0A : inst.op == OP_AND ? 0x22 : 0x32, VREG(inst.vy));
+        emit_store(buf, RAX, VREG(inst.vx));
+        return true;
+    case OP_ADD_REG:
+        emit_load(buf, RAX, VREG(inst.vx));
+        /* add al, [Vy] */
+        emit_alu(buf, 0x02, VREG(inst.vy));
+        emit_setcc_dl(buf, CC_C);
+        emit_store_result(buf, inst.vx);
+        return true;
+    case OP_SUB:
+        /* VF is set when there is no borrow */
+        emit_load(buf, RAX, VREG(inst.vx));
+        /* sub al, [Vy] */
+        emit_alu(buf, 0x2A, VREG(inst.vy));
+        emit_setcc_dl(buf, CC_NC);
+        emit_store_result(buf, inst.vx);
+        return true;
+    case OP_SUBN:
+        emit_load(buf, RAX, VREG(inst.vy));
+        /* sub al, [Vx] */
+        emit_alu(buf, 0x2A, VREG(inst.vx));
+        emit_setcc_dl(buf, CC_NC);
+        emit_store_result(buf, inst.vx);
+        return true;
+    case OP_SHR:
+    case OP_SHR_QUIRK:
+        emit_load(buf, RAX, VREG(inst.op == OP_SHR ? inst.vx : inst.vy));
+        /* shr al, 1 (the shifted-out bit goes into CF) */
+        emit_byte(buf, 0xD0);
+        emit_byte(buf, 0xE8);
+        emit_setcc_dl(buf, CC_C);
+        emit_store_result(buf, inst.vx);
+        return true;
+    case OP_SHL:
+    case OP_SHL_QUIRK:
+        emit_load(buf, RAX, VREG(inst.op == OP_SHL ? inst.vx : inst.vy));
+        /* shl al, 1 */
+        emit_byte(buf, 0xD0);
+        emit_byte(buf, 0xE0);
+        emit_setcc_dl(buf, CC_C);
+        emit_store_result(buf, inst.vx);
+        return true;
+    case OP_LD_I:
+        /* mov word [I], imm16 */
+        emit_byte(buf, 0x66);
+        emit_byte(buf, 0xC7);
+        emit_mem(buf, 0, IREG);
+        emit_byte(buf, inst.addr & 0xFF);
+        emit_byte(buf, inst.addr >> 8);
+        return true;
+    case OP_ADD_I:
+        emit_load(buf, RAX, VREG(inst.vx));
+        /* add word [I], ax */
+        emit_byte(buf, 0x66);
+        emit_byte(buf, 0x01);
+        emit_mem(buf, RAX, IREG);
+        return true;
+    case OP_LD_REG_DT:
+        emit_load(buf, RAX, DTREG);
+        emit_store(buf, RAX, VREG(inst.vx));
+        return true;
+    case OP_LD_DT_REG:
+    case OP_LD_ST:
+        emit_load(buf, RAX, VREG(inst.vx));
+        emit_store(buf, RAX, inst.op == OP_LD_DT_REG ? DTREG : STREG);
+        return true;
+    default:
+        /* Everything else is left to the interpreter */
+        return false;
+    }
+}
+#else
+static bool chip8_jit_translate(
+    struct code_buf *buf, struct chip8_instruction inst)
+{
+    (void)buf;
+    (void)inst;
+    return false;
+}
+#endif
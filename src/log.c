@@ -7,19 +7,55 @@
  */
 #include "log.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The queue needs atomic operations, which C99 doesn't have, so without the
+ * GCC builtins we fall back to writing every message synchronously.
+ */
+#if defined(__GNUC__)
+#define LOG_ASYNC 1
+#else
+#define LOG_ASYNC 0
+#endif
 
 /**
- * The current maximum log level.
+ * A message waiting to be written.
  */
-static enum log_level max_level;
+struct log_record {
+    /**
+     * The next record in the queue.
+     */
+    struct log_record *next;
+    enum log_level level;
+    /**
+     * The text of the message (without the program name, level or final
+     * newline).
+     */
+    char text[];
+};
+
 /**
- * The current message log level.
- *
- * This is undefined if there is no message currently being logged; a message
- * should always be started with the log_message_begin function.
+ * The buffer in which a thread builds up a multi-part message.
  */
-static enum log_level message_level;
+struct log_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+    /**
+     * The level of the message being built.
+     */
+    enum log_level level;
+};
+
+/**
+ * The current maximum log level.
+ */
+static enum log_level max_level;
 /**
  * The current log output file.
  */
@@ -28,17 +64,104 @@ static FILE *log_output;
  * The program name to print in output messages.
  */
 static const char *progname;
+/**
+ * The key for each thread's `struct log_buffer`.
+ */
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+#if LOG_ASYNC
+/**
+ * The records waiting to be written, newest first.
+ *
+ * This is a lock-free stack: logging threads push records onto it using
+ * compare-and-swap, and the writer takes the whole stack at once and reverses
+ * it.  Since nothing ever pops a single record, there is no ABA problem.
+ */
+static struct log_record *queue;
+/**
+ * The lock protecting the writer's state (but not the queue).
+ */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Signaled when a record is pushed onto an empty queue, or when the writer
+ * should stop.
+ */
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+/**
+ * Signaled when the writer has finished writing a batch of records.
+ */
+static pthread_cond_t writer_idle = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+/**
+ * Whether the writer thread is running; if not, records are written by the
+ * thread which logs them.
+ */
+static bool writer_running;
+/**
+ * Whether the writer is in the middle of writing a batch of records.
+ */
+static bool writer_busy;
+/**
+ * Whether the writer should exit once the queue is empty.
+ */
+static bool writer_stopping;
+#endif
 
 /**
  * Returns a string with the name of the given log level.
  */
 static char *log_level_string(enum log_level level);
+/**
+ * Returns the calling thread's message buffer, or NULL if it could not be
+ * allocated.
+ */
+static struct log_buffer *log_buffer_get(void);
+static void log_buffer_key_create(void);
+static void log_buffer_free(void *data);
+/**
+ * Hands the given record over to be written.
+ */
+static void log_submit(struct log_record *record);
+/**
+ * Writes the given list of records, oldest first, and frees them.
+ */
+static void log_write_records(struct log_record *records);
+#if LOG_ASYNC
+/**
+ * Pushes a record onto the queue.
+ *
+ * @return Whether the queue was empty.
+ */
+static bool queue_push(struct log_record *record);
+/**
+ * Takes every record off the queue.
+ *
+ * @return The records, oldest first.
+ */
+static struct log_record *queue_take(void);
+/**
+ * The body of the writer thread.
+ */
+static void *log_writer(void *data);
+/**
+ * Stops the writer thread (at exit), writing out anything still queued.
+ */
+static void log_stop_writer(void);
+#endif
 
 void log_init(const char *name, FILE *output, enum log_level max)
 {
     progname = name;
     log_set_output(output);
     log_set_level(max);
+#if LOG_ASYNC
+    if (!writer_running &&
+        pthread_create(&writer, NULL, log_writer, NULL) == 0) {
+        __atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+        atexit(log_stop_writer);
+    }
+#endif
     log_message(LOG_DEBUG, "Logging initialized");
 }
 
@@ -54,9 +177,25 @@ void log_set_level(enum log_level max)
 
 void log_set_output(FILE *output)
 {
+    /* Messages already logged should still go to the old output */
+    log_flush();
     log_output = output;
 }
 
+void log_flush(void)
+{
+#if LOG_ASYNC
+    if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&writer_lock);
+        while (__atomic_load_n(&queue, __ATOMIC_ACQUIRE) || writer_busy)
+            pthread_cond_wait(&writer_idle, &writer_lock);
+        pthread_mutex_unlock(&writer_lock);
+    }
+#endif
+    if (log_output)
+        fflush(log_output);
+}
+
 static char *log_level_string(enum log_level level)
 {
     switch (level) {
@@ -78,33 +217,226 @@ static char *log_level_string(enum log_level level)
 void log_message(enum log_level level, const char *fmt, ...)
 {
     va_list args;
+    struct log_record *record;
+    int len;
+
+    if (log_output == NULL || level > max_level)
+        return;
+
     va_start(args, fmt);
-    if (log_output != NULL && level <= max_level) {
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (!(record = malloc(sizeof *record + len + 1))) {
+        /* We can still get the message out the slow way */
+        va_start(args, fmt);
+        flockfile(log_output);
         fprintf(log_output, "%s: %s: ", progname, log_level_string(level));
         vfprintf(log_output, fmt, args);
         putc('\n', log_output);
+        funlockfile(log_output);
+        va_end(args);
+        return;
     }
+    va_start(args, fmt);
+    vsnprintf(record->text, len + 1, fmt, args);
     va_end(args);
+    record->level = level;
+    log_submit(record);
 }
 
 void log_message_begin(enum log_level level)
 {
-    message_level = level;
-    if (log_output != NULL && message_level <= max_level)
-        fprintf(log_output, "%s: %s: ", progname, log_level_string(level));
+    struct log_buffer *buf = log_buffer_get();
+
+    if (!buf)
+        return;
+    buf->level = level;
+    buf->len = 0;
 }
 
 void log_message_part(const char *fmt, ...)
 {
+    struct log_buffer *buf = log_buffer_get();
     va_list args;
+    int len;
+
+    if (!buf || log_output == NULL || buf->level > max_level)
+        return;
+
     va_start(args, fmt);
-    if (log_output != NULL && message_level <= max_level)
-        vfprintf(log_output, fmt, args);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 128;
+        char *data;
+
+        while (buf->len + len + 1 > cap)
+            cap *= 2;
+        if (!(data = realloc(buf->data, cap)))
+            return;
+        buf->data = data;
+        buf->cap = cap;
+    }
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, len + 1, fmt, args);
     va_end(args);
+    buf->len += len;
 }
 
 void log_message_end(void)
 {
-    if (log_output != NULL && message_level <= max_level)
-        putc('\n', log_output);
+    struct log_buffer *buf = log_buffer_get();
+    struct log_record *record;
+
+    if (!buf || log_output == NULL || buf->level > max_level)
+        return;
+    if (!(record = malloc(sizeof *record + buf->len + 1)))
+        return;
+    if (buf->len > 0)
+        memcpy(record->text, buf->data, buf->len);
+    record->text[buf->len] = '\0';
+    record->level = buf->level;
+    buf->len = 0;
+    log_submit(record);
+}
+
+static struct log_buffer *log_buffer_get(void)
+{
+    struct log_buffer *buf;
+
+    pthread_once(&buffer_key_once, log_buffer_key_create);
+    if (!(buf = pthread_getspecific(buffer_key))) {
+        if (!(buf = calloc(1, sizeof *buf)))
+            return NULL;
+        pthread_setspecific(buffer_key, buf);
+    }
+
+    return buf;
+}
+
+static void log_buffer_key_create(void)
+{
+    pthread_key_create(&buffer_key, log_buffer_free);
+}
+
+static void log_buffer_free(void *data)
+{
+    struct log_buffer *buf = data;
+
+    free(buf->data);
+    free(buf);
+}
+
+static void log_submit(struct log_record *record)
+{
+#if LOG_ASYNC
+    if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        /*
+         * The writer only needs waking up if the queue was empty; otherwise,
+         * it's either awake already or has a wakeup pending.
+         */
+        if (queue_push(record)) {
+            pthread_mutex_lock(&writer_lock);
+            pthread_cond_signal(&writer_wake);
+            pthread_mutex_unlock(&writer_lock);
+        }
+        return;
+    }
+#endif
+    record->next = NULL;
+    log_write_records(record);
+}
+
+static void log_write_records(struct log_record *records)
+{
+    FILE *output = log_output;
+
+    if (output)
+        flockfile(output);
+    while (records) {
+        struct log_record *next = records->next;
+
+        if (output)
+            fprintf(output, "%s: %s: %s\n", progname,
+                log_level_string(records->level), records->text);
+        free(records);
+        records = next;
+    }
+    if (output) {
+        fflush(output);
+        funlockfile(output);
+    }
+}
+
+#if LOG_ASYNC
+static bool queue_push(struct log_record *record)
+{
+    struct log_record *head = __atomic_load_n(&queue, __ATOMIC_RELAXED);
+
+    do {
+        record->next = head;
+    } while (!__atomic_compare_exchange_n(
+        &queue, &head, record, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return head == NULL;
+}
+
+static struct log_record *queue_take(void)
+{
+    struct log_record *records =
+        __atomic_exchange_n(&queue, NULL, __ATOMIC_ACQUIRE);
+    struct log_record *oldest = NULL;
+
+    while (records) {
+        struct log_record *next = records->next;
+
+        records->next = oldest;
+        oldest = records;
+        records = next;
+    }
+
+    return oldest;
+}
+
+static void *log_writer(void *data)
+{
+    (void)data;
+
+    pthread_mutex_lock(&writer_lock);
+    for (;;) {
+        struct log_record *records;
+
+        while (!__atomic_load_n(&queue, __ATOMIC_ACQUIRE) && !writer_stopping)
+            pthread_cond_wait(&writer_wake, &writer_lock);
+        if (!(records = queue_take()))
+            break;
+        writer_busy = true;
+        pthread_mutex_unlock(&writer_lock);
+
+        log_write_records(records);
+
+        pthread_mutex_lock(&writer_lock);
+        writer_busy = false;
+        pthread_cond_broadcast(&writer_idle);
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    return NULL;
+}
+
+static void log_stop_writer(void)
+{
+    pthread_mutex_lock(&writer_lock);
+    writer_stopping = true;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+    __atomic_store_n(&writer_running, false, __ATOMIC_RELEASE);
+    /* Anything which slipped in while the writer was finishing up */
+    log_write_records(queue_take());
 }
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "movie.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The maximum length of a line in a movie file.
+ */
+#define LINE_MAX_LEN 128
+
+/**
+ * Adds an input to the end of the movie.
+ */
+static void chip8_movie_add_input(
+    struct chip8_movie *movie, unsigned long frame, uint16_t key_states);
+/**
+ * Reads the header of a movie file.
+ *
+ * @return An error code.
+ */
+static int chip8_movie_read_header(
+    struct chip8_movie *movie, FILE *input, const char *fname);
+
+struct chip8_movie *chip8_movie_new(struct chip8_options opts)
+{
+    struct chip8_movie *movie = xcalloc(1, sizeof *movie);
+
+    movie->seed = opts.seed;
+    movie->load_quirks = opts.load_quirks;
+    movie->shift_quirks = opts.shift_quirks;
+    movie->cycles_per_frame = opts.cycles_per_frame;
+
+    return movie;
+}
+
+void chip8_movie_free(struct chip8_movie *movie)
+{
+    if (!movie)
+        return;
+    free(movie->inputs);
+    free(movie);
+}
+
+struct chip8_options chip8_movie_options(
+    const struct chip8_movie *movie, struct chip8_options opts)
+{
+    opts.seed = movie->seed;
+    opts.load_quirks = movie->load_quirks;
+    opts.shift_quirks = movie->shift_quirks;
+    opts.cycles_per_frame = movie->cycles_per_frame;
+    opts.enable_timer = true;
+    opts.virtual_clock = true;
+
+    return opts;
+}
+
+void chip8_movie_record(struct chip8_movie *movie, uint16_t key_states)
+{
+    if (movie->n_inputs == 0 ||
+        movie->inputs[movie->n_inputs - 1].key_states != key_states)
+        chip8_movie_add_input(movie, movie->frames, key_states);
+    movie->frames++;
+}
+
+uint16_t chip8_movie_keys(
+    const struct chip8_movie *movie, unsigned long frame, size_t *cursor)
+{
+    while (*cursor < movie->n_inputs && movie->inputs[*cursor].frame <= frame)
+        (*cursor)++;
+    return *cursor > 0 ? movie->inputs[*cursor - 1].key_states : 0;
+}
+
+unsigned chip8_movie_replay(const struct chip8_movie *movie, struct chip8 *chip,
+    unsigned long *frames)
+{
+    size_t cursor = 0;
+    unsigned long frame;
+    unsigned stopped = 0;
+
+    for (frame = 0; frame < movie->frames; frame++) {
+        chip->key_states = chip8_movie_keys(movie, frame, &cursor);
+        stopped = chip8_run_frame(chip);
+        if (stopped & (CHIP8_STOP_HALT | CHIP8_STOP_ERROR))
+            break;
+    }
+
+    if (frames)
+        *frames = frame;
+    return stopped;
+}
+
+int chip8_movie_save(const struct chip8_movie *movie, const char *fname)
+{
+    FILE *output;
+
+    if (!(output = fopen(fname, "w"))) {
+        log_error("Could not open movie file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    fprintf(output, "chip8-movie %d\n", CHIP8_MOVIE_VERSION);
+    fprintf(output, "seed %" PRIu64 "\n", movie->seed);
+    fprintf(output, "load-quirks %d\n", movie->load_quirks);
+    fprintf(output, "shift-quirks %d\n", movie->shift_quirks);
+    fprintf(output, "cycles-per-frame %lu\n", movie->cycles_per_frame);
+    fprintf(output, "frames %lu\n", movie->frames);
+    for (size_t i = 0; i < movie->n_inputs; i++)
+        fprintf(output, "%lu %04X\n", movie->inputs[i].frame,
+            (unsigned)movie->inputs[i].key_states);
+
+    if (ferror(output)) {
+        log_error("Could not write movie file '%s'", fname);
+        fclose(output);
+        return 1;
+    }
+    if (fclose(output) != 0) {
+        log_error("Could not write movie file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+struct chip8_movie *chip8_movie_load(const char *fname)
+{
+    struct chip8_movie *movie = xcalloc(1, sizeof *movie);
+    FILE *input;
+    char line[LINE_MAX_LEN];
+    int line_num = 6;
+
+    if (!(input = fopen(fname, "r"))) {
+        log_error("Could not open movie file '%s': %s", fname, strerror(errno));
+        goto ERROR_MOVIE_CREATED;
+    }
+    if (chip8_movie_read_header(movie, input, fname))
+        goto ERROR_FILE_OPENED;
+
+    while (fgets(line, sizeof line, input)) {
+        unsigned long frame;
+        unsigned keys;
+        char extra;
+
+        line_num++;
+        if (sscanf(line, "%lu %x %c", &frame, &keys, &extra) != 2 ||
+            keys > 0xFFFF) {
+            log_error("%s:%d: invalid input", fname, line_num);
+            goto ERROR_FILE_OPENED;
+        }
+        if (movie->n_inputs > 0 &&
+            frame <= movie->inputs[movie->n_inputs - 1].frame) {
+            log_error("%s:%d: inputs are out of order", fname, line_num);
+            goto ERROR_FILE_OPENED;
+        }
+        chip8_movie_add_input(movie, frame, keys);
+    }
+    if (ferror(input)) {
+        log_error("Error reading from movie file '%s'", fname);
+        goto ERROR_FILE_OPENED;
+    }
+
+    fclose(input);
+    return movie;
+
+ERROR_FILE_OPENED:
+    fclose(input);
+ERROR_MOVIE_CREATED:
+    chip8_movie_free(movie);
+    return NULL;
+}
+
+static void chip8_movie_add_input(
+    struct chip8_movie *movie, unsigned long frame, uint16_t key_states)
+{
+    if (movie->n_inputs == movie->inputs_cap) {
+        movie->inputs_cap = movie->inputs_cap ? 2 * movie->inputs_cap : 64;
+        movie->inputs = xrealloc(
+            movie->inputs, movie->inputs_cap * sizeof *movie->inputs);
+    }
+    movie->inputs[movie->n_inputs].frame = frame;
+    movie->inputs[movie->n_inputs].key_states = key_states;
+    movie->n_inputs++;
+}
+
+static int chip8_movie_read_header(
+    struct chip8_movie *movie, FILE *input, const char *fname)
+{
+    char line[LINE_MAX_LEN];
+    int version, load_quirks, shift_quirks;
+
+    if (!fgets(line, sizeof line, input) ||
+        sscanf(line, "chip8-movie %d", &version) != 1) {
+        log_error("'%s' is not a movie file", fname);
+        return 1;
+    }
+    if (version != CHIP8_MOVIE_VERSION) {
+        log_error("Unsupported movie version %d (expected %d)", version,
+            CHIP8_MOVIE_VERSION);
+        return 1;
+    }
+    if (!fgets(line, sizeof line, input) ||
+        sscanf(line, "seed %" SCNu64, &movie->seed) != 1 ||
+        !fgets(line, sizeof line, input) ||
+        sscanf(line, "load-quirks %d", &load_quirks) != 1 ||
+        !fgets(line, sizeof line, input) ||
+        sscanf(line, "shift-quirks %d", &shift_quirks) != 1 ||
+        !fgets(line, sizeof line, input) ||
+        sscanf(line, "cycles-per-frame %lu", &movie->cycles_per_frame) != 1 ||
+        !fgets(line, sizeof line, input) ||
+        sscanf(line, "frames %lu", &movie->frames) != 1) {
+        log_error("Movie file '%s' has an invalid header", fname);
+        return 1;
+    }
+    movie->load_quirks = load_quirks;
+    movie->shift_quirks = shift_quirks;
+
+    return 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "pack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "memory.h"
+
+struct chip8_pack {
+    /**
+     * The whole pack file, mapped into memory.
+     */
+    void *map;
+    size_t map_len;
+    const struct chip8_pack_header *header;
+    /**
+     * The index, sorted by digest.
+     */
+    const struct chip8_pack_entry *entries;
+    /**
+     * The name table.
+     */
+    const char *names;
+};
+
+/**
+ * Compares two entries by digest, for sorting.
+ */
+static int compare_entries(const void *a, const void *b);
+/**
+ * Checks that the header and index of a mapped pack are valid, so that
+ * nothing needs to be checked when games are looked up later.
+ *
+ * @return An error code.
+ */
+static int pack_check(const struct chip8_pack *pack, const char *fname);
+
+int chip8_pack_write(
+    const char *fname, const struct chip8_pack_item *items, size_t n_items)
+{
+    struct chip8_pack_header header;
+    struct chip8_pack_entry *entries = NULL;
+    /* The item each entry was made from */
+    size_t *sources = NULL;
+    size_t n_entries = 0;
+    uint64_t names_size = 0;
+    uint64_t offset;
+    FILE *output;
+    int retval = 0;
+
+    /* An empty pack is fine, but the library calls mustn't see NULL */
+    if (n_items > 0) {
+        entries = xcalloc(n_items, sizeof *entries);
+        sources = xcalloc(n_items, sizeof *sources);
+    }
+    for (size_t i = 0; i < n_items; i++) {
+        chip8_sha1(items[i].data, items[i].len, entries[i].sha1);
+        entries[i].flags = items[i].flags;
+        entries[i].len = items[i].len;
+        /* The position of the item is stashed in offset until after sorting */
+        entries[i].offset = i;
+    }
+    if (n_items > 0)
+        qsort(entries, n_items, sizeof *entries, compare_entries);
+
+    /* Copies of the same game are next to each other, earliest first */
+    for (size_t i = 0; i < n_items; i++) {
+        if (n_entries > 0 &&
+            memcmp(entries[i].sha1, entries[n_entries - 1].sha1,
+                CHIP8_SHA1_LEN) == 0) {
+            log_warning("Skipping '%s', which is identical to '%s'",
+                items[entries[i].offset].name,
+                items[entries[n_entries - 1].offset].name);
+            continue;
+        }
+        entries[n_entries++] = entries[i];
+    }
+
+    for (size_t i = 0; i < n_entries; i++) {
+        sources[i] = entries[i].offset;
+        entries[i].name = names_size;
+        names_size += strlen(items[sources[i]].name) + 1;
+    }
+    offset = sizeof header + n_entries * sizeof *entries + names_size;
+    for (size_t i = 0; i < n_entries; i++) {
+        entries[i].offset = offset;
+        offset += entries[i].len;
+    }
+    if (offset > UINT32_MAX) {
+        log_error("Pack file '%s' would be too big", fname);
+        retval = 1;
+        goto EXIT_ENTRIES_CREATED;
+    }
+
+    memcpy(header.magic, CHIP8_PACK_MAGIC, sizeof header.magic);
+    header.version = CHIP8_PACK_VERSION;
+    header.byte_order = CHIP8_PACK_BYTE_ORDER;
+    header.n_entries = n_entries;
+    header.names_size = names_size;
+
+    if (!(output = fopen(fname, "wb"))) {
+        log_error("Could not open pack file '%s': %s", fname, strerror(errno));
+        retval = 1;
+        goto EXIT_ENTRIES_CREATED;
+    }
+    if (fwrite(&header, sizeof header, 1, output) != 1 ||
+        (n_entries > 0 &&
+            fwrite(entries, sizeof *entries, n_entries, output) != n_entries))
+        retval = 1;
+    for (size_t i = 0; !retval && i < n_entries; i++) {
+        const char *name = items[sources[i]].name;
+
+        if (fwrite(name, 1, strlen(name) + 1, output) != strlen(name) + 1)
+            retval = 1;
+    }
+    for (size_t i = 0; !retval && i < n_entries; i++)
+        if (fwrite(items[sources[i]].data, 1, entries[i].len, output) !=
+            entries[i].len)
+            retval = 1;
+    if (fclose(output) != 0)
+        retval = 1;
+    if (retval)
+        log_error("Could not write pack file '%s': %s", fname, strerror(errno));
+    else
+        log_info("Packed %zu games into '%s'", n_entries, fname);
+
+EXIT_ENTRIES_CREATED:
+    free(sources);
+    free(entries);
+    return retval;
+}
+
+struct chip8_pack *chip8_pack_open(const char *fname)
+{
+    struct chip8_pack *pack = xcalloc(1, sizeof *pack);
+    struct stat st;
+    int fd;
+
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        log_error("Could not open pack file '%s': %s", fname, strerror(errno));
+        goto ERROR_PACK_CREATED;
+    }
+    if (fstat(fd, &st) != 0) {
+        log_error("Could not stat pack file '%s': %s", fname, strerror(errno));
+        close(fd);
+        goto ERROR_PACK_CREATED;
+    }
+    if ((size_t)st.st_size < sizeof *pack->header) {
+        log_error("'%s' is not a pack file", fname);
+        close(fd);
+        goto ERROR_PACK_CREATED;
+    }
+    pack->map_len = st.st_size;
+    /* A shared mapping lets every process using the pack share its pages */
+    pack->map = mmap(NULL, pack->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pack->map == MAP_FAILED) {
+        log_error("Could not map pack file '%s': %s", fname, strerror(errno));
+        goto ERROR_PACK_CREATED;
+    }
+
+    pack->header = pack->map;
+    pack->entries = (const struct chip8_pack_entry *)(pack->header + 1);
+    if (pack_check(pack, fname))
+        goto ERROR_PACK_MAPPED;
+    pack->names = (const char *)(pack->entries + pack->header->n_entries);
+
+    return pack;
+
+ERROR_PACK_MAPPED:
+    munmap(pack->map, pack->map_len);
+ERROR_PACK_CREATED:
+    free(pack);
+    return NULL;
+}
+
+void chip8_pack_close(struct chip8_pack *pack)
+{
+    if (!pack)
+        return;
+    munmap(pack->map, pack->map_len);
+    free(pack);
+}
+
+size_t chip8_pack_size(const struct chip8_pack *pack)
+{
+    return pack->header->n_entries;
+}
+
+const struct chip8_pack_entry *chip8_pack_get(
+    const struct chip8_pack *pack, size_t idx)
+{
+    return &pack->entries[idx];
+}
+
+const struct chip8_pack_entry *chip8_pack_find(
+    const struct chip8_pack *pack, const uint8_t sha1[CHIP8_SHA1_LEN])
+{
+    size_t lo = 0;
+    size_t hi = pack->header->n_entries;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(sha1, pack->entries[mid].sha1, CHIP8_SHA1_LEN);
+
+        if (cmp == 0)
+            return &pack->entries[mid];
+        else if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+const struct chip8_pack_entry *chip8_pack_find_name(
+    const struct chip8_pack *pack, const char *name)
+{
+    for (size_t i = 0; i < pack->header->n_entries; i++)
+        if (strcmp(pack->names + pack->entries[i].name, name) == 0)
+            return &pack->entries[i];
+
+    return NULL;
+}
+
+const char *chip8_pack_name(
+    const struct chip8_pack *pack, const struct chip8_pack_entry *entry)
+{
+    return pack->names + entry->name;
+}
+
+const uint8_t *chip8_pack_data(
+    const struct chip8_pack *pack, const struct chip8_pack_entry *entry)
+{
+    return (const uint8_t *)pack->map + entry->offset;
+}
+
+struct chip8_options chip8_pack_options(
+    const struct chip8_pack_entry *entry, struct chip8_options opts)
+{
+    if (entry->flags & CHIP8_PACK_SHIFT_QUIRKS)
+        opts.shift_quirks = true;
+    if (entry->flags & CHIP8_PACK_LOAD_QUIRKS)
+        opts.load_quirks = true;
+
+    return opts;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct chip8_pack_entry *ea = a;
+    const struct chip8_pack_entry *eb = b;
+    int cmp = memcmp(ea->sha1, eb->sha1, CHIP8_SHA1_LEN);
+
+    /* Ties are broken by original position, so duplicates stay in order */
+    if (cmp == 0)
+        return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+    return cmp;
+}
+
+static int pack_check(const struct chip8_pack *pack, const char *fname)
+{
+    const struct chip8_pack_header *header = pack->header;
+    uint64_t names_start;
+
+    if (memcmp(header->magic, CHIP8_PACK_MAGIC, sizeof header->magic) != 0) {
+        log_error("'%s' is not a pack file", fname);
+        return 1;
+    }
+    if (header->byte_order != CHIP8_PACK_BYTE_ORDER) {
+        log_error("Pack '%s' was written on a machine with a different byte "
+                  "order",
+            fname);
+        return 1;
+    }
+    if (header->version != CHIP8_PACK_VERSION) {
+        log_error("Unsupported pack version %lu (expected %d)",
+            (unsigned long)header->version, CHIP8_PACK_VERSION);
+        return 1;
+    }
+
+    names_start = sizeof *header +
+        (uint64_t)header->n_entries * sizeof(struct chip8_pack_entry);
+    if (names_start + header->names_size > pack->map_len ||
+        (header->names_size > 0 &&
+            ((const char *)pack->map)[names_start + header->names_size - 1] !=
+                '\0')) {
+        log_error("Pack '%s' is truncated or corrupt", fname);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < header->n_entries; i++) {
+        const struct chip8_pack_entry *entry = &pack->entries[i];
+
+        if (entry->name >= header->names_size ||
+            (uint64_t)entry->offset + entry->len > pack->map_len ||
+            entry->len > CHIP8_PROG_SIZE) {
+            log_error("Pack '%s' is truncated or corrupt", fname);
+            return 1;
+        }
+        /* Lookups by digest depend on the index being sorted */
+        if (i > 0 &&
+            memcmp(pack->entries[i - 1].sha1, entry->sha1, CHIP8_SHA1_LEN) >=
+                0) {
+            log_error("The index of pack '%s' is not sorted", fname);
+            return 1;
+        }
+    }
+
+    return 0;
+}
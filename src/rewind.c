@@ -0,0 +1,287 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "rewind.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "state.h"
+
+/**
+ * The largest number of bytes covered by a single run in the encoding.
+ */
+#define RUN_MAX 128
+
+/**
+ * A single encoded snapshot.
+ */
+struct rewind_entry {
+    /**
+     * The run-length encoded snapshot (for a keyframe) or delta.
+     */
+    uint8_t *data;
+    /**
+     * The length of the encoded data.
+     */
+    size_t len;
+    /**
+     * The number of snapshots since the last keyframe (0 if this is a
+     * keyframe).
+     */
+    size_t since_key;
+};
+
+struct chip8_rewind {
+    /**
+     * The snapshots, as a ring buffer.
+     */
+    struct rewind_entry *entries;
+    size_t capacity;
+    size_t keyframe_interval;
+    /**
+     * The index of the oldest snapshot.
+     */
+    size_t head;
+    /**
+     * The number of snapshots in the buffer.
+     */
+    size_t count;
+    /**
+     * The total length of the encoded snapshots.
+     */
+    size_t bytes;
+    /**
+     * The decoded keyframe on which the newest snapshot is based.
+     *
+     * This is kept around so that we don't need to decode it for every new
+     * delta; it is only valid if `key_valid` is set.
+     */
+    struct chip8_state key;
+    bool key_valid;
+    /**
+     * Space for building a snapshot or delta.
+     */
+    struct chip8_state scratch;
+    /**
+     * Space for encoding a snapshot, big enough for the worst case.
+     */
+    uint8_t *buf;
+};
+
+/**
+ * Returns the entry with the given index, counting from the oldest.
+ */
+static struct rewind_entry *rewind_entry(struct chip8_rewind *rewind, size_t i);
+/**
+ * Discards the oldest snapshot in the buffer.
+ */
+static void rewind_drop_oldest(struct chip8_rewind *rewind);
+/**
+ * Makes sure that `key` holds the keyframe on which the newest snapshot is
+ * based.
+ */
+static void rewind_load_key(struct chip8_rewind *rewind);
+/**
+ * Run-length encodes the given data, which is expected to be mostly zero.
+ *
+ * The encoding is a sequence of runs, each starting with a control byte `c`.
+ * If `c` is less than 0x80, the run is made up of `c + 1` zero bytes;
+ * otherwise, the run is made up of the `c - 0x7F` bytes which follow.
+ *
+ * @param[out] out Space for the encoded data (at least `2 * len` bytes).
+ * @return The length of the encoded data.
+ */
+static size_t rle_encode(uint8_t *out, const uint8_t *data, size_t len);
+/**
+ * XORs run-length encoded data into the given buffer.
+ */
+static void rle_xor(uint8_t *dest, const uint8_t *data, size_t len);
+
+struct chip8_rewind *chip8_rewind_new(size_t capacity, size_t keyframe_interval)
+{
+    struct chip8_rewind *rewind = xcalloc(1, sizeof *rewind);
+
+    rewind->capacity = capacity > 0 ? capacity : 1;
+    rewind->entries = xcalloc(rewind->capacity, sizeof *rewind->entries);
+    if (keyframe_interval == 0)
+        keyframe_interval = 1;
+    else if (keyframe_interval > rewind->capacity)
+        keyframe_interval = rewind->capacity;
+    rewind->keyframe_interval = keyframe_interval;
+    rewind->buf = xmalloc(2 * sizeof(struct chip8_state));
+
+    return rewind;
+}
+
+void chip8_rewind_destroy(struct chip8_rewind *rewind)
+{
+    if (!rewind)
+        return;
+    while (rewind->count > 0)
+        rewind_drop_oldest(rewind);
+    free(rewind->entries);
+    free(rewind->buf);
+    free(rewind);
+}
+
+void chip8_rewind_push(struct chip8_rewind *rewind, const struct chip8 *chip)
+{
+    struct rewind_entry *entry;
+    size_t since_key = 0;
+
+    /*
+     * When the oldest keyframe goes, so must all the deltas based on it, so
+     * making room for a new snapshot may free up several at once.
+     */
+    if (rewind->count == rewind->capacity) {
+        rewind_drop_oldest(rewind);
+        while (rewind->count > 0 && rewind_entry(rewind, 0)->since_key != 0)
+            rewind_drop_oldest(rewind);
+    }
+    if (rewind->count > 0)
+        since_key = rewind_entry(rewind, rewind->count - 1)->since_key + 1;
+    if (since_key >= rewind->keyframe_interval)
+        since_key = 0;
+
+    entry = rewind_entry(rewind, rewind->count);
+    if (since_key == 0) {
+        chip8_state_capture(chip, &rewind->key);
+        rewind->key_valid = true;
+        entry->len = rle_encode(
+            rewind->buf, (const uint8_t *)&rewind->key, sizeof rewind->key);
+    } else {
+        uint8_t *delta = (uint8_t *)&rewind->scratch;
+        const uint8_t *key = (const uint8_t *)&rewind->key;
+
+        rewind_load_key(rewind);
+        chip8_state_capture(chip, &rewind->scratch);
+        for (size_t i = 0; i < sizeof rewind->scratch; i++)
+            delta[i] ^= key[i];
+        entry->len = rle_encode(rewind->buf, delta, sizeof rewind->scratch);
+    }
+    entry->data = xmalloc(entry->len);
+    memcpy(entry->data, rewind->buf, entry->len);
+    entry->since_key = since_key;
+    rewind->count++;
+    rewind->bytes += entry->len;
+}
+
+int chip8_rewind_pop(struct chip8_rewind *rewind, struct chip8 *chip)
+{
+    struct rewind_entry *entry;
+    int retval;
+
+    if (rewind->count == 0)
+        return 1;
+
+    entry = rewind_entry(rewind, rewind->count - 1);
+    if (entry->since_key == 0) {
+        memset(&rewind->scratch, 0, sizeof rewind->scratch);
+        /* The key is about to go away along with this snapshot */
+        rewind->key_valid = false;
+    } else {
+        rewind_load_key(rewind);
+        rewind->scratch = rewind->key;
+    }
+    rle_xor((uint8_t *)&rewind->scratch, entry->data, entry->len);
+    retval = chip8_state_restore(chip, &rewind->scratch);
+
+    rewind->count--;
+    rewind->bytes -= entry->len;
+    free(entry->data);
+    entry->data = NULL;
+    return retval;
+}
+
+size_t chip8_rewind_size(const struct chip8_rewind *rewind)
+{
+    return rewind->count;
+}
+
+size_t chip8_rewind_bytes(const struct chip8_rewind *rewind)
+{
+    return rewind->bytes;
+}
+
+static struct rewind_entry *rewind_entry(struct chip8_rewind *rewind, size_t i)
+{
+    return &rewind->entries[(rewind->head + i) % rewind->capacity];
+}
+
+static void rewind_drop_oldest(struct chip8_rewind *rewind)
+{
+    struct rewind_entry *entry = rewind_entry(rewind, 0);
+
+    rewind->bytes -= entry->len;
+    free(entry->data);
+    entry->data = NULL;
+    rewind->head = (rewind->head + 1) % rewind->capacity;
+    if (--rewind->count == 0)
+        rewind->key_valid = false;
+}
+
+static void rewind_load_key(struct chip8_rewind *rewind)
+{
+    size_t newest = rewind->count - 1;
+    struct rewind_entry *key;
+
+    if (rewind->key_valid)
+        return;
+    key = rewind_entry(rewind, newest - rewind_entry(rewind, newest)->since_key);
+    memset(&rewind->key, 0, sizeof rewind->key);
+    rle_xor((uint8_t *)&rewind->key, key->data, key->len);
+    rewind->key_valid = true;
+}
+
+static size_t rle_encode(uint8_t *out, const uint8_t *data, size_t len)
+{
+    size_t outlen = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t start = i;
+
+        while (i < len && i - start < RUN_MAX && data[i] == 0)
+            i++;
+        if (i > start) {
+            out[outlen++] = (uint8_t)(i - start - 1);
+            continue;
+        }
+        /*
+         * A single zero byte isn't worth ending a literal run for, since
+         * that would cost a control byte for the zero and another to resume.
+         */
+        while (i < len && i - start < RUN_MAX &&
+            (data[i] != 0 || (i + 1 < len && data[i + 1] != 0)))
+            i++;
+        out[outlen++] = (uint8_t)(0x7F + (i - start));
+        memcpy(out + outlen, data + start, i - start);
+        outlen += i - start;
+    }
+
+    return outlen;
+}
+
+static void rle_xor(uint8_t *dest, const uint8_t *data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        uint8_t c = data[i++];
+
+        if (c < 0x80) {
+            dest += c + 1;
+        } else {
+            for (int j = 0; j < c - 0x7F; j++)
+                *dest++ ^= data[i++];
+        }
+    }
+}
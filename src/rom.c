@@ -0,0 +1,140 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "rom.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "instruction.h"
+#include "log.h"
+#include "memory.h"
+
+/**
+ * Tries to map the ROM in the given file, which has already been checked to
+ * be a regular file of an acceptable size.
+ *
+ * @return Whether the file was mapped.
+ */
+static bool rom_map(struct chip8_rom *rom, int fd, size_t len);
+/**
+ * Reads the ROM in the given file into a buffer.
+ *
+ * @return An error code.
+ */
+static int rom_read(struct chip8_rom *rom, int fd, const char *fname);
+
+int chip8_rom_open(struct chip8_rom *rom, const char *fname)
+{
+    struct stat stats;
+    int fd;
+    int retval = 0;
+
+    rom->data = NULL;
+    rom->len = 0;
+    rom->map = NULL;
+    rom->map_len = 0;
+
+    if ((fd = open(fname, O_RDONLY)) == -1) {
+        log_error("Could not open game file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &stats) != 0) {
+        log_error("Could not stat '%s': %s", fname, strerror(errno));
+        retval = 1;
+        goto EXIT_FILE_OPENED;
+    }
+
+    if (S_ISREG(stats.st_mode)) {
+        /* The size is known up front, so there is no point reading a big file */
+        if (stats.st_size > CHIP8_PROG_SIZE) {
+            log_error("Game file '%s' is too big", fname);
+            retval = 1;
+            goto EXIT_FILE_OPENED;
+        }
+        if (rom_map(rom, fd, stats.st_size))
+            goto EXIT_FILE_OPENED;
+    }
+    retval = rom_read(rom, fd, fname);
+
+EXIT_FILE_OPENED:
+    close(fd);
+    return retval;
+}
+
+void chip8_rom_close(struct chip8_rom *rom)
+{
+    if (rom->map)
+        munmap(rom->map, rom->map_len);
+    else
+        free((void *)rom->data);
+    rom->data = NULL;
+    rom->len = 0;
+    rom->map = NULL;
+    rom->map_len = 0;
+}
+
+static bool rom_map(struct chip8_rom *rom, int fd, size_t len)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *map;
+
+    /*
+     * Everything past the end of the file up to the end of its last page reads
+     * as zero, so as long as the whole program area fits in one page, we can
+     * promise callers that much without reading anything past the mapping.
+     * An empty file can't be mapped at all.
+     */
+    if (len == 0 || page_size < CHIP8_PROG_SIZE)
+        return false;
+    if ((map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        log_debug("Could not map game file: %s", strerror(errno));
+        return false;
+    }
+    rom->data = map;
+    rom->len = len;
+    rom->map = map;
+    rom->map_len = len;
+
+    return true;
+}
+
+static int rom_read(struct chip8_rom *rom, int fd, const char *fname)
+{
+    /* One byte more than will fit, to detect files which are too big */
+    uint8_t *data = xcalloc(CHIP8_PROG_SIZE + 1, 1);
+    size_t len = 0;
+    ssize_t n;
+
+    while (len <= CHIP8_PROG_SIZE &&
+        (n = read(fd, data + len, CHIP8_PROG_SIZE + 1 - len)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("Error reading from game file '%s': %s", fname,
+                strerror(errno));
+            free(data);
+            return 1;
+        }
+        len += n;
+    }
+    if (len > CHIP8_PROG_SIZE) {
+        log_error("Game file '%s' is too big", fname);
+        free(data);
+        return 1;
+    }
+    rom->data = data;
+    rom->len = len;
+
+    return 0;
+}
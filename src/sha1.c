@@ -0,0 +1,148 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "sha1.h"
+
+#include <ctype.h>
+#include <string.h>
+
+/**
+ * The size of a SHA-1 block, in bytes.
+ */
+#define SHA1_BLOCK_LEN 64
+
+/**
+ * Rotates the given word left by the given number of bits.
+ */
+static uint32_t rotl(uint32_t x, int n);
+/**
+ * Processes a single block of input, updating the hash state.
+ */
+static void sha1_block(uint32_t h[5], const uint8_t block[SHA1_BLOCK_LEN]);
+/**
+ * Returns the value of the given hexadecimal digit, or -1 if it isn't one.
+ */
+static int hex_value(char c);
+
+void chip8_sha1(const void *data, size_t len, uint8_t digest[CHIP8_SHA1_LEN])
+{
+    uint32_t h[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    const uint8_t *bytes = data;
+    uint8_t last[2 * SHA1_BLOCK_LEN] = {0};
+    size_t rest = len % SHA1_BLOCK_LEN;
+    size_t last_len = rest < SHA1_BLOCK_LEN - 8 ? SHA1_BLOCK_LEN
+                                                : 2 * SHA1_BLOCK_LEN;
+    uint64_t bits = (uint64_t)len * 8;
+
+    for (size_t i = 0; i + SHA1_BLOCK_LEN <= len; i += SHA1_BLOCK_LEN)
+        sha1_block(h, bytes + i);
+
+    /* The padding is a 1 bit, then zeros, then the length in bits */
+    if (rest > 0)
+        memcpy(last, bytes + len - rest, rest);
+    last[rest] = 0x80;
+    for (int i = 0; i < 8; i++)
+        last[last_len - 1 - i] = bits >> (8 * i);
+    sha1_block(h, last);
+    if (last_len > SHA1_BLOCK_LEN)
+        sha1_block(h, last + SHA1_BLOCK_LEN);
+
+    for (int i = 0; i < 5; i++) {
+        digest[4 * i] = h[i] >> 24;
+        digest[4 * i + 1] = h[i] >> 16;
+        digest[4 * i + 2] = h[i] >> 8;
+        digest[4 * i + 3] = h[i];
+    }
+}
+
+void chip8_sha1_format(
+    const uint8_t digest[CHIP8_SHA1_LEN], char hex[CHIP8_SHA1_HEX_LEN])
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < CHIP8_SHA1_LEN; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    hex[2 * CHIP8_SHA1_LEN] = '\0';
+}
+
+int chip8_sha1_parse(const char *hex, uint8_t digest[CHIP8_SHA1_LEN])
+{
+    if (strlen(hex) != 2 * CHIP8_SHA1_LEN)
+        return 1;
+    for (int i = 0; i < CHIP8_SHA1_LEN; i++) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hex_value(hex[2 * i + 1]);
+
+        if (hi < 0 || lo < 0)
+            return 1;
+        digest[i] = (hi << 4) | lo;
+    }
+
+    return 0;
+}
+
+static uint32_t rotl(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const uint8_t block[SHA1_BLOCK_LEN])
+{
+    uint32_t w[80];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 |
+            (uint32_t)block[4 * i + 1] << 16 |
+            (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k, tmp;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        tmp = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = tmp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static int hex_value(char c)
+{
+    if (isdigit((unsigned char)c))
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * Checks that the given state is valid.
+ *
+ * @return An error code.
+ */
+static int chip8_state_check(const struct chip8_state *state);
+
+void chip8_state_capture(const struct chip8 *chip, struct chip8_state *state)
+{
+    memset(state, 0, sizeof *state);
+    memcpy(state->magic, CHIP8_STATE_MAGIC, sizeof state->magic);
+    state->version = CHIP8_STATE_VERSION;
+    state->byte_order = CHIP8_STATE_BYTE_ORDER;
+    state->size = sizeof *state;
+
+    if (chip->halted)
+        state->flags |= CHIP8_STATE_HALTED;
+    if (chip->highres)
+        state->flags |= CHIP8_STATE_HIGHRES;
+    if (chip->opts.shift_quirks)
+        state->flags |= CHIP8_STATE_SHIFT_QUIRKS;
+    if (chip->opts.load_quirks)
+        state->flags |= CHIP8_STATE_LOAD_QUIRKS;
+    if (chip->opts.delay_draws)
+        state->flags |= CHIP8_STATE_DELAY_DRAWS;
+    if (chip->opts.virtual_clock)
+        state->flags |= CHIP8_STATE_VIRTUAL_CLOCK;
+
+    state->rand_state = chip->rand_state;
+    state->cycles = chip->cycles;
+    state->timer_ticks = chip->timer_ticks;
+    state->tick_cycles = chip->tick_cycles;
+    state->cycles_per_frame = chip->opts.cycles_per_frame;
+    memcpy(state->display, chip->display, sizeof state->display);
+    state->stack_depth = chip->opts.stack_depth;
+    state->stack_size = chip->stack_size;
+    memcpy(state->call_stack, chip->call_stack,
+        chip->stack_size * sizeof state->call_stack[0]);
+    state->pc = chip->pc;
+    state->reg_i = chip->reg_i;
+    state->key_states = chip->key_states;
+    state->reg_dt = chip->reg_dt;
+    state->reg_st = chip->reg_st;
+    memcpy(state->regs, chip->regs, sizeof state->regs);
+    memcpy(state->rpl, chip->rpl, sizeof state->rpl);
+    memcpy(state->mem, chip->mem, sizeof state->mem);
+}
+
+int chip8_state_restore(struct chip8 *chip, const struct chip8_state *state)
+{
+    if (chip8_state_check(state))
+        return 1;
+
+    chip->halted = state->flags & CHIP8_STATE_HALTED;
+    chip->highres = state->flags & CHIP8_STATE_HIGHRES;
+    chip->opts.shift_quirks = state->flags & CHIP8_STATE_SHIFT_QUIRKS;
+    chip->opts.load_quirks = state->flags & CHIP8_STATE_LOAD_QUIRKS;
+    chip->opts.delay_draws = state->flags & CHIP8_STATE_DELAY_DRAWS;
+
+    chip->rand_state = state->rand_state;
+    chip->cycles = state->cycles;
+    /*
+     * With the system clock, the tick count is the current time, which
+     * shouldn't go backwards just because we're restoring an old state (nor
+     * should the restored timers be charged for the time since the last
+     * update).
+     */
+    if (chip->opts.virtual_clock && (state->flags & CHIP8_STATE_VIRTUAL_CLOCK)) {
+        chip->timer_ticks = state->timer_ticks;
+        chip->tick_cycles = state->tick_cycles;
+    } else {
+        chip8_timer_sync(chip);
+    }
+    chip->opts.cycles_per_frame = state->cycles_per_frame;
+    memcpy(chip->display, state->display, sizeof chip->display);
+    chip->dirty_rows = UINT64_MAX;
+    chip->opts.stack_depth = state->stack_depth;
+    chip->stack_size = state->stack_size;
+    memcpy(chip->call_stack, state->call_stack,
+        state->stack_size * sizeof chip->call_stack[0]);
+    chip->pc = state->pc;
+    chip->reg_i = state->reg_i;
+    chip->key_states = state->key_states;
+    chip->reg_dt = state->reg_dt;
+    chip->reg_st = state->reg_st;
+    memcpy(chip->regs, state->regs, sizeof chip->regs);
+    memcpy(chip->rpl, state->rpl, sizeof chip->rpl);
+    memcpy(chip->mem, state->mem, sizeof chip->mem);
+    /* Anything we decoded or compiled before is now out of date */
+    chip8_invalidate_code(chip, 0, CHIP8_MEM_SIZE);
+
+    return 0;
+}
+
+int chip8_save_state(const struct chip8 *chip, const char *fname)
+{
+    struct chip8_state state;
+    FILE *output;
+
+    chip8_state_capture(chip, &state);
+    if (!(output = fopen(fname, "wb"))) {
+        log_error("Could not open state file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    if (fwrite(&state, sizeof state, 1, output) != 1) {
+        log_error("Could not write state file '%s': %s", fname, strerror(errno));
+        fclose(output);
+        return 1;
+    }
+    if (fclose(output) != 0) {
+        log_error("Could not write state file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+int chip8_load_state(struct chip8 *chip, const char *fname)
+{
+    int fd;
+    struct stat st;
+    const struct chip8_state *state;
+    int retval = 0;
+
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        log_error("Could not open state file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) != 0) {
+        log_error("Could not stat state file '%s': %s", fname, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof *state) {
+        log_error("State file '%s' is too small", fname);
+        close(fd);
+        return 1;
+    }
+    state = mmap(NULL, sizeof *state, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED) {
+        log_error("Could not map state file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+
+    if (chip8_state_restore(chip, state)) {
+        log_error("Could not load state file '%s'", fname);
+        retval = 1;
+    }
+
+    munmap((void *)state, sizeof *state);
+    return retval;
+}
+
+static int chip8_state_check(const struct chip8_state *state)
+{
+    if (memcmp(state->magic, CHIP8_STATE_MAGIC, sizeof state->magic) != 0) {
+        log_error("Not a Chip-8 state");
+        return 1;
+    }
+    if (state->byte_order != CHIP8_STATE_BYTE_ORDER) {
+        log_error("State was saved on a machine with a different byte order");
+        return 1;
+    }
+    if (state->version != CHIP8_STATE_VERSION) {
+        log_error("Unsupported state version %lu (expected %d)",
+            (unsigned long)state->version, CHIP8_STATE_VERSION);
+        return 1;
+    }
+    if (state->size != sizeof *state) {
+        log_error("State has the wrong size");
+        return 1;
+    }
+    if (state->stack_depth > CHIP8_STACK_MAX ||
+        state->stack_size > state->stack_depth) {
+        log_error("State has an invalid call stack");
+        return 1;
+    }
+    /* A frame with no cycles in it would stop the game from ever advancing */
+    if (state->cycles_per_frame == 0) {
+        log_error("State has an invalid frame length");
+        return 1;
+    }
+
+    return 0;
+}
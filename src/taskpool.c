@@ -0,0 +1,215 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "taskpool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The tasks belonging to a single thread.
+ *
+ * Since tasks are just indices, the queue is simply a range of indices.  The
+ * owning thread takes tasks from the front, and other threads steal them from
+ * the back.
+ */
+struct taskpool_queue {
+    /**
+     * The lock protecting the queue.
+     */
+    pthread_mutex_t lock;
+    /**
+     * The first task in the queue.
+     */
+    size_t begin;
+    /**
+     * One past the last task in the queue.
+     */
+    size_t end;
+};
+
+/**
+ * The state shared by all the threads in a pool.
+ */
+struct taskpool {
+    /**
+     * The task to run.
+     */
+    taskpool_task task;
+    /**
+     * The data to pass to the task.
+     */
+    void *data;
+    /**
+     * The number of threads (and queues).
+     */
+    unsigned n_threads;
+    /**
+     * The task queue of each thread.
+     */
+    struct taskpool_queue *queues;
+};
+
+/**
+ * A single thread in the pool.
+ */
+struct taskpool_worker {
+    /**
+     * The pool to which the thread belongs.
+     */
+    struct taskpool *pool;
+    /**
+     * The index of the thread's own queue.
+     */
+    unsigned id;
+    /**
+     * The thread itself (unused for the calling thread).
+     */
+    pthread_t thread;
+};
+
+/**
+ * Takes the next task from the given thread's own queue.
+ *
+ * @return Whether there was a task to take.
+ */
+static bool taskpool_take(struct taskpool *pool, unsigned id, size_t *task);
+/**
+ * Steals half of the remaining tasks of some other thread, moving all but
+ * the first of them into the given thread's queue.
+ *
+ * @return Whether there was anything to steal.
+ */
+static bool taskpool_steal(struct taskpool *pool, unsigned id, size_t *task);
+/**
+ * Runs tasks until there are none left in any queue.
+ */
+static void *taskpool_work(void *worker);
+
+unsigned taskpool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (unsigned)n : 1;
+}
+
+int taskpool_run(
+    unsigned n_threads, size_t n_tasks, taskpool_task task, void *data)
+{
+    struct taskpool pool;
+    struct taskpool_worker *workers;
+    unsigned started;
+    int retval = 0;
+
+    if (n_tasks == 0)
+        return 0;
+    if (n_threads == 0)
+        n_threads = 1;
+    if (n_threads > n_tasks)
+        n_threads = n_tasks;
+
+    pool.task = task;
+    pool.data = data;
+    pool.n_threads = n_threads;
+    pool.queues = xcalloc(n_threads, sizeof *pool.queues);
+    workers = xcalloc(n_threads, sizeof *workers);
+    for (unsigned i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].begin = n_tasks * i / n_threads;
+        pool.queues[i].end = n_tasks * (i + 1) / n_threads;
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    /* The calling thread is worker 0, so we only need to start the rest */
+    for (started = 1; started < n_threads; started++) {
+        int err = pthread_create(
+            &workers[started].thread, NULL, taskpool_work, &workers[started]);
+        if (err != 0) {
+            /*
+             * This isn't fatal, since the threads we do have will steal the
+             * tasks which were meant for the missing ones.
+             */
+            log_warning("Could not start worker thread: %s", strerror(err));
+            break;
+        }
+    }
+    taskpool_work(&workers[0]);
+    for (unsigned i = 1; i < started; i++)
+        if (pthread_join(workers[i].thread, NULL) != 0) {
+            log_error("Could not join worker thread");
+            retval = 1;
+        }
+
+    for (unsigned i = 0; i < n_threads; i++)
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    free(workers);
+    free(pool.queues);
+    return retval;
+}
+
+static bool taskpool_take(struct taskpool *pool, unsigned id, size_t *task)
+{
+    struct taskpool_queue *queue = &pool->queues[id];
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->begin < queue->end) {
+        *task = queue->begin++;
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool taskpool_steal(struct taskpool *pool, unsigned id, size_t *task)
+{
+    for (unsigned i = 1; i < pool->n_threads; i++) {
+        struct taskpool_queue *victim = &pool->queues[(id + i) % pool->n_threads];
+        struct taskpool_queue *own = &pool->queues[id];
+        size_t begin, end;
+
+        pthread_mutex_lock(&victim->lock);
+        end = victim->end;
+        begin = end - (victim->end - victim->begin + 1) / 2;
+        victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+        if (begin == end)
+            continue;
+
+        *task = begin;
+        pthread_mutex_lock(&own->lock);
+        own->begin = begin + 1;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    return false;
+}
+
+static void *taskpool_work(void *worker)
+{
+    struct taskpool_worker *self = worker;
+    struct taskpool *pool = self->pool;
+    size_t task;
+
+    /*
+     * Once there's nothing left to steal, every remaining task is already
+     * owned by a thread which will run it, so we can stop.
+     */
+    while (taskpool_take(pool, self->id, &task) ||
+        taskpool_steal(pool, self->id, &task))
+        pool->task(task, pool->data);
+
+    return NULL;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The number of records in each block of the ring.
+ */
+#define TRACE_BLOCK_LEN 4096
+/**
+ * The number of blocks in the ring.
+ */
+#define TRACE_BLOCKS 16
+
+struct chip8_trace {
+    /**
+     * The name of the trace file (for error messages).
+     */
+    char *fname;
+    FILE *output;
+    /**
+     * The records, as a ring of blocks.
+     */
+    struct chip8_trace_record *records;
+    /**
+     * The number of records in each block (only meaningful for blocks which
+     * have been handed over to the writer).
+     */
+    size_t lens[TRACE_BLOCKS];
+    /**
+     * The number of records in the block currently being filled.
+     *
+     * This is only used by the recording thread, so it needs no locking.
+     */
+    size_t fill;
+    /**
+     * The lock protecting everything below.
+     */
+    pthread_mutex_t lock;
+    /**
+     * Signaled when a block is handed over to the writer.
+     */
+    pthread_cond_t filled;
+    /**
+     * Signaled when the writer is done with a block.
+     */
+    pthread_cond_t drained;
+    /**
+     * The number of blocks handed over to the writer so far.
+     *
+     * The block currently being filled is `filled_blocks % TRACE_BLOCKS`.
+     */
+    size_t filled_blocks;
+    /**
+     * The number of blocks written out so far.
+     */
+    size_t written_blocks;
+    /**
+     * Whether the trace is being closed, so that the writer should exit once
+     * it has written all the blocks handed to it.
+     */
+    bool closing;
+    /**
+     * Whether there was an error writing to the file.
+     */
+    bool error;
+    pthread_t writer;
+};
+
+/**
+ * Hands the current block over to the writer, waiting if necessary until
+ * there is a free block to take its place.
+ */
+static void trace_hand_over(struct chip8_trace *trace);
+/**
+ * The body of the writer thread.
+ */
+static void *trace_writer(void *data);
+
+struct chip8_trace *chip8_trace_open(const char *fname, uint32_t flags)
+{
+    struct chip8_trace *trace = xcalloc(1, sizeof *trace);
+    struct chip8_trace_header header;
+    int err;
+
+    trace->fname = xstrdup(fname);
+    if (!(trace->output = fopen(fname, "wb"))) {
+        log_error("Could not open trace file '%s': %s", fname, strerror(errno));
+        goto ERROR_TRACE_CREATED;
+    }
+    memcpy(header.magic, CHIP8_TRACE_MAGIC, sizeof header.magic);
+    header.version = CHIP8_TRACE_VERSION;
+    header.byte_order = CHIP8_TRACE_BYTE_ORDER;
+    header.record_size = sizeof(struct chip8_trace_record);
+    header.flags = flags;
+    if (fwrite(&header, sizeof header, 1, trace->output) != 1) {
+        log_error("Could not write trace file '%s': %s", fname, strerror(errno));
+        goto ERROR_FILE_OPENED;
+    }
+
+    trace->records =
+        xcalloc(TRACE_BLOCKS * TRACE_BLOCK_LEN, sizeof *trace->records);
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->filled, NULL);
+    pthread_cond_init(&trace->drained, NULL);
+    if ((err = pthread_create(&trace->writer, NULL, trace_writer, trace))) {
+        log_error("Could not start trace writer: %s", strerror(err));
+        goto ERROR_SYNC_CREATED;
+    }
+
+    return trace;
+
+ERROR_SYNC_CREATED:
+    pthread_cond_destroy(&trace->drained);
+    pthread_cond_destroy(&trace->filled);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->records);
+ERROR_FILE_OPENED:
+    fclose(trace->output);
+ERROR_TRACE_CREATED:
+    free(trace->fname);
+    free(trace);
+    return NULL;
+}
+
+int chip8_trace_close(struct chip8_trace *trace)
+{
+    int retval;
+
+    if (!trace)
+        return 0;
+    if (trace->fill > 0)
+        trace_hand_over(trace);
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = true;
+    pthread_cond_signal(&trace->filled);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+
+    retval = trace->error;
+    if (fclose(trace->output) != 0) {
+        log_error("Could not write trace file '%s': %s", trace->fname,
+            strerror(errno));
+        retval = 1;
+    }
+    pthread_cond_destroy(&trace->drained);
+    pthread_cond_destroy(&trace->filled);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->records);
+    free(trace->fname);
+    free(trace);
+    return retval;
+}
+
+void chip8_trace_record(
+    struct chip8_trace *trace, const struct chip8_trace_record *record)
+{
+    /*
+     * The recording thread is the only one which changes filled_blocks, so
+     * it can read it without taking the lock.
+     */
+    size_t block = trace->filled_blocks % TRACE_BLOCKS;
+
+    trace->records[block * TRACE_BLOCK_LEN + trace->fill++] = *record;
+    if (trace->fill == TRACE_BLOCK_LEN)
+        trace_hand_over(trace);
+}
+
+int chip8_trace_read_header(
+    FILE *input, const char *fname, struct chip8_trace_header *header)
+{
+    if (fread(header, sizeof *header, 1, input) != 1 ||
+        memcmp(header->magic, CHIP8_TRACE_MAGIC, sizeof header->magic) != 0) {
+        log_error("'%s' is not a trace file", fname);
+        return 1;
+    }
+    if (header->byte_order != CHIP8_TRACE_BYTE_ORDER) {
+        log_error("Trace '%s' was recorded on a machine with a different byte "
+                  "order",
+            fname);
+        return 1;
+    }
+    if (header->version != CHIP8_TRACE_VERSION) {
+        log_error("Unsupported trace version %lu (expected %d)",
+            (unsigned long)header->version, CHIP8_TRACE_VERSION);
+        return 1;
+    }
+    if (header->record_size != sizeof(struct chip8_trace_record)) {
+        log_error("Trace '%s' has the wrong record size", fname);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void trace_hand_over(struct chip8_trace *trace)
+{
+    pthread_mutex_lock(&trace->lock);
+    trace->lens[trace->filled_blocks % TRACE_BLOCKS] = trace->fill;
+    trace->filled_blocks++;
+    pthread_cond_signal(&trace->filled);
+    /* The next block must not still be waiting to be written */
+    while (trace->filled_blocks - trace->written_blocks == TRACE_BLOCKS)
+        pthread_cond_wait(&trace->drained, &trace->lock);
+    pthread_mutex_unlock(&trace->lock);
+    trace->fill = 0;
+}
+
+static void *trace_writer(void *data)
+{
+    struct chip8_trace *trace = data;
+
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        size_t block;
+
+        while (trace->written_blocks == trace->filled_blocks && !trace->closing)
+            pthread_cond_wait(&trace->filled, &trace->lock);
+        if (trace->written_blocks == trace->filled_blocks)
+            break;
+        block = trace->written_blocks % TRACE_BLOCKS;
+
+        /* The block is ours until we say otherwise, so we can let go */
+        pthread_mutex_unlock(&trace->lock);
+        if (!trace->error &&
+            fwrite(trace->records + block * TRACE_BLOCK_LEN,
+                sizeof *trace->records, trace->lens[block],
+                trace->output) != trace->lens[block]) {
+            log_error("Could not write trace file '%s': %s", trace->fname,
+                strerror(errno));
+            trace->error = true;
+        }
+        pthread_mutex_lock(&trace->lock);
+
+        trace->written_blocks++;
+        pthread_cond_signal(&trace->drained);
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    return NULL;
+}